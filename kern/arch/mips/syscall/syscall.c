@@ -125,10 +125,42 @@ syscall(struct trapframe *tf)
 			err = sys_write((int)tf->tf_a0, (void *)tf->tf_a1, (size_t)tf->tf_a2, &retval);
 			break;
 
+		case SYS_pread:
+			err = sys_pread((int)tf->tf_a0, (void *)tf->tf_a1, (size_t)tf->tf_a2, &retval, tf);
+			break;
+
+		case SYS_pwrite:
+			err = sys_pwrite((int)tf->tf_a0, (void *)tf->tf_a1, (size_t)tf->tf_a2, &retval, tf);
+			break;
+
+		case SYS_readv:
+			err = sys_readv((int)tf->tf_a0, (const struct iovec *)tf->tf_a1, (int)tf->tf_a2, &retval);
+			break;
+
+		case SYS_writev:
+			err = sys_writev((int)tf->tf_a0, (const struct iovec *)tf->tf_a1, (int)tf->tf_a2, &retval);
+			break;
+
+		case SYS_preadv:
+			err = sys_preadv((int)tf->tf_a0, (const struct iovec *)tf->tf_a1, (int)tf->tf_a2, &retval, tf);
+			break;
+
+		case SYS_pwritev:
+			err = sys_pwritev((int)tf->tf_a0, (const struct iovec *)tf->tf_a1, (int)tf->tf_a2, &retval, tf);
+			break;
+
 		case SYS_lseek:
 			err = sys_lseek((int)tf->tf_a0, &retval, tf);
 			break;
 
+		case SYS_getrlimit:
+			err = sys_getrlimit((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+			break;
+
+		case SYS_setrlimit:
+			err = sys_setrlimit((int)tf->tf_a0, (const_userptr_t)tf->tf_a1);
+			break;
+
 		case SYS_dup2:
 			err = sys_dup2((int)tf->tf_a0, (int)tf->tf_a1, &retval);
 			break;
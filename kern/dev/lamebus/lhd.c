@@ -37,6 +37,7 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +61,31 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/*
+ * Scheduling. Requests are normally serviced in C-LOOK order, but one
+ * that has waited more than this many disk revolutions goes next
+ * regardless. Reads get a shorter deadline because somebody is
+ * usually waiting for them; writes are mostly from the syncer.
+ */
+#define LHD_READ_REVS   30
+#define LHD_WRITE_REVS  300
+#define LHD_DEFAULT_RPM 3600
+
+/*
+ * A request waiting for (or using) the disk. One that has to queue
+ * gets its own semaphore to wait on, so handing the disk over wakes
+ * only the request that gets it. If the semaphore can't be made, the
+ * request waits on the shared lh_cv instead, which works the same,
+ * just less efficiently.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* first sector */
+	uint32_t lr_nsect;		/* number of sectors */
+	uint64_t lr_deadline;		/* when it must go (nsecs) */
+	struct lhd_request *lr_next;	/* queue linkage */
+	struct semaphore *lr_turn;	/* V'd when we get the disk */
+};
+
 /*
  * Shortcut for reading a register.
  */
@@ -180,88 +206,296 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Start an operation on one sector. The data for a write must already
+ * be in the on-card buffer.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh, uint32_t sector, uint32_t statval)
+{
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Wait until the interrupt handler tells us the current operation is
+ * done, and return its result.
  */
 static
 int
-lhd_io(struct device *d, struct uio *uio)
+lhd_wait(struct lhd_softc *lh)
 {
-	struct lhd_softc *lh = d->d_data;
+	P(lh->lh_done);
+	return lh->lh_result;
+}
 
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+/*
+ * Read LEN sectors starting at SECTOR. While the card reads each
+ * sector after the first, the previous one is copied out of the
+ * staging buffer to wherever the uio says.
+ */
+static
+int
+lhd_read(struct lhd_softc *lh, uint32_t sector, uint32_t len,
+	 struct uio *uio)
+{
 	uint32_t i;
-	uint32_t statval = LHD_WORKING;
 	int result;
 
-	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
-		return EINVAL;
-	}
+	lhd_start(lh, sector, LHD_WORKING);
+	for (i=0; i<len; i++) {
+		result = lhd_wait(lh);
+		if (result) {
+			return result;
+		}
 
-	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
-		return EINVAL;
+		/* Empty the card's buffer and get it going again. */
+		membar_load_load();
+		memcpy(lh->lh_stage, lh->lh_buf, LHD_SECTSIZE);
+		if (i+1 < len) {
+			lhd_start(lh, sector+i+1, LHD_WORKING);
+		}
+
+		result = uiomove(lh->lh_stage, LHD_SECTSIZE, uio);
+		if (result) {
+			if (i+1 < len) {
+				/* Don't leave the next read hanging. */
+				lhd_wait(lh);
+			}
+			return result;
+		}
 	}
+	return 0;
+}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+/*
+ * Write LEN sectors starting at SECTOR. While the card writes each
+ * sector but the last, the next one is copied from wherever the uio
+ * says into the staging buffer.
+ */
+static
+int
+lhd_write(struct lhd_softc *lh, uint32_t sector, uint32_t len,
+	  struct uio *uio)
+{
+	uint32_t i;
+	int result, result2;
+
+	result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	membar_store_store();
+	if (result) {
+		return result;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
+		lhd_start(lh, sector+i, LHD_WORKING | LHD_ISWRITE);
+
+		result = 0;
+		if (i+1 < len) {
+			result = uiomove(lh->lh_stage, LHD_SECTSIZE, uio);
+		}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+		result2 = lhd_wait(lh);
+		if (result2) {
+			return result2;
+		}
+		if (result) {
+			return result;
+		}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (i+1 < len) {
+			memcpy(lh->lh_buf, lh->lh_stage, LHD_SECTSIZE);
 			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
 		}
+	}
+	return 0;
+}
+
+/*
+ * Current time in nanoseconds, for deadlines.
+ */
+static
+uint64_t
+lhd_now(void)
+{
+	struct timespec ts;
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Choose the next request to service and take it off the queue.
+ * Anything past its deadline goes first, earliest deadline first;
+ * otherwise it's C-LOOK: the lowest request at or past where the head
+ * was left, or, if there isn't one, the lowest request overall. Call
+ * with lh_lock held.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request *r, *best, *lowest, **rp;
+	uint64_t now;
 
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
+	if (lh->lh_queue == NULL) {
+		return NULL;
+	}
 
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+	now = lhd_now();
+	best = lowest = NULL;
+	for (r = lh->lh_queue; r != NULL; r = r->lr_next) {
+		if (r->lr_deadline <= now &&
+		    (best == NULL || r->lr_deadline < best->lr_deadline)) {
+			best = r;
+		}
+	}
+	if (best == NULL) {
+		for (r = lh->lh_queue; r != NULL; r = r->lr_next) {
+			if (lowest == NULL || r->lr_sector < lowest->lr_sector) {
+				lowest = r;
+			}
+			if (r->lr_sector >= lh->lh_headpos &&
+			    (best == NULL || r->lr_sector < best->lr_sector)) {
+				best = r;
+			}
+		}
+		if (best == NULL) {
+			best = lowest;
+		}
+	}
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	for (rp = &lh->lh_queue; *rp != best; rp = &(*rp)->lr_next) {
+		KASSERT(*rp != NULL);
+	}
+	*rp = best->lr_next;
+	best->lr_next = NULL;
+	return best;
+}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+/*
+ * Wait until the scheduler gives us the disk.
+ */
+static
+void
+lhd_acquire(struct lhd_softc *lh, struct lhd_request *req)
+{
+	lock_acquire(lh->lh_lock);
+	if (lh->lh_current == NULL) {
+		/* Idle; go right ahead. */
+		lh->lh_current = req;
+		lock_release(lh->lh_lock);
+		return;
+	}
+	req->lr_turn = sem_create("lhd-turn", 0);
+	req->lr_next = lh->lh_queue;
+	lh->lh_queue = req;
+	if (req->lr_turn == NULL) {
+		/* Out of memory; share the cv */
+		while (lh->lh_current != req) {
+			cv_wait(lh->lh_cv, lh->lh_lock);
 		}
+		lock_release(lh->lh_lock);
+		return;
+	}
+	lock_release(lh->lh_lock);
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	/*
+	 * lhd_release makes us current before it wakes us, so there's
+	 * nothing to recheck. A V that comes before we get here is
+	 * simply counted.
+	 */
+	P(req->lr_turn);
+	KASSERT(lh->lh_current == req);
+	sem_destroy(req->lr_turn);
+	req->lr_turn = NULL;
+}
 
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+/*
+ * Give up the disk and hand it to whoever should go next. Only that
+ * request is woken; the rest keep sleeping.
+ */
+static
+void
+lhd_release(struct lhd_softc *lh, struct lhd_request *req)
+{
+	lock_acquire(lh->lh_lock);
+	KASSERT(lh->lh_current == req);
+	lh->lh_headpos = req->lr_sector + req->lr_nsect;
+	lh->lh_current = lhd_pick(lh);
+	if (lh->lh_current != NULL) {
+		if (lh->lh_current->lr_turn != NULL) {
+			V(lh->lh_current->lr_turn);
+		}
+		else {
+			cv_broadcast(lh->lh_cv, lh->lh_lock);
 		}
 	}
+	lock_release(lh->lh_lock);
+}
 
-	return 0;
+/*
+ * I/O function (for both reads and writes)
+ *
+ * The card only does one sector at a time, but we keep the device for
+ * the whole request rather than competing for it sector by sector, and
+ * copy each sector to or from the caller while the card works on the
+ * next (or previous) one. Which waiting request gets the device next
+ * is up to lhd_pick.
+ */
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_request req;
+
+	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
+	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
+	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
+	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+	uint32_t revs;
+	int result;
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (sectoff != 0 || lenoff != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	if (sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
+		return EINVAL;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	revs = uio->uio_rw == UIO_WRITE ? LHD_WRITE_REVS : LHD_READ_REVS;
+	req.lr_sector = sector;
+	req.lr_nsect = len;
+	req.lr_deadline = lhd_now() + revs * lh->lh_revtime;
+	req.lr_next = NULL;
+	req.lr_turn = NULL;
+
+	/* Wait until it's our turn. */
+	lhd_acquire(lh, &req);
+
+	if (uio->uio_rw == UIO_WRITE) {
+		result = lhd_write(lh, sector, len, uio);
+	}
+	else {
+		result = lhd_read(lh, sector, len, uio);
+	}
+
+	/* Let the next request go ahead. */
+	lhd_release(lh, &req);
+
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -277,6 +511,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	uint32_t rpm;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,18 +519,38 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Get a staging buffer to copy through. */
+	lh->lh_lock = NULL;
+	lh->lh_cv = NULL;
+	lh->lh_stage = kmalloc(LHD_SECTSIZE);
+	if (lh->lh_stage == NULL) {
 		return ENOMEM;
 	}
+
+	/* Create the synchronization primitives. */
+	lh->lh_lock = lock_create("lhd-lock");
+	if (lh->lh_lock == NULL) {
+		goto fail;
+	}
+	lh->lh_cv = cv_create("lhd-queue");
+	if (lh->lh_cv == NULL) {
+		goto fail;
+	}
 	lh->lh_done = sem_create("lhd-done", 0);
 	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+		goto fail;
 	}
 
+	/* Set up the request queue. */
+	lh->lh_queue = NULL;
+	lh->lh_current = NULL;
+	lh->lh_headpos = 0;
+	rpm = bus_read_register(lh->lh_busdata, lh->lh_buspos, LHD_REG_RPM);
+	if (rpm == 0) {
+		rpm = LHD_DEFAULT_RPM;
+	}
+	lh->lh_revtime = 60000000000ULL / rpm;
+
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
@@ -305,4 +560,17 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 
 	/* Add the VFS device structure to the VFS device list. */
 	return vfs_adddev(name, &lh->lh_dev, 1);
+
+ fail:
+	if (lh->lh_cv != NULL) {
+		cv_destroy(lh->lh_cv);
+		lh->lh_cv = NULL;
+	}
+	if (lh->lh_lock != NULL) {
+		lock_destroy(lh->lh_lock);
+		lh->lh_lock = NULL;
+	}
+	kfree(lh->lh_stage);
+	lh->lh_stage = NULL;
+	return ENOMEM;
 }
@@ -51,9 +51,17 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
+	void *lh_stage;			/* Staging buffer in memory */
 	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct semaphore *lh_done;	/* Operation completion */
+
+	/* Request scheduling (see lhd_pick) */
+	struct lock *lh_lock;		/* protects the following */
+	struct cv *lh_cv;		/* for waiting for our turn */
+	struct lhd_request *lh_queue;	/* waiting requests */
+	struct lhd_request *lh_current;	/* request using the disk */
+	uint32_t lh_headpos;		/* where the last request ended */
+	uint64_t lh_revtime;		/* nsecs per revolution */
 
 	struct device lh_dev;		/* VFS device structure */
 };
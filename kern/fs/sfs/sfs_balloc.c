@@ -30,62 +30,156 @@
 /*
  * SFS filesystem
  *
- * Block allocation.
+ * Block and inode allocation.
  */
 #include <types.h>
 #include <lib.h>
+#include <synch.h>
 #include <bitmap.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. The zeroed block is left in the buffer
+ * cache, since whoever allocated it is probably about to use it.
  */
-static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
+
+	result = buffer_get(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	result = buffer_modified(buf);
+	buffer_release(buf);
+	if (result) {
+		/* The block is going back on the free list; forget it */
+		buffer_drop(&sfs->sfs_absfs, block, SFS_BLOCKSIZE);
+	}
+	return result;
+}
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+/*
+ * Note that the freemap bit for DISKBLOCK has changed, so the freemap
+ * block holding it needs to be written. Call with the freemap locked.
+ */
+static
+void
+sfs_freemap_dirty(struct sfs_fs *sfs, daddr_t diskblock)
+{
+	unsigned fmblock = diskblock / SFS_BITSPERBLOCK;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (!bitmap_isset(sfs->sfs_freemapdirtyblocks, fmblock)) {
+		bitmap_mark(sfs->sfs_freemapdirtyblocks, fmblock);
+	}
+	sfs->sfs_freemapdirty = true;
 }
 
 /*
- * Allocate a block.
+ * Adjust the free block count of the group DISKBLOCK is in by DELTA.
+ * Call with the freemap locked.
+ */
+static
+void
+sfs_groupfree_adjust(struct sfs_fs *sfs, daddr_t diskblock, int delta)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	unsigned group = diskblock / sb->sb_groupblocks;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(group < sb->sb_ngroups);
+
+	sb->sb_groupfree[group] += delta;
+	sfs->sfs_superdirty = true;
+}
+
+/*
+ * Allocate a block, as close after GOAL as we can. A GOAL of 0 means
+ * the caller has no preference.
+ *
+ * If CLEAR is set the block is zeroed. Callers that are about to fill
+ * in the block themselves (file data writes) pass false and take on
+ * the job of making sure none of the block's old contents ever reach
+ * a reader.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, bool clear, daddr_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	/*
+	 * Take the first free block at or after GOAL, wrapping around
+	 * to the start of the volume. Searching forward keeps a file
+	 * that grows at the end laid out in ascending order, which is
+	 * what sequential reads and sfs_io's request coalescing want.
+	 */
+	if (goal >= sfs->sfs_sb.sb_nblocks) {
+		goal = 0;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_dirty(sfs, *diskblock);
+	sfs_groupfree_adjust(sfs, *diskblock, -1);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
-	/* Clear block before returning it */
+	if (!clear) {
+		return 0;
+	}
+
+	/* Clear block before returning it (the block is ours; no lock) */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_freemap_dirty(sfs, *diskblock);
+		sfs_groupfree_adjust(sfs, *diskblock, 1);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
 /*
- * Free a block.
+ * Free a block. With a journal it stays allocated until the running
+ * transaction commits (see sfs_journal.c).
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	/* Any cached contents are garbage now; don't write them. */
+	buffer_drop(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE);
+
+	if (!sfs_jfree(sfs, diskblock)) {
+		sfs_freemap_release(sfs, diskblock);
+	}
+}
+
+/*
+ * Mark a block free in the freemap.
+ */
+void
+sfs_freemap_release(struct sfs_fs *sfs, daddr_t diskblock)
+{
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_dirty(sfs, diskblock);
+	sfs_groupfree_adjust(sfs, diskblock, 1);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +188,283 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
+}
+
+
+/*
+ * Note that the inode bitmap bit for INO has changed. Call with the
+ * freemap locked.
+ */
+static
+void
+sfs_inodemap_dirty(struct sfs_fs *sfs, uint32_t ino)
+{
+	unsigned imblock = ino / SFS_BITSPERBLOCK;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (!bitmap_isset(sfs->sfs_inodemapdirtyblocks, imblock)) {
+		bitmap_mark(sfs->sfs_inodemapdirtyblocks, imblock);
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Adjust the free inode count of the group INO is in by DELTA (packed
+ * format). Call with the freemap locked.
+ */
+static
+void
+sfs_groupifree_adjust(struct sfs_fs *sfs, uint32_t ino, int delta)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	unsigned group = ino / sb->sb_groupinodes;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(group < sb->sb_ngroups);
+
+	sb->sb_groupifree[group] += delta;
+	sfs->sfs_superdirty = true;
 }
 
+/*
+ * Allocate an inode, as close after GOAL as we can, and clear it.
+ *
+ * In the original format each inode is a block of its own, numbered
+ * by its block number, so this is sfs_balloc. In the packed format
+ * it's a slot in the inode table, found in the inode bitmap; putting
+ * it near GOAL puts it in the same table block as its neighbors, so
+ * looking at all the files in a directory reads few blocks.
+ */
+int
+sfs_ialloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *ino)
+{
+	struct buf *buf;
+	daddr_t block;
+	size_t offset, size;
+	int result;
+
+	if (sfs->sfs_sb.sb_version == SFS_VERSION_ORIG) {
+		return sfs_balloc(sfs, goal, true, ino);
+	}
+
+	if (goal >= sfs->sfs_sb.sb_ninodes) {
+		goal = 0;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_near(sfs->sfs_inodemap, goal, ino);
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+	sfs_inodemap_dirty(sfs, *ino);
+	sfs_groupifree_adjust(sfs, *ino, -1);
+	lock_release(sfs->sfs_freemaplock);
+
+	if (*ino >= sfs->sfs_sb.sb_ninodes) {
+		panic("sfs: %s: ialloc: invalid inode %u\n",
+		      sfs->sfs_sb.sb_volname, *ino);
+	}
+
+	/* Clear the slot; the rest of the block belongs to other inodes */
+	sfs_inodeloc(sfs, *ino, &block, &offset, &size);
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, &buf);
+	if (result == 0) {
+		bzero((char *)buffer_map(buf) + offset, size);
+		result = sfs_jmodified(sfs, buf, block);
+		buffer_release(buf);
+	}
+	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
+		bitmap_unmark(sfs->sfs_inodemap, *ino);
+		sfs_inodemap_dirty(sfs, *ino);
+		sfs_groupifree_adjust(sfs, *ino, 1);
+		lock_release(sfs->sfs_freemaplock);
+	}
+	return result;
+}
+
+/*
+ * Free an inode.
+ */
+void
+sfs_ifree(struct sfs_fs *sfs, uint32_t ino)
+{
+	if (sfs->sfs_sb.sb_version == SFS_VERSION_ORIG) {
+		sfs_bfree(sfs, ino);
+		return;
+	}
+
+	/* Other inodes share the block, so leave it in the cache */
+	lock_acquire(sfs->sfs_freemaplock);
+	bitmap_unmark(sfs->sfs_inodemap, ino);
+	sfs_inodemap_dirty(sfs, ino);
+	sfs_groupifree_adjust(sfs, ino, 1);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Check if an inode is in use.
+ */
+int
+sfs_iused(struct sfs_fs *sfs, uint32_t ino)
+{
+	int ret;
+
+	if (sfs->sfs_sb.sb_version == SFS_VERSION_ORIG) {
+		return sfs_bused(sfs, ino);
+	}
+
+	if (ino >= sfs->sfs_sb.sb_ninodes) {
+		panic("sfs: %s: sfs_iused called on out of range inode %u\n",
+		      sfs->sfs_sb.sb_volname, ino);
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_inodemap, ino);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
+}
+
+
+/*
+ * Count the clear bits in MAP from START up to but not including END.
+ */
+static
+uint32_t
+sfs_countfree(struct bitmap *map, uint32_t start, uint32_t end)
+{
+	uint32_t i, count = 0;
+
+	for (i=start; i<end; i++) {
+		if (!bitmap_isset(map, i)) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/*
+ * Set up the allocation group counts at mount time, once the bitmaps
+ * have been read. A volume without groups gets them now; one whose
+ * counts don't match its bitmaps (because it wasn't unmounted
+ * cleanly, say) gets them fixed. Either way the superblock is marked
+ * dirty so the next sync writes it.
+ */
+void
+sfs_groups_setup(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	uint32_t group, start, end, count;
+	bool changed = false;
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	if (sb->sb_ngroups == 0) {
+		sb->sb_ngroups = SFS_NGROUPS(sb->sb_nblocks);
+		sb->sb_groupblocks = SFS_GROUPBLOCKS(sb->sb_nblocks);
+		if (sb->sb_version == SFS_VERSION_PACKED) {
+			sb->sb_groupinodes = SFS_GROUPINODES(sb->sb_ninodes,
+							     sb->sb_ngroups);
+		}
+		kprintf("sfs: %s: Adding %u allocation groups\n",
+			sb->sb_volname, sb->sb_ngroups);
+		changed = true;
+	}
+
+	for (group=0; group<sb->sb_ngroups; group++) {
+		start = group * sb->sb_groupblocks;
+		end = start + sb->sb_groupblocks;
+		if (end > sb->sb_nblocks) {
+			end = sb->sb_nblocks;
+		}
+		count = sfs_countfree(sfs->sfs_freemap, start, end);
+		if (sb->sb_groupfree[group] != count) {
+			sb->sb_groupfree[group] = count;
+			changed = true;
+		}
+
+		if (sfs->sfs_inodemap == NULL) {
+			continue;
+		}
+		start = group * sb->sb_groupinodes;
+		end = start + sb->sb_groupinodes;
+		if (end > sb->sb_ninodes) {
+			end = sb->sb_ninodes;
+		}
+		count = start < end ?
+			sfs_countfree(sfs->sfs_inodemap, start, end) : 0;
+		if (sb->sb_groupifree[group] != count) {
+			sb->sb_groupifree[group] = count;
+			changed = true;
+		}
+	}
+
+	if (changed) {
+		sfs->sfs_superdirty = true;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Choose an inode number to pass to sfs_ialloc as the goal for a new
+ * directory. Files go near their parent directory, but putting every
+ * directory there too would pile the whole volume into one group, so
+ * directories go to the group with the most free inodes (or, in the
+ * original format where inodes are blocks, the most free blocks).
+ * Ties go to the group with more free blocks.
+ */
+uint32_t
+sfs_dirgoal(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	uint32_t group, best = 0;
+	uint32_t goal;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (group=1; group<sb->sb_ngroups; group++) {
+		if (sb->sb_groupifree[group] < sb->sb_groupifree[best]) {
+			continue;
+		}
+		if (sb->sb_groupifree[group] > sb->sb_groupifree[best] ||
+		    sb->sb_groupfree[group] > sb->sb_groupfree[best]) {
+			best = group;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	if (sb->sb_version == SFS_VERSION_ORIG) {
+		goal = best * sb->sb_groupblocks;
+	}
+	else {
+		goal = best * sb->sb_groupinodes;
+	}
+	return goal;
+}
+
+/*
+ * Where to start looking for the data blocks of inode INO: the start
+ * of its group. (In the original format inodes are blocks, and the
+ * block after the inode is better.)
+ */
+daddr_t
+sfs_datagoal(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+
+	if (sb->sb_version == SFS_VERSION_ORIG) {
+		return ino + 1;
+	}
+	return (ino / sb->sb_groupinodes) * sb->sb_groupblocks;
+}
@@ -35,39 +35,228 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * File blocks mapped through one index block at each level of
+ * indirection: an indirect block maps SFS_DBPERIDB blocks, a double
+ * indirect block SFS_DBPERIDB indirect blocks' worth, and so on.
+ */
+#define SFS_RANGE1	SFS_DBPERIDB
+#define SFS_RANGE2	(SFS_RANGE1 * SFS_DBPERIDB)
+#define SFS_RANGE3	(SFS_RANGE2 * SFS_DBPERIDB)
+
+/*
+ * Number of file blocks mapped by an index block at level INDIRECTION
+ * (1, 2, or 3).
+ */
+static
+uint32_t
+sfs_ibrange(int indirection)
+{
+	switch (indirection) {
+	    case 1: return SFS_RANGE1;
+	    case 2: return SFS_RANGE2;
+	    case 3: return SFS_RANGE3;
+	}
+	panic("sfs: bad indirection level %d\n", indirection);
+	return 0;
+}
+
+/*
+ * For a file block past the direct blocks, figure out which index
+ * block pointer in the inode leads to it, how many levels of
+ * indirection that is, and the offset of the block in the range that
+ * pointer maps.
+ */
+static
+int
+sfs_bmap_locate(struct sfs_vnode *sv, uint32_t fileblock,
+		uint32_t **slot, int *indirection, uint32_t *offset)
+{
+	KASSERT(fileblock >= SFS_NDIRECT);
+	fileblock -= SFS_NDIRECT;
+
+	if (fileblock < SFS_RANGE1) {
+		*slot = &sv->sv_i.sfi_indirect;
+		*indirection = 1;
+		*offset = fileblock;
+		return 0;
+	}
+	fileblock -= SFS_RANGE1;
+
+	if (fileblock < SFS_RANGE2) {
+		*slot = &sv->sv_i.sfi_dindirect;
+		*indirection = 2;
+		*offset = fileblock;
+		return 0;
+	}
+	fileblock -= SFS_RANGE2;
+
+	if (fileblock < SFS_RANGE3) {
+		*slot = &sv->sv_i.sfi_tindirect;
+		*indirection = 3;
+		*offset = fileblock;
+		return 0;
+	}
+
+	/* Past the end of the triple indirect block; too big. */
+	return EFBIG;
+}
+
+/*
+ * Leaf index block cache.
+ *
+ * Each vnode keeps a copy of the entries of the last level-1 index
+ * block it went through, so a run of lookups in the same part of a
+ * big file (the usual case) doesn't walk the index tree and lock a
+ * buffer for every block. The copy is never dirty: sfs_bmap updates
+ * it together with the buffer when it allocates, and the buffer cache
+ * still owns writing the index block back. Truncation throws it away.
+ *
+ * Readers only hold the vnode lock shared, so the cache has its own
+ * spinlock.
+ */
+
+/*
+ * The first file block mapped by the level-1 index block that maps
+ * FILEBLOCK. Every index tree starts SFS_NDIRECT plus a multiple of
+ * SFS_DBPERIDB blocks in, so this doesn't depend on the level.
+ */
+static
+uint32_t
+sfs_ibc_leafbase(uint32_t fileblock)
+{
+	KASSERT(fileblock >= SFS_NDIRECT);
+	return fileblock - (fileblock - SFS_NDIRECT) % SFS_DBPERIDB;
+}
+
+/*
+ * Look FILEBLOCK up in the cache. Returns true and sets *DISKBLOCK
+ * (possibly to 0, for a hole) on a hit.
+ */
+static
+bool
+sfs_ibc_lookup(struct sfs_vnode *sv, uint32_t fileblock, daddr_t *diskblock)
+{
+	uint32_t base;
+	bool hit;
+
+	base = sfs_ibc_leafbase(fileblock);
+
+	spinlock_acquire(&sv->sv_ibclock);
+	hit = sv->sv_ibcblock != 0 && sv->sv_ibcbase == base;
+	if (hit) {
+		*diskblock = sv->sv_ibcdata[fileblock - base];
+	}
+	spinlock_release(&sv->sv_ibclock);
+	return hit;
+}
+
+/*
+ * Load the cache from IDDATA, the contents of level-1 index block
+ * BLOCK, which maps file blocks starting at BASE. If there's no
+ * memory for the copy, just don't cache anything.
+ */
+static
+void
+sfs_ibc_fill(struct sfs_vnode *sv, uint32_t base, daddr_t block,
+	     const uint32_t *iddata)
+{
+	uint32_t *newdata;
+
+	newdata = NULL;
+	if (sv->sv_ibcdata == NULL) {
+		/* Can't kmalloc under a spinlock, so do it first */
+		newdata = kmalloc(SFS_DBPERIDB * sizeof(uint32_t));
+		if (newdata == NULL) {
+			return;
+		}
+	}
+
+	spinlock_acquire(&sv->sv_ibclock);
+	if (sv->sv_ibcdata == NULL) {
+		sv->sv_ibcdata = newdata;
+		newdata = NULL;
+	}
+	memcpy(sv->sv_ibcdata, iddata, SFS_DBPERIDB * sizeof(uint32_t));
+	sv->sv_ibcbase = base;
+	sv->sv_ibcblock = block;
+	spinlock_release(&sv->sv_ibclock);
+
+	/* Someone else got there first */
+	if (newdata != NULL) {
+		kfree(newdata);
+	}
+}
+
+/*
+ * Forget the cached index block.
+ */
+static
+void
+sfs_ibc_invalidate(struct sfs_vnode *sv)
+{
+	spinlock_acquire(&sv->sv_ibclock);
+	sv->sv_ibcblock = 0;
+	spinlock_release(&sv->sv_ibclock);
+}
+
+/*
+ * Release the cache's memory; called when the vnode is reclaimed.
+ */
+void
+sfs_bmap_dropcache(struct sfs_vnode *sv)
+{
+	if (sv->sv_ibcdata != NULL) {
+		kfree(sv->sv_ibcdata);
+		sv->sv_ibcdata = NULL;
+	}
+	sv->sv_ibcblock = 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated, along with any index blocks needed to reach it. New
+ * blocks go right after the previous block of the file if possible
+ * (see sfs_balloc), so files written in order come out contiguous.
+ *
+ * If FRESH is NULL, a newly allocated data block is zeroed, as are
+ * index blocks always. Otherwise a new data block is left as is and
+ * *FRESH is set to tell the caller it has to supply the contents
+ * (all of them); that saves zeroing blocks that are about to be
+ * overwritten.
+ *
+ * Index blocks are read through the buffer cache, so once a file is
+ * in use the walk down to a deep block doesn't touch the disk; and
+ * lookups under the last leaf index block used skip the walk entirely
+ * (see above).
+ *
+ * The caller should hold the vnode lock, for writing if DOALLOC is
+ * set.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+	 daddr_t *diskblock, bool *fresh)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *slot;
+	daddr_t block, next, goal;
+	uint32_t offset, range, idoff;
+	int indirection;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	if (fresh != NULL) {
+		*fresh = false;
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,10 +271,20 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			/* Try to put it right after the previous block */
+			goal = sv->sv_goal;
+			if (fileblock > 0 &&
+			    sv->sv_i.sfi_direct[fileblock-1] != 0) {
+				goal = sv->sv_i.sfi_direct[fileblock-1] + 1;
+			}
+			result = sfs_balloc(sfs, goal, fresh == NULL, &block);
 			if (result) {
 				return result;
 			}
+			sv->sv_goal = block + 1;
+			if (fresh != NULL) {
+				*fresh = true;
+			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
@@ -105,127 +304,337 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block. Try the leaf cache; unless we'd have
+	 * to allocate, that answers it.
 	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	if (sfs_ibc_lookup(sv, fileblock, &block) &&
+	    (block != 0 || !doalloc)) {
+		if (block != 0 && !sfs_bused(sfs, block)) {
+			panic("sfs: %s: Data block %u (block %u of file %u) "
+			      "marked free\n", sfs->sfs_sb.sb_volname,
+			      block, fileblock, sv->sv_ino);
+		}
+		*diskblock = block;
+		return 0;
+	}
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * Find which of the index blocks in the inode it's under.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	result = sfs_bmap_locate(sv, fileblock, &slot, &indirection, &offset);
+	if (result) {
+		return result;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
+	block = *slot;
+	if (block==0 && !doalloc) {
 		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
+		 * There's no index block allocated. We weren't asked
+		 * to allocate anything, so pretend it was filled with
+		 * all zeros.
 		 */
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+	else if (block==0) {
+		/* Allocate the top index block and remember it */
+		result = sfs_balloc(sfs, sv->sv_goal, true, &block);
 		if (result) {
 			return result;
 		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
+		sv->sv_goal = block + 1;
+		*slot = block;
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+
+	/*
+	 * Walk down the index blocks. At each level, BLOCK is an index
+	 * block and OFFSET is the block we want relative to the first
+	 * one it maps. (If we just allocated an index block, sfs_balloc
+	 * left it zeroed in the buffer cache.)
+	 */
+	for (; indirection > 0; indirection--) {
+		range = sfs_ibrange(indirection) / SFS_DBPERIDB;
+		idoff = offset / range;
+		offset %= range;
+
+		result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE,
+				     &idbuf);
 		if (result) {
 			return result;
 		}
+		iddata = buffer_map(idbuf);
+
+		next = iddata[idoff];
+		if (next==0 && doalloc) {
+			/*
+			 * Try to put it right after its neighbor in this
+			 * index block, if there is one; otherwise after
+			 * whatever we allocated for this file last.
+			 */
+			goal = sv->sv_goal;
+			if (idoff > 0 && iddata[idoff-1] != 0 &&
+			    indirection == 1) {
+				goal = iddata[idoff-1] + 1;
+			}
+			/* Index blocks must be zeroed; data maybe not */
+			result = sfs_balloc(sfs, goal,
+					    indirection > 1 || fresh == NULL,
+					    &next);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+			sv->sv_goal = next + 1;
+			if (indirection == 1 && fresh != NULL) {
+				*fresh = true;
+			}
+
+			/* Remember it; the index block is now dirty */
+			iddata[idoff] = next;
+			result = sfs_jmodified(sfs, idbuf, block);
+			if (result) {
+				buffer_release(idbuf);
+				sfs_ibc_invalidate(sv);
+				if (fresh != NULL && *fresh) {
+					/* Caller won't fill it; we must */
+					(void)sfs_clearblock(sfs, next);
+					*fresh = false;
+				}
+				return result;
+			}
+		}
+		if (indirection == 1) {
+			/* Remember this leaf for the next lookup */
+			sfs_ibc_fill(sv, sfs_ibc_leafbase(fileblock), block,
+				     iddata);
+		}
+		buffer_release(idbuf);
+
+		if (next == 0) {
+			/* Hole */
+			*diskblock = 0;
+			return 0;
+		}
+		block = next;
+	}
+
+	/* Hand back the result and return. */
+	if (!sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
 	}
+	*diskblock = block;
+	return 0;
+}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+/*
+ * Write back the blocks under index block BLOCK at level INDIRECTION,
+ * then the index block itself.
+ */
+static
+int
+sfs_flushib(struct sfs_fs *sfs, daddr_t block, int indirection)
+{
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t i;
+	int result;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		if (iddata[i] == 0) {
+			continue;
+		}
+		if (indirection > 1) {
+			result = sfs_flushib(sfs, iddata[i], indirection-1);
+		}
+		else {
+			result = buffer_flush(&sfs->sfs_absfs, iddata[i],
+					      SFS_BLOCKSIZE);
+		}
 		if (result) {
+			buffer_release(idbuf);
 			return result;
 		}
+	}
+	result = buffer_sync(idbuf);
+	buffer_release(idbuf);
+	return result;
+}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+/*
+ * Write back any of a file's blocks (data and index) that are sitting
+ * dirty in the buffer cache. Used by fsync; the inode itself is the
+ * caller's problem. Call with the vnode lock held.
+ */
+int
+sfs_flushblocks(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t i;
+	int result;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+	for (i=0; i<SFS_NDIRECT; i++) {
+		if (sv->sv_i.sfi_direct[i] == 0) {
+			continue;
+		}
+		result = buffer_flush(&sfs->sfs_absfs, sv->sv_i.sfi_direct[i],
+				      SFS_BLOCKSIZE);
 		if (result) {
 			return result;
 		}
 	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+	if (sv->sv_i.sfi_indirect != 0) {
+		result = sfs_flushib(sfs, sv->sv_i.sfi_indirect, 1);
+		if (result) {
+			return result;
+		}
+	}
+	if (sv->sv_i.sfi_dindirect != 0) {
+		result = sfs_flushib(sfs, sv->sv_i.sfi_dindirect, 2);
+		if (result) {
+			return result;
+		}
+	}
+	if (sv->sv_i.sfi_tindirect != 0) {
+		result = sfs_flushib(sfs, sv->sv_i.sfi_tindirect, 3);
+		if (result) {
+			return result;
+		}
 	}
-	*diskblock = block;
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Truncate the blocks under one index block. *SLOT is the index
+ * block, which sits at level INDIRECTION and maps file blocks starting
+ * at BASEBLOCK; BLOCKLEN is the new length of the file in blocks.
+ * Discard everything past the end, and the index block itself if it
+ * ends up empty, in which case *SLOT is cleared and *SLOTCHANGED set.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_ib(struct sfs_fs *sfs, uint32_t *slot, int indirection,
+	      uint32_t baseblock, uint32_t blocklen, bool *slotchanged)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, range, childbase;
+	bool hasnonzero, iddirty, childchanged;
+	int result;
+
+	range = sfs_ibrange(indirection);
+	if (*slot == 0 || blocklen >= baseblock + range) {
+		/* Nothing here, or all of it is before the new EOF */
+		return 0;
+	}
+
+	/* Read the index block */
+	result = buffer_read(&sfs->sfs_absfs, *slot, SFS_BLOCKSIZE, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		childbase = baseblock + j * (range / SFS_DBPERIDB);
+		if (indirection > 1) {
+			/* Recurse into the lower-level index block */
+			childchanged = false;
+			result = sfs_itrunc_ib(sfs, &iddata[j], indirection-1,
+					       childbase, blocklen,
+					       &childchanged);
+			if (result) {
+				if (iddirty || childchanged) {
+					/* Don't lose what we've freed */
+					(void)sfs_jmodified(sfs, idbuf, *slot);
+				}
+				buffer_release(idbuf);
+				return result;
+			}
+			if (childchanged) {
+				iddirty = true;
+			}
+		}
+		else if (blocklen <= childbase && iddata[j] != 0) {
+			/* Discard data blocks past the new EOF */
+			sfs_bfree(sfs, iddata[j]);
+			iddata[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
 
+	if (!hasnonzero) {
+		/* The whole index block is empty now; free it */
+		buffer_release(idbuf);
+		sfs_bfree(sfs, *slot);
+		*slot = 0;
+		*slotchanged = true;
+		return 0;
+	}
+	if (iddirty) {
+		/* The index block is dirty */
+		result = sfs_jmodified(sfs, idbuf, *slot);
+	}
+	buffer_release(idbuf);
+	return result;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim. Handles inline files
+ * too (see sfs_io.c). The caller should hold the vnode lock for
+ * writing (or, in sfs_reclaim, be the only one who can see the
+ * vnode).
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	/*
+	 * An inline file just gets its tail cleared, unless it's
+	 * growing past the inline area; then it needs real blocks.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (len <= (off_t)sfs_inline_max(sfs)) {
+			if (len < (off_t)sv->sv_i.sfi_size) {
+				bzero(sv->sv_i.sfi_inline + len,
+				      sv->sv_i.sfi_size - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sv->sv_dirty = true;
+			return 0;
+		}
+		result = sfs_inline_spill(sv);
+		if (result) {
+			return result;
+		}
+	}
 
-	vfs_biglock_acquire();
+	/* Index blocks are about to change under the leaf cache */
+	sfs_ibc_invalidate(sv);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,64 +649,41 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then the indirect, double indirect, and triple indirect trees */
+	changed = false;
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	result = sfs_itrunc_ib(sfs, &sv->sv_i.sfi_indirect, 1,
+			       baseblock, blocklen, &changed);
+	if (result == 0) {
+		baseblock += SFS_RANGE1;
+		result = sfs_itrunc_ib(sfs, &sv->sv_i.sfi_dindirect, 2,
+				       baseblock, blocklen, &changed);
+	}
+	if (result == 0) {
+		baseblock += SFS_RANGE2;
+		result = sfs_itrunc_ib(sfs, &sv->sv_i.sfi_tindirect, 3,
+				       baseblock, blocklen, &changed);
+	}
+	if (changed) {
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		return result;
 	}
 
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
+	/*
+	 * With no blocks left, it can go back to being inline. (This
+	 * also turns an empty hashed directory back into a flat one.)
+	 */
+	if (len == 0) {
+		sv->sv_i.sfi_flags = SFS_IFLAG_INLINE;
+	}
+
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
-
@@ -35,10 +35,40 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * In-memory name index for a directory.
+ *
+ * Built the first time a directory is searched by someone holding its
+ * lock for writing, and kept up to date by sfs_dir_link and
+ * sfs_dir_unlink after that. It maps each name to its inode and slot,
+ * and keeps a list of empty slots. If we run out of memory while
+ * updating it, we throw it away and build it again later; in the
+ * meantime searches fall back to scanning the directory.
+ */
+struct sfs_dirname {
+	char dn_name[SFS_NAMELEN];	/* name (null-terminated) */
+	uint32_t dn_ino;		/* inode number */
+	int dn_slot;			/* directory slot */
+	struct sfs_dirname *dn_next;	/* hash chain */
+};
+
+struct sfs_freeslot {
+	int fsl_slot;			/* an empty directory slot */
+	struct sfs_freeslot *fsl_next;
+};
+
+struct sfs_dirindex {
+	struct sfs_dirname **di_hash;	/* hash table of names */
+	unsigned di_hashsize;		/* number of chains */
+	unsigned di_count;		/* number of names */
+	struct sfs_freeslot *di_free;	/* empty slots */
+};
+
 /*
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
@@ -95,14 +125,835 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+static int sfs_dir_scan(struct sfs_vnode *sv, const char *name,
+			uint32_t *ino, int *slot, int *emptyslot);
+
+////////////////////////////////////////////////////////////
+// Name index
+
+/*
+ * Hash a name. This is also the on-disk hash for hashed directories,
+ * so it can't be changed.
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+static
+unsigned
+sfs_dirindex_hashfunc(const char *name, unsigned size)
+{
+	return sfs_dirhash(name) % size;
+}
+
+static
+struct sfs_dirindex *
+sfs_dirindex_create(void)
+{
+	struct sfs_dirindex *di;
+	unsigned i;
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return NULL;
+	}
+	di->di_hash = kmalloc(SFS_DIRINDEX_INITSIZE *
+			      sizeof(struct sfs_dirname *));
+	if (di->di_hash == NULL) {
+		kfree(di);
+		return NULL;
+	}
+	di->di_hashsize = SFS_DIRINDEX_INITSIZE;
+	for (i=0; i<di->di_hashsize; i++) {
+		di->di_hash[i] = NULL;
+	}
+	di->di_count = 0;
+	di->di_free = NULL;
+	return di;
+}
+
+static
+void
+sfs_dirindex_destroy(struct sfs_dirindex *di)
+{
+	struct sfs_dirname *dn;
+	struct sfs_freeslot *fsl;
+	unsigned i;
+
+	for (i=0; i<di->di_hashsize; i++) {
+		while ((dn = di->di_hash[i]) != NULL) {
+			di->di_hash[i] = dn->dn_next;
+			kfree(dn);
+		}
+	}
+	while ((fsl = di->di_free) != NULL) {
+		di->di_free = fsl->fsl_next;
+		kfree(fsl);
+	}
+	kfree(di->di_hash);
+	kfree(di);
+}
+
+static
+struct sfs_dirname *
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirname *dn;
+
+	for (dn = di->di_hash[sfs_dirindex_hashfunc(name, di->di_hashsize)];
+	     dn != NULL;
+	     dn = dn->dn_next) {
+		if (!strcmp(dn->dn_name, name)) {
+			return dn;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the number of chains. If there's no memory for it, carry on
+ * with longer chains.
+ */
+static
+void
+sfs_dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_dirname **newhash, *dn, *next;
+	unsigned newsize, i, ix;
+
+	newsize = di->di_hashsize * 2;
+	newhash = kmalloc(newsize * sizeof(struct sfs_dirname *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+	for (i=0; i<di->di_hashsize; i++) {
+		for (dn = di->di_hash[i]; dn != NULL; dn = next) {
+			next = dn->dn_next;
+			ix = sfs_dirindex_hashfunc(dn->dn_name, newsize);
+			dn->dn_next = newhash[ix];
+			newhash[ix] = dn;
+		}
+	}
+	kfree(di->di_hash);
+	di->di_hash = newhash;
+	di->di_hashsize = newsize;
+}
+
+static
+int
+sfs_dirindex_addname(struct sfs_dirindex *di, const char *name,
+		     uint32_t ino, int slot)
+{
+	struct sfs_dirname *dn;
+	unsigned ix;
+
+	dn = kmalloc(sizeof(*dn));
+	if (dn == NULL) {
+		return ENOMEM;
+	}
+	KASSERT(strlen(name) < sizeof(dn->dn_name));
+	strcpy(dn->dn_name, name);
+	dn->dn_ino = ino;
+	dn->dn_slot = slot;
+
+	ix = sfs_dirindex_hashfunc(dn->dn_name, di->di_hashsize);
+	dn->dn_next = di->di_hash[ix];
+	di->di_hash[ix] = dn;
+	di->di_count++;
+
+	if (di->di_count > 2 * di->di_hashsize) {
+		sfs_dirindex_grow(di);
+	}
+	return 0;
+}
+
+static
+void
+sfs_dirindex_removename(struct sfs_dirindex *di, struct sfs_dirname *dn)
+{
+	struct sfs_dirname **dnp;
+
+	dnp = &di->di_hash[sfs_dirindex_hashfunc(dn->dn_name,
+						 di->di_hashsize)];
+	while (*dnp != dn) {
+		KASSERT(*dnp != NULL);
+		dnp = &(*dnp)->dn_next;
+	}
+	*dnp = dn->dn_next;
+	KASSERT(di->di_count > 0);
+	di->di_count--;
+	kfree(dn);
+}
+
+static
+int
+sfs_dirindex_addfree(struct sfs_dirindex *di, int slot)
+{
+	struct sfs_freeslot *fsl;
+
+	fsl = kmalloc(sizeof(*fsl));
+	if (fsl == NULL) {
+		return ENOMEM;
+	}
+	fsl->fsl_slot = slot;
+	fsl->fsl_next = di->di_free;
+	di->di_free = fsl;
+	return 0;
+}
+
+/*
+ * Take SLOT off the empty slot list, if it's there. (It's normally at
+ * the front, because that's the one sfs_dir_findname hands out.)
+ */
+static
+void
+sfs_dirindex_takefree(struct sfs_dirindex *di, int slot)
+{
+	struct sfs_freeslot **fslp, *fsl;
+
+	for (fslp = &di->di_free; *fslp != NULL; fslp = &(*fslp)->fsl_next) {
+		if ((*fslp)->fsl_slot == slot) {
+			fsl = *fslp;
+			*fslp = fsl->fsl_next;
+			kfree(fsl);
+			return;
+		}
+	}
+}
+
+/*
+ * Throw away a directory's name index, if it has one.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_destroy(sv->sv_dirindex);
+		sv->sv_dirindex = NULL;
+	}
+}
+
+/*
+ * Build the name index for a directory, reading it a block at a time.
+ * Call with the directory locked for writing.
+ */
+static
+int
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di;
+	struct sfs_direntry *sds;
+	off_t pos, size;
+	size_t len;
+	unsigned i, n;
+	int slot, result;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = sfs_dirindex_create();
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	sds = kmalloc(SFS_BLOCKSIZE);
+	if (sds == NULL) {
+		sfs_dirindex_destroy(di);
+		return ENOMEM;
+	}
+
+	size = sfs_dir_nentries(sv) * (off_t)sizeof(struct sfs_direntry);
+	slot = 0;
+	for (pos = 0; pos < size; pos += SFS_BLOCKSIZE) {
+		len = SFS_BLOCKSIZE;
+		if (pos + (off_t)len > size) {
+			len = size - pos;
+		}
+		result = sfs_metaio(sv, pos, sds, len, UIO_READ);
+		if (result) {
+			goto fail;
+		}
+
+		n = len / sizeof(struct sfs_direntry);
+		for (i=0; i<n; i++, slot++) {
+			if (sds[i].sfd_ino == SFS_NOINO) {
+				result = sfs_dirindex_addfree(di, slot);
+			}
+			else {
+				sds[i].sfd_name[sizeof(sds[i].sfd_name)-1] = 0;
+				if (sfs_dirindex_find(di, sds[i].sfd_name)) {
+					/* Duplicate; the scan finds the first */
+					continue;
+				}
+				result = sfs_dirindex_addname(di,
+							      sds[i].sfd_name,
+							      sds[i].sfd_ino,
+							      slot);
+			}
+			if (result) {
+				goto fail;
+			}
+		}
+	}
+
+	kfree(sds);
+	sv->sv_dirindex = di;
+	return 0;
+
+ fail:
+	kfree(sds);
+	sfs_dirindex_destroy(di);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Hashed directories
+//
+// See <kern/sfs.h> for the layout. Everything goes through
+// sfs_metaio, so the header and table blocks stay in the buffer
+// cache and a cold lookup costs a header, a table, and a bucket read.
+
+/* Slot number of entry I of the bucket at file block BLOCK */
+#define SFS_DIRHASH_SLOT(block, i) \
+	((block) * (SFS_BLOCKSIZE / sizeof(struct sfs_direntry)) + 1 + (i))
+
+static
+int
+sfs_dirhash_readbucket(struct sfs_vnode *sv, uint32_t block,
+		       struct sfs_dirbucket *db)
+{
+	return sfs_metaio(sv, (off_t)block * SFS_BLOCKSIZE, db, sizeof(*db),
+			  UIO_READ);
+}
+
+static
+int
+sfs_dirhash_writebucket(struct sfs_vnode *sv, uint32_t block,
+			struct sfs_dirbucket *db)
+{
+	return sfs_metaio(sv, (off_t)block * SFS_BLOCKSIZE, db, sizeof(*db),
+			  UIO_WRITE);
+}
+
+static
+int
+sfs_dirhash_gettable(struct sfs_vnode *sv, uint32_t ix, uint32_t *block)
+{
+	return sfs_metaio(sv, SFS_BLOCKSIZE + (off_t)ix * sizeof(uint32_t),
+			  block, sizeof(*block), UIO_READ);
+}
+
+static
+int
+sfs_dirhash_settable(struct sfs_vnode *sv, uint32_t ix, uint32_t block)
+{
+	return sfs_metaio(sv, SFS_BLOCKSIZE + (off_t)ix * sizeof(uint32_t),
+			  &block, sizeof(block), UIO_WRITE);
+}
+
+/*
+ * Read the table depth out of the header.
+ */
+static
+int
+sfs_dirhash_getdepth(struct sfs_vnode *sv, uint32_t *depth)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t words[2];
+	int result;
+
+	result = sfs_metaio(sv, 0, words, sizeof(words), UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (words[0] != SFS_DIRHASH_MAGIC ||
+	    words[1] > SFS_DIRHASH_MAXDEPTH) {
+		panic("sfs: %s: directory %u: Bad hash header\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+	*depth = words[1];
+	return 0;
+}
+
+static
+int
+sfs_dirhash_setdepth(struct sfs_vnode *sv, uint32_t depth)
+{
+	/* dh_depth is the second word */
+	return sfs_metaio(sv, sizeof(uint32_t), &depth, sizeof(depth),
+			  UIO_WRITE);
+}
+
+/*
+ * Find the (first) bucket for hash value HASH. Also hand back the
+ * table depth.
+ */
+static
+int
+sfs_dirhash_findbucket(struct sfs_vnode *sv, uint32_t hash,
+		       uint32_t *depth, uint32_t *block)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	result = sfs_dirhash_getdepth(sv, depth);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirhash_gettable(sv, hash & ((1U << *depth) - 1), block);
+	if (result) {
+		return result;
+	}
+	if (*block < SFS_DIRHASH_FIRSTBUCKET ||
+	    *block >= sv->sv_i.sfi_size / SFS_BLOCKSIZE) {
+		panic("sfs: %s: directory %u: Bad hash bucket %u\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, *block);
+	}
+	return 0;
+}
+
+/*
+ * Look up NAME in a hashed directory. Same interface as
+ * sfs_dir_findname, except that no empty slot is handed back; the
+ * slot for a new name depends on its hash, so sfs_dirhash_insert
+ * picks it.
+ */
+static
+int
+sfs_dirhash_find(struct sfs_vnode *sv, const char *name,
+		 uint32_t *ino, int *slot)
+{
+	struct sfs_dirbucket *db;
+	uint32_t depth, block;
+	unsigned i;
+	int result;
+
+	result = sfs_dirhash_findbucket(sv, sfs_dirhash(name), &depth, &block);
+	if (result) {
+		return result;
+	}
+
+	db = kmalloc(sizeof(*db));
+	if (db == NULL) {
+		return ENOMEM;
+	}
+
+	while (block != 0) {
+		result = sfs_dirhash_readbucket(sv, block, db);
+		if (result) {
+			kfree(db);
+			return result;
+		}
+		for (i=0; i<SFS_DIRHASH_PERBUCKET; i++) {
+			if (db->db_entries[i].sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			db->db_entries[i].sfd_name[SFS_NAMELEN-1] = 0;
+			if (!strcmp(db->db_entries[i].sfd_name, name)) {
+				if (ino != NULL) {
+					*ino = db->db_entries[i].sfd_ino;
+				}
+				if (slot != NULL) {
+					*slot = SFS_DIRHASH_SLOT(block, i);
+				}
+				kfree(db);
+				return 0;
+			}
+		}
+		block = db->db_next;
+	}
+
+	kfree(db);
+	return ENOENT;
+}
+
+/*
+ * Double the bucket table, from 2^DEPTH entries to 2^(DEPTH+1), by
+ * copying the first half to the second half.
+ */
+static
+int
+sfs_dirhash_growtable(struct sfs_vnode *sv, uint32_t depth)
+{
+	uint32_t *tbl;
+	uint32_t n, i, perblock, nblocks;
+	int result;
+
+	KASSERT(depth < SFS_DIRHASH_MAXDEPTH);
+
+	tbl = kmalloc(SFS_BLOCKSIZE);
+	if (tbl == NULL) {
+		return ENOMEM;
+	}
+
+	n = 1U << depth;
+	perblock = SFS_BLOCKSIZE / sizeof(uint32_t);
+	if (n < perblock) {
+		/* The whole table is in the first block */
+		result = sfs_metaio(sv, SFS_BLOCKSIZE, tbl,
+				    2 * n * sizeof(uint32_t), UIO_READ);
+		if (result == 0) {
+			memcpy(tbl + n, tbl, n * sizeof(uint32_t));
+			result = sfs_metaio(sv, SFS_BLOCKSIZE, tbl,
+					    2 * n * sizeof(uint32_t),
+					    UIO_WRITE);
+		}
+	}
+	else {
+		nblocks = n / perblock;
+		result = 0;
+		for (i=0; i<nblocks && result == 0; i++) {
+			result = sfs_metaio(sv, (off_t)(1 + i) * SFS_BLOCKSIZE,
+					    tbl, SFS_BLOCKSIZE, UIO_READ);
+			if (result == 0) {
+				result = sfs_metaio(sv,
+				     (off_t)(1 + nblocks + i) * SFS_BLOCKSIZE,
+				     tbl, SFS_BLOCKSIZE, UIO_WRITE);
+			}
+		}
+	}
+	kfree(tbl);
+	if (result) {
+		return result;
+	}
+
+	/* Only now is the new half live */
+	return sfs_dirhash_setdepth(sv, depth + 1);
+}
+
+/*
+ * Split the bucket DB at file block BLOCK, which is full, into two.
+ * HASH is the hash of any name that belongs in it; DEPTH is the
+ * table depth.
+ */
+static
+int
+sfs_dirhash_split(struct sfs_vnode *sv, uint32_t hash, uint32_t depth,
+		  uint32_t block, struct sfs_dirbucket *db)
+{
+	struct sfs_dirbucket *ndb;
+	uint32_t bdepth, newblock, bit, ix;
+	unsigned i;
+	int result;
+
+	bdepth = db->db_depth;
+	KASSERT(bdepth < SFS_DIRHASH_MAXDEPTH);
+	KASSERT(db->db_next == 0);
+
+	if (bdepth == depth) {
+		/* Only one table entry points here; make room for two */
+		result = sfs_dirhash_growtable(sv, depth);
+		if (result) {
+			return result;
+		}
+		depth++;
+	}
+
+	ndb = kmalloc(sizeof(*ndb));
+	if (ndb == NULL) {
+		return ENOMEM;
+	}
+	bzero(ndb, sizeof(*ndb));
+
+	/* Names with the next hash bit set move to the new bucket */
+	bit = 1U << bdepth;
+	for (i=0; i<SFS_DIRHASH_PERBUCKET; i++) {
+		if (db->db_entries[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		db->db_entries[i].sfd_name[SFS_NAMELEN-1] = 0;
+		if (sfs_dirhash(db->db_entries[i].sfd_name) & bit) {
+			ndb->db_entries[i] = db->db_entries[i];
+			bzero(&db->db_entries[i], sizeof(db->db_entries[i]));
+		}
+	}
+	db->db_depth = ndb->db_depth = bdepth + 1;
+
+	/* New buckets go at the end; write it before anything points to it */
+	newblock = sv->sv_i.sfi_size / SFS_BLOCKSIZE;
+	result = sfs_dirhash_writebucket(sv, newblock, ndb);
+	kfree(ndb);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirhash_writebucket(sv, block, db);
+	if (result) {
+		return result;
+	}
+
+	/* Repoint the table entries for the new bucket's half */
+	for (ix = (hash & (bit - 1)) | bit; ix < (1U << depth); ix += 2*bit) {
+		result = sfs_dirhash_settable(sv, ix, newblock);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Add the entry SD to a hashed directory, handing back its slot. The
+ * caller has checked that the name isn't already there.
+ */
+static
+int
+sfs_dirhash_insert(struct sfs_vnode *sv, struct sfs_direntry *sd, int *slot)
+{
+	struct sfs_dirbucket *db;
+	uint32_t hash, depth, first, block, newblock;
+	unsigned i;
+	int result;
+
+	hash = sfs_dirhash(sd->sfd_name);
+
+	db = kmalloc(sizeof(*db));
+	if (db == NULL) {
+		return ENOMEM;
+	}
+
+	while (1) {
+		result = sfs_dirhash_findbucket(sv, hash, &depth, &first);
+		if (result) {
+			goto out;
+		}
+
+		/* Look for a free entry along the chain */
+		block = first;
+		while (1) {
+			result = sfs_dirhash_readbucket(sv, block, db);
+			if (result) {
+				goto out;
+			}
+			for (i=0; i<SFS_DIRHASH_PERBUCKET; i++) {
+				if (db->db_entries[i].sfd_ino == SFS_NOINO) {
+					*slot = SFS_DIRHASH_SLOT(block, i);
+					result = sfs_metaio(sv,
+						(off_t)*slot * sizeof(*sd),
+						sd, sizeof(*sd), UIO_WRITE);
+					goto out;
+				}
+			}
+			if (db->db_next == 0) {
+				break;
+			}
+			block = db->db_next;
+		}
+
+		if (db->db_depth == SFS_DIRHASH_MAXDEPTH) {
+			break;
+		}
+
+		/* Split the bucket and try again */
+		KASSERT(block == first);
+		result = sfs_dirhash_split(sv, hash, depth, block, db);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* Out of hash bits; chain on an overflow bucket */
+	newblock = sv->sv_i.sfi_size / SFS_BLOCKSIZE;
+	bzero(db, sizeof(*db));
+	db->db_depth = SFS_DIRHASH_MAXDEPTH;
+	db->db_entries[0] = *sd;
+	result = sfs_dirhash_writebucket(sv, newblock, db);
+	if (result) {
+		goto out;
+	}
+	/* db_next is the second word of the last bucket */
+	result = sfs_metaio(sv, (off_t)block * SFS_BLOCKSIZE + sizeof(uint32_t),
+			    &newblock, sizeof(newblock), UIO_WRITE);
+	if (result) {
+		goto out;
+	}
+	*slot = SFS_DIRHASH_SLOT(newblock, 0);
+
+ out:
+	kfree(db);
+	return result;
+}
+
+/*
+ * Turn a flat directory into a hashed one. Call with the directory
+ * locked for writing.
+ *
+ * The entries are read into memory, the directory is emptied, and
+ * the entries are added back one at a time. If that fails, put the
+ * flat directory back the way it was.
+ */
+static
+int
+sfs_dir_makehashed(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry *sds;
+	struct sfs_dirheader *dh;
+	struct sfs_dirbucket *db;
+	off_t pos, size;
+	size_t len;
+	int i, nentries, slot, result, result2;
+
+	KASSERT(!(sv->sv_i.sfi_flags & SFS_IFLAG_HASHED));
+
+	nentries = sfs_dir_nentries(sv);
+	size = nentries * (off_t)sizeof(struct sfs_direntry);
+	sds = kmalloc(size);
+	if (sds == NULL) {
+		return ENOMEM;
+	}
+	for (pos = 0; pos < size; pos += len) {
+		len = SFS_BLOCKSIZE;
+		if (pos + (off_t)len > size) {
+			len = size - pos;
+		}
+		result = sfs_metaio(sv, pos, (char *)sds + pos, len, UIO_READ);
+		if (result) {
+			kfree(sds);
+			return result;
+		}
+	}
+
+	/* Block-sized buffers don't belong on the stack */
+	dh = kmalloc(sizeof(*dh));
+	db = kmalloc(sizeof(*db));
+	if (dh == NULL || db == NULL) {
+		kfree(dh);
+		kfree(db);
+		kfree(sds);
+		return ENOMEM;
+	}
+
+	/* The slots are about to change */
+	sfs_dir_dropindex(sv);
+
+	result = sfs_itrunc(sv, 0);
+	if (result) {
+		goto out;
+	}
+	sv->sv_i.sfi_flags = SFS_IFLAG_HASHED;
+	sv->sv_dirty = true;
+
+	/* One bucket, at depth 0 */
+	bzero(dh, sizeof(*dh));
+	dh->dh_magic = SFS_DIRHASH_MAGIC;
+	dh->dh_depth = 0;
+	bzero(db, sizeof(*db));
+	result = sfs_metaio(sv, 0, dh, sizeof(*dh), UIO_WRITE);
+	if (result == 0) {
+		result = sfs_dirhash_settable(sv, 0, SFS_DIRHASH_FIRSTBUCKET);
+	}
+	if (result == 0) {
+		result = sfs_dirhash_writebucket(sv, SFS_DIRHASH_FIRSTBUCKET,
+						 db);
+	}
+
+	for (i=0; i<nentries && result == 0; i++) {
+		if (sds[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		sds[i].sfd_name[SFS_NAMELEN-1] = 0;
+		result = sfs_dirhash_insert(sv, &sds[i], &slot);
+	}
+	if (result == 0) {
+		goto out;
+	}
+
+	/* Put it back */
+	result2 = sfs_itrunc(sv, 0);
+	for (pos = 0; pos < size && result2 == 0; pos += len) {
+		len = SFS_BLOCKSIZE;
+		if (pos + (off_t)len > size) {
+			len = size - pos;
+		}
+		result2 = sfs_metaio(sv, pos, (char *)sds + pos, len,
+				     UIO_WRITE);
+	}
+	if (result2) {
+		kprintf("sfs: %s: directory %u: %s\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, strerror(result));
+		kprintf("sfs: %s: directory %u: while restoring: %s\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, strerror(result2));
+		panic("sfs: %s: directory %u: Cannot recover\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+
+ out:
+	kfree(dh);
+	kfree(db);
+	kfree(sds);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * Hashed directories are searched through their on-disk index. For
+ * flat ones, use the name index if there is one, building it first
+ * if the caller holds the directory lock for writing. Otherwise
+ * (e.g. the index couldn't be built), scan the directory.
+ *
+ * An empty slot is only ever handed back for a flat directory.
  */
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirname *dn;
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_HASHED) {
+		/* Already indexed on disk */
+		return sfs_dirhash_find(sv, name, ino, slot);
+	}
+
+	if (sv->sv_dirindex == NULL && rwlock_do_i_hold_write(sv->sv_lock)) {
+		/* If this fails we'll just scan; no need to complain */
+		(void)sfs_dir_buildindex(sv);
+	}
+
+	di = sv->sv_dirindex;
+	if (di == NULL) {
+		return sfs_dir_scan(sv, name, ino, slot, emptyslot);
+	}
+
+	if (emptyslot != NULL && di->di_free != NULL) {
+		*emptyslot = di->di_free->fsl_slot;
+	}
+	dn = sfs_dirindex_find(di, name);
+	if (dn == NULL) {
+		return ENOENT;
+	}
+	if (slot != NULL) {
+		*slot = dn->dn_slot;
+	}
+	if (ino != NULL) {
+		*ino = dn->dn_ino;
+	}
+	return 0;
+}
+
+/*
+ * Search a directory the slow way: read every entry. Same interface
+ * as sfs_dir_findname.
+ */
+static
+int
+sfs_dir_scan(struct sfs_vnode *sv, const char *name,
+	     uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
@@ -170,23 +1021,50 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
-	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
-	}
-
 	/* Set up the entry. */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = ino;
 	strcpy(sd.sfd_name, name);
 
+	/*
+	 * A full flat directory that's big enough gets hashed. If that
+	 * doesn't work out, it just stays flat and grows.
+	 */
+	if (emptyslot < 0 && !(sv->sv_i.sfi_flags & SFS_IFLAG_HASHED) &&
+	    sfs_dir_nentries(sv) >= SFS_DIRHASH_MINENTRIES) {
+		(void)sfs_dir_makehashed(sv);
+	}
+
+	/* In a hashed directory, the name's hash decides where it goes */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_HASHED) {
+		return sfs_dirhash_insert(sv, &sd, slot ? slot : &emptyslot);
+	}
+
+	/* If we didn't get an empty slot, add the entry at the end. */
+	if (emptyslot < 0) {
+		emptyslot = sfs_dir_nentries(sv);
+	}
+
 	/* Hand back the slot, if so requested. */
 	if (slot) {
 		*slot = emptyslot;
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Update the name index, or drop it if we can't. */
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_takefree(sv->sv_dirindex, emptyslot);
+		if (sfs_dirindex_addname(sv->sv_dirindex, name, ino,
+					 emptyslot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -196,13 +1074,46 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
+	struct sfs_dirname *dn = NULL;
+	int result;
+
+	/* If there's a name index, find out what name we're removing. */
+	if (sv->sv_dirindex != NULL) {
+		result = sfs_readdir(sv, slot, &sd);
+		if (result) {
+			return result;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		dn = sfs_dirindex_find(sv->sv_dirindex, sd.sfd_name);
+		if (dn == NULL || dn->dn_slot != slot) {
+			/* Can only happen with duplicate names on disk */
+			sfs_dir_dropindex(sv);
+			dn = NULL;
+		}
+	}
+
+	/* Never clear a bucket header */
+	KASSERT(!(sv->sv_i.sfi_flags & SFS_IFLAG_HASHED) ||
+		slot % (SFS_BLOCKSIZE / sizeof(struct sfs_direntry)) != 0);
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Update the name index, or drop it if we can't. */
+	if (dn != NULL) {
+		sfs_dirindex_removename(sv->sv_dirindex, dn);
+		if (sfs_dirindex_addfree(sv->sv_dirindex, slot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
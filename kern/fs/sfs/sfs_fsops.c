@@ -37,10 +37,12 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <synch.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -49,11 +51,12 @@
 #define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
 #define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
 #define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
+#define SFS_FS_NINODES(sfs)        ((sfs)->sfs_sb.sb_ninodes)
+#define SFS_FS_INODEMAPBITS(sfs)   SFS_FREEMAPBITS(SFS_FS_NINODES(sfs))
+#define SFS_FS_INODEMAPBLOCKS(sfs) SFS_INODEMAPBLOCKS(SFS_FS_NINODES(sfs))
 
 /*
- * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Routines for doing I/O on the free block bitmap.
  *
  * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
  * sectors of bits, one bit for each sector on the filesystem. The
@@ -66,79 +69,201 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * The inode bitmap of the packed format is laid out the same way,
+ * with one bit per inode, and is handled by the same code.
+ *
+ * At mount time we read each bitmap in one go. After that,
+ * sfs_balloc and sfs_bfree (and sfs_ialloc and sfs_ifree) note which
+ * of its blocks they change in a second bitmap, and sync writes just
+ * those, with each run of adjacent dirty blocks going to the disk as
+ * one request. On a volume with a journal, the bitmaps go to the log
+ * with each commit and are only written here at a checkpoint.
  */
 static
 int
-sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
+sfs_bitmap_read(struct sfs_fs *sfs, struct bitmap *map, daddr_t start,
+		uint32_t nblocks)
 {
-	uint32_t j, freemapblocks;
-	char *freemapdata;
 	int result;
 
-	/* Number of blocks in the free block bitmap. */
-	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+	result = sfs_readblock(sfs, start, bitmap_getdata(map),
+			       nblocks * SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
 
-	/* Pointer to our freemap data in memory. */
-	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	/* We changed the bits behind the bitmap's back */
+	bitmap_refresh(map);
+	return 0;
+}
 
-	/* For each block in the free block bitmap... */
-	for (j=0; j<freemapblocks; j++) {
+static
+int
+sfs_bitmap_writedirty(struct sfs_fs *sfs, struct bitmap *map,
+		      struct bitmap *dirty, daddr_t start, uint32_t nblocks)
+{
+	uint32_t j, k;
+	char *mapdata;
+	int result;
 
-		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
-		/* and read or write it. The freemap starts at sector 2. */
-		if (rw == UIO_READ) {
-			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
-		}
-		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+	/* Pointer to the bitmap data in memory. */
+	mapdata = bitmap_getdata(map);
+
+	for (j=0; j<nblocks; j = k) {
+		if (!bitmap_isset(dirty, j)) {
+			k = j+1;
+			continue;
 		}
 
-		/* If we failed, stop. */
+		/* Find the end of this run of dirty blocks */
+		for (k = j+1; k<nblocks && bitmap_isset(dirty, k); k++);
+
+		result = sfs_writeblock(sfs, start + j,
+					mapdata + j*SFS_BLOCKSIZE,
+					(k - j) * SFS_BLOCKSIZE);
 		if (result) {
 			return result;
 		}
+		for (; j<k; j++) {
+			bitmap_unmark(dirty, j);
+		}
 	}
 	return 0;
 }
 
+static
+int
+sfs_freemap_read(struct sfs_fs *sfs)
+{
+	int result;
+
+	/* The freemap starts at sector 2. */
+	result = sfs_bitmap_read(sfs, sfs->sfs_freemap, SFS_FREEMAP_START,
+				 SFS_FS_FREEMAPBLOCKS(sfs));
+	if (result) {
+		return result;
+	}
+
+	if (sfs->sfs_inodemap != NULL) {
+		result = sfs_bitmap_read(sfs, sfs->sfs_inodemap,
+					 sfs->sfs_sb.sb_inodemapstart,
+					 SFS_FS_INODEMAPBLOCKS(sfs));
+	}
+	return result;
+}
+
+static
+int
+sfs_freemap_writedirty(struct sfs_fs *sfs)
+{
+	int result;
+
+	result = sfs_bitmap_writedirty(sfs, sfs->sfs_freemap,
+				       sfs->sfs_freemapdirtyblocks,
+				       SFS_FREEMAP_START,
+				       SFS_FS_FREEMAPBLOCKS(sfs));
+	if (result) {
+		return result;
+	}
+
+	if (sfs->sfs_inodemap != NULL) {
+		result = sfs_bitmap_writedirty(sfs, sfs->sfs_inodemap,
+					       sfs->sfs_inodemapdirtyblocks,
+					       sfs->sfs_sb.sb_inodemapstart,
+					       SFS_FS_INODEMAPBLOCKS(sfs));
+	}
+	return result;
+}
+
 /*
  * Sync routine for the vnode table.
  */
-static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct vnodearray *vnodes;
+	struct vnode *v;
+	struct sfs_vnode *sv;
+	unsigned i, n, num;
+	int result, ret = 0;
+
+	/*
+	 * Inode locks come before the vnode table lock, so we can't
+	 * sync while holding it. Instead, collect references to all
+	 * the loaded vnodes, then let go of the table. Vnodes being
+	 * reclaimed are skipped; sfs_reclaim syncs them itself.
+	 */
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
+	lock_acquire(sfs->sfs_vnlock);
 	num = vnodearray_num(sfs->sfs_vnodes);
+	result = vnodearray_setsize(vnodes, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(vnodes);
+		return result;
+	}
+	n = 0;
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		v = vnodearray_get(sfs->sfs_vnodes, i);
+		sv = v->vn_data;
+		if (sv->sv_reclaiming) {
+			continue;
+		}
+		VOP_INCREF(v);
+		vnodearray_set(vnodes, n++, v);
 	}
-	return 0;
+	lock_release(sfs->sfs_vnlock);
+	num = n;
+
+	/*
+	 * Sync each one. This only puts the inodes in the buffer
+	 * cache; sfs_sync writes the whole cache out afterwards, so
+	 * don't use VOP_FSYNC.
+	 */
+	for (i=0; i<num; i++) {
+		v = vnodearray_get(vnodes, i);
+		sv = v->vn_data;
+
+		rwlock_acquire_write(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		rwlock_release_write(sv->sv_lock);
+		if (result && ret == 0) {
+			ret = result;
+		}
+
+		VOP_DECREF(v);
+	}
+
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+	return ret;
 }
 
 /*
  * Sync routine for the freemap.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
-		result = sfs_freemapio(sfs, UIO_WRITE);
+		result = sfs_freemap_writedirty(sfs);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -146,20 +271,22 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 /*
  * Sync routine for the superblock.
  */
-static
 int
 sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +301,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,28 +333,69 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
+	/* With a journal, a commit and checkpoint does all of this. */
+	if (sfs->sfs_journal != NULL) {
+		return sfs_jcommit(sfs, true);
+	}
+
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
+		return result;
+	}
+
+	/* Write back anything still dirty in the buffer cache. */
+	result = buffer_sync_fs(&sfs->sfs_absfs);
+	if (result) {
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	return 0;
+}
+
+/*
+ * Space usage. The allocation group counts cover the whole volume, so
+ * this doesn't need to look at the bitmaps. In the original format
+ * inodes are blocks, so any free block is a free inode.
+ */
+static
+int
+sfs_statfs(struct fs *fs, struct fs_stats *st)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	uint32_t group, freeblocks = 0, freeinodes = 0;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (group=0; group<sb->sb_ngroups; group++) {
+		freeblocks += sb->sb_groupfree[group];
+		freeinodes += sb->sb_groupifree[group];
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	st->fst_blocksize = SFS_BLOCKSIZE;
+	st->fst_blocks = sb->sb_nblocks;
+	st->fst_freeblocks = freeblocks;
+	if (sb->sb_version == SFS_VERSION_ORIG) {
+		st->fst_files = sb->sb_nblocks;
+		st->fst_freefiles = freeblocks;
+	}
+	else {
+		st->fst_files = sb->sb_ninodes;
+		st->fst_freefiles = freeinodes;
+	}
 	return 0;
 }
 
@@ -243,13 +409,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name doesn't change after mount; no lock needed */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +424,21 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	if (sfs->sfs_freemapdirtyblocks != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirtyblocks);
+	}
+	if (sfs->sfs_inodemap != NULL) {
+		bitmap_destroy(sfs->sfs_inodemap);
+	}
+	if (sfs->sfs_inodemapdirtyblocks != NULL) {
+		bitmap_destroy(sfs->sfs_inodemapdirtyblocks);
+	}
+	sfs_journal_destroy(sfs);
 	vnodearray_destroy(sfs->sfs_vnodes);
+	kfree(sfs->sfs_vnhash);
+	lock_destroy(sfs->sfs_freemaplock);
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,19 +453,33 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer holds the biglock, so nothing can come along and open
+	 * one once we've checked.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/*
+	 * Our blocks had better not outlive us in the buffer cache. If
+	 * one won't write back, stay mounted rather than lose it.
+	 */
+	result = buffer_drop_fs(&sfs->sfs_absfs);
+	if (result) {
+		return result;
+	}
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,10 +487,38 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Block I/O for the buffer cache.
+ */
+static
+int
+sfs_fs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	return sfs_readblock(fs->fs_data, block, data, len);
+}
+
+static
+int
+sfs_fs_readblocks(struct fs *fs, daddr_t block, struct iovec *iov,
+		  unsigned nblocks, size_t len)
+{
+	return sfs_readblocks(fs->fs_data, block, iov, nblocks, len);
+}
+
+static
+int
+sfs_fs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	/* Not until the transaction that changed it commits */
+	if (sfs_jheld(fs->fs_data, block)) {
+		return EAGAIN;
+	}
+	return sfs_writeblock(fs->fs_data, block, data, len);
+}
+
 /*
  * File system operations table.
  */
@@ -309,6 +527,10 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_getvolname = sfs_getvolname,
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
+	.fsop_readblock = sfs_fs_readblock,
+	.fsop_readblocks = sfs_fs_readblocks,
+	.fsop_writeblock = sfs_fs_writeblock,
+	.fsop_statfs = sfs_statfs,
 };
 
 /*
@@ -321,12 +543,16 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
 	 */
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_dinode) -
+		       sizeof(((struct sfs_dinode *)0)->sfi_inline)
+		       <= SFS_PINODESIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
 
 	/* Allocate object */
@@ -351,23 +577,132 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_object;
+	}
+	sfs->sfs_vncv = cv_create("sfs reclaim");
+	if (sfs->sfs_vncv == NULL) {
+		goto cleanup_vnlock;
+	}
 	sfs->sfs_vnodes = vnodearray_create();
 	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+		goto cleanup_vncv;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vnodes;
+	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnhash;
+	}
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirtyblocks = NULL;
+	sfs->sfs_inodemap = NULL;
+	sfs->sfs_inodemapdirtyblocks = NULL;
+
+	/* journal (set up by sfs_journal_mount) */
+	sfs->sfs_journal = NULL;
+	sfs->sfs_crashed = false;
 
 	return sfs;
 
+cleanup_vnhash:
+	kfree(sfs->sfs_vnhash);
+cleanup_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
+cleanup_vncv:
+	cv_destroy(sfs->sfs_vncv);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
 	return NULL;
 }
 
+/*
+ * Check that the journal, if there is one, is inside the volume and
+ * after the rest of the metadata, which ends at METAEND.
+ */
+static
+int
+sfs_checkjournal(struct sfs_fs *sfs, uint32_t metaend)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	uint32_t end;
+
+	if (sb->sb_journalblocks == 0) {
+		return 0;
+	}
+	end = sb->sb_journalstart + sb->sb_journalblocks;
+	if (sb->sb_journalblocks < SFS_JOURNAL_MINBLOCKS ||
+	    sb->sb_journalstart < metaend ||
+	    end > sb->sb_nblocks || end < sb->sb_journalstart) {
+		kprintf("sfs: %s: Bad journal layout\n", sb->sb_volname);
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Check the format version, and that the packed format's inode bitmap
+ * and inode table are where they can be: after the freemap, in order,
+ * and inside the volume. Then check the journal.
+ */
+static
+int
+sfs_checklayout(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	uint32_t mapend, tableend;
+
+	/* Volumes without allocation groups get them at mount time */
+	if (sb->sb_ngroups != 0 &&
+	    (sb->sb_ngroups != SFS_NGROUPS(sb->sb_nblocks) ||
+	     sb->sb_groupblocks != SFS_GROUPBLOCKS(sb->sb_nblocks) ||
+	     sb->sb_groupinodes != (sb->sb_version == SFS_VERSION_PACKED ?
+			SFS_GROUPINODES(sb->sb_ninodes, sb->sb_ngroups) : 0))) {
+		kprintf("sfs: %s: Bad allocation group layout\n",
+			sb->sb_volname);
+		return EINVAL;
+	}
+
+	switch (sb->sb_version) {
+	    case SFS_VERSION_ORIG:
+		return sfs_checkjournal(sfs, SFS_FREEMAP_START +
+					SFS_FREEMAPBLOCKS(sb->sb_nblocks));
+	    case SFS_VERSION_PACKED:
+		break;
+	    default:
+		kprintf("sfs: %s: Unsupported format version %u\n",
+			sb->sb_volname, sb->sb_version);
+		return EINVAL;
+	}
+
+	mapend = sb->sb_inodemapstart + SFS_INODEMAPBLOCKS(sb->sb_ninodes);
+	tableend = sb->sb_inodetablestart +
+		SFS_INODETABLEBLOCKS(sb->sb_ninodes);
+	if (sb->sb_ninodes <= SFS_ROOTDIR_INO ||
+	    sb->sb_inodemapstart < SFS_FREEMAP_START +
+	    SFS_FREEMAPBLOCKS(sb->sb_nblocks) ||
+	    sb->sb_inodetablestart < mapend ||
+	    tableend > sb->sb_nblocks || tableend < sb->sb_inodetablestart) {
+		kprintf("sfs: %s: Bad inode table layout\n", sb->sb_volname);
+		return EINVAL;
+	}
+	return sfs_checkjournal(sfs, tableend);
+}
+
 /*
  * Mount routine.
  *
@@ -388,8 +723,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +735,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +742,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +754,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +766,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -448,26 +777,60 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	result = sfs_checklayout(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
+	/* Replay the journal, if there is one, before reading anything else */
+	result = sfs_journal_mount(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
-	result = sfs_freemapio(sfs, UIO_READ);
+	sfs->sfs_freemapdirtyblocks =
+		bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemapdirtyblocks == NULL) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return ENOMEM;
+	}
+	if (sfs->sfs_sb.sb_version == SFS_VERSION_PACKED) {
+		/* And the inode bitmap */
+		sfs->sfs_inodemap = bitmap_create(SFS_FS_INODEMAPBITS(sfs));
+		sfs->sfs_inodemapdirtyblocks =
+			bitmap_create(SFS_FS_INODEMAPBLOCKS(sfs));
+		if (sfs->sfs_inodemap == NULL ||
+		    sfs->sfs_inodemapdirtyblocks == NULL) {
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return ENOMEM;
+		}
+	}
+	result = sfs_freemap_read(sfs);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* Check the allocation group counts against the bitmaps */
+	sfs_groups_setup(sfs);
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -479,3 +842,32 @@ sfs_mount(const char *device)
 {
 	return vfs_mount(device, NULL, sfs_domount);
 }
+
+/*
+ * Arrange for the volume on DEVICE to "crash" once its next
+ * transaction is in the log: from then on nothing more reaches the
+ * disk, so what's there is what recovery would find after the system
+ * went down at that point. Unmount and mount it again to recover.
+ */
+int
+sfs_crash(const char *device)
+{
+	struct vnode *root;
+	int result;
+
+	vfs_biglock_acquire();
+	result = vfs_getroot(device, &root);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+	if (root->vn_fs == NULL || root->vn_fs->fs_ops != &sfs_fsops) {
+		result = EINVAL;
+	}
+	else {
+		result = sfs_jcrash(root->vn_fs->fs_data);
+	}
+	VOP_DECREF(root);
+	vfs_biglock_release();
+	return result;
+}
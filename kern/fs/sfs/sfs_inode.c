@@ -35,23 +35,66 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Find inode INO on disk: the block it's in, and its offset and size
+ * within the block. In the original format the inode is the whole
+ * block; in the packed format it's one slot of an inode table block.
+ */
+void
+sfs_inodeloc(struct sfs_fs *sfs, uint32_t ino, daddr_t *block,
+	     size_t *offset, size_t *size)
+{
+	if (sfs->sfs_sb.sb_version == SFS_VERSION_ORIG) {
+		*block = ino;
+		*offset = 0;
+		*size = SFS_BLOCKSIZE;
+		return;
+	}
+
+	KASSERT(ino < sfs->sfs_sb.sb_ninodes);
+	*block = sfs->sfs_sb.sb_inodetablestart + ino / SFS_INOPB;
+	*offset = (ino % SFS_INOPB) * SFS_PINODESIZE;
+	*size = SFS_PINODESIZE;
+}
+
+/*
+ * Write an on-disk inode structure back out to disk. Call with the
+ * vnode lock held for writing.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	daddr_t block;
+	size_t offset, size;
 	int result;
 
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		sfs_inodeloc(sfs, sv->sv_ino, &block, &offset, &size);
+		if (size == SFS_BLOCKSIZE) {
+			/* The inode is the whole block; no need to read it */
+			result = buffer_get(&sfs->sfs_absfs, block,
+					    SFS_BLOCKSIZE, &buf);
+		}
+		else {
+			/* We share the block with other inodes */
+			result = buffer_read(&sfs->sfs_absfs, block,
+					     SFS_BLOCKSIZE, &buf);
+		}
+		if (result) {
+			return result;
+		}
+		memcpy((char *)buffer_map(buf) + offset, &sv->sv_i, size);
+		result = sfs_jmodified(sfs, buf, block);
+		buffer_release(buf);
 		if (result) {
 			return result;
 		}
@@ -60,6 +103,143 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+/*
+ * The table of loaded vnodes. Each vnode is in the sfs_vnodes array,
+ * which is what sync and unmount walk, and in a hash table keyed on
+ * inode number, which is what lookups use. The vnode remembers its
+ * array index so removal doesn't need a search either. All of these
+ * need sfs_vnlock.
+ */
+
+static
+unsigned
+sfs_vnhash(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino % sfs->sfs_vnhashsize;
+}
+
+static
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhash(sfs, ino)];
+	     sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the number of hash chains. If we can't get the memory, just
+ * carry on with longer chains.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **oldtable, *sv, *next;
+	unsigned oldsize, i, ix;
+
+	oldtable = sfs->sfs_vnhash;
+	oldsize = sfs->sfs_vnhashsize;
+
+	sfs->sfs_vnhash = kmalloc(2 * oldsize * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		sfs->sfs_vnhash = oldtable;
+		return;
+	}
+	sfs->sfs_vnhashsize = 2 * oldsize;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+
+	for (i=0; i<oldsize; i++) {
+		for (sv = oldtable[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			ix = sfs_vnhash(sfs, sv->sv_ino);
+			sv->sv_hashnext = sfs->sfs_vnhash[ix];
+			sfs->sfs_vnhash[ix] = sv;
+		}
+	}
+	kfree(oldtable);
+}
+
+static
+int
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned ix;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, &sv->sv_index);
+	if (result) {
+		return result;
+	}
+
+	ix = sfs_vnhash(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[ix];
+	sfs->sfs_vnhash[ix] = sv;
+
+	/* Keep the chains short on average */
+	if (vnodearray_num(sfs->sfs_vnodes) > 2 * sfs->sfs_vnhashsize) {
+		sfs_vnhash_grow(sfs);
+	}
+	return 0;
+}
+
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp, *last;
+	unsigned num;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (svp = &sfs->sfs_vnhash[sfs_vnhash(sfs, sv->sv_ino)];
+	     *svp != sv;
+	     svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	/* Move the last vnode in the array into our slot. */
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_index < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_index) ==
+		&sv->sv_absvn);
+	last = vnodearray_get(sfs->sfs_vnodes, num - 1)->vn_data;
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_index, &last->sv_absvn);
+	last->sv_index = sv->sv_index;
+	vnodearray_setsize(sfs->sfs_vnodes, num - 1);
+}
+
+/*
+ * Give up on reclaiming a vnode: make it findable again.
+ */
+static
+void
+sfs_reclaim_abort(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_reclaiming = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,15 +250,16 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/* Freeing the file's blocks and inode is a transaction */
+	sfs_trans_begin(sfs);
+
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,16 +269,34 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		sfs_trans_end(sfs);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * Mark the vnode so that sfs_loadvnode waits for us instead of
+	 * handing it out again, and sfs_sync_vnodes leaves it alone.
+	 * Then let go of the table, so truncating and syncing (which
+	 * can mean a lot of disk I/O) doesn't hold up everyone else on
+	 * the volume.
+	 */
+	sv->sv_reclaiming = true;
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Ours is the only reference and nobody can get another, so
+	 * nobody else can be holding or waiting for sv_lock, and we
+	 * don't need it.
+	 */
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			sfs_reclaim_abort(sfs, sv);
+			sfs_trans_end(sfs);
 			return result;
 		}
 	}
@@ -105,35 +304,31 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		sfs_reclaim_abort(sfs, sv);
+		sfs_trans_end(sfs);
 		return result;
 	}
 
+	lock_acquire(sfs->sfs_vnlock);
+
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+		sfs_ifree(sfs, sv->sv_ino);
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vntable_remove(sfs, sv);
 
-	vnode_cleanup(&sv->sv_absvn);
+	/* Anyone waiting for it can now load the inode afresh */
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+	sfs_trans_end(sfs);
 
-	vfs_biglock_release();
+	vnode_cleanup(&sv->sv_absvn);
+	rwlock_destroy(sv->sv_lock);
+	sfs_dir_dropindex(sv);
+	sfs_bmap_dropcache(sv);
+	spinlock_cleanup(&sv->sv_ibclock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -144,75 +339,108 @@ sfs_reclaim(struct vnode *v)
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident. Takes the vnode table lock.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	struct buf *buf;
+	daddr_t block;
+	size_t offset, size;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	lock_acquire(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	/* Look in the vnodes table */
+ again:
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
+		if (sv->sv_reclaiming) {
+			/* On its way out; wait, then look again */
+			cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+			goto again;
+		}
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
+		/* Every inode in memory must be allocated */
+		if (!sfs_iused(sfs, sv->sv_ino)) {
+			panic("sfs: %s: Found unallocated inode %u\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_lock = rwlock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
-	/* Must be in an allocated block */
-	if (!sfs_bused(sfs, ino)) {
-		panic("sfs: %s: Tried to load inode %u from "
-		      "unallocated block\n", sfs->sfs_sb.sb_volname, ino);
+	/* Must be allocated */
+	if (!sfs_iused(sfs, ino)) {
+		panic("sfs: %s: Tried to load unallocated inode %u\n",
+		      sfs->sfs_sb.sb_volname, ino);
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+	sfs_inodeloc(sfs, ino, &block, &offset, &size);
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, &buf);
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	/* A packed inode is the front of struct sfs_dinode; zero the rest */
+	bzero(&sv->sv_i, sizeof(sv->sv_i));
+	memcpy(&sv->sv_i, (char *)buffer_map(buf) + offset, size);
+	buffer_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_reclaiming = false;
+
+	/* Directories get a name index when first searched */
+	sv->sv_dirindex = NULL;
+
+	/* No reads yet; a first read from the start counts as sequential */
+	sv->sv_ra_pos = 0;
+	sv->sv_ra_window = 0;
+	sv->sv_ra_next = 0;
+
+	/* No index block cached yet */
+	spinlock_init(&sv->sv_ibclock);
+	sv->sv_ibcbase = 0;
+	sv->sv_ibcblock = 0;
+	sv->sv_ibcdata = NULL;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
-	 * block on disk will have been zeroed out by sfs_balloc and
+	 * inode on disk will have been zeroed out by sfs_ialloc and
 	 * thus the type recorded there will be SFS_TYPE_INVAL.
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		/* It's empty, so its contents fit inline */
+		sv->sv_i.sfi_flags = SFS_IFLAG_INLINE;
 		sv->sv_dirty = true;
 	}
 
@@ -235,41 +463,61 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		spinlock_cleanup(&sv->sv_ibclock);
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
 
+	/* Until we know better, put the file's blocks near its inode */
+	sv->sv_goal = sfs_datagoal(sfs, ino);
+
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
+	result = sfs_vntable_add(sfs, sv);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
+		spinlock_cleanup(&sv->sv_ibclock);
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
 }
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object in directory DIR and hand back its
+ * vnode.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+	    struct sfs_vnode **ret)
 {
-	uint32_t ino;
+	uint32_t ino, goal;
 	int result;
 
 	/*
-	 * First, get an inode. (Each inode is a block, and the inode
-	 * number is the block number, so just get a block.)
+	 * First, get an inode. Put a file near the directory, so the
+	 * inodes of files in the same directory end up together; put
+	 * a directory in a group with room to spare for its files.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	if (type == SFS_TYPE_DIR) {
+		goal = sfs_dirgoal(sfs);
+	}
+	else {
+		goal = dir->sv_ino + 1;
+	}
+	result = sfs_ialloc(sfs, goal, &ino);
 	if (result) {
 		return result;
 	}
@@ -280,14 +528,14 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 
 	result = sfs_loadvnode(sfs, ino, type, ret);
 	if (result) {
-		sfs_bfree(sfs, ino);
+		sfs_ifree(sfs, ino);
 	}
 	return result;
 }
 
 /*
  * Get vnode for the root of the filesystem.
- * The root vnode is always found in block 1 (SFS_ROOTDIR_INO).
+ * The root vnode is always inode 1 (SFS_ROOTDIR_INO).
  */
 int
 sfs_getroot(struct fs *fs, struct vnode **ret)
@@ -296,25 +544,20 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
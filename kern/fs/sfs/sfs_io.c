@@ -38,6 +38,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -50,10 +51,17 @@
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
  * except sfs_device.
+ *
+ * Apart from the superblock and freemap, which we keep our own
+ * copies of, blocks should be accessed through the buffer cache;
+ * these routines are what it uses to fill and flush buffers. (The one
+ * exception is sfs_runio, which moves long runs of file data directly
+ * and keeps the cache coherent itself.)
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read or write a block (or a run of contiguous blocks, according to
+ * the uio), retrying I/O errors.
  */
 static
 int
@@ -62,12 +70,23 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	/*
+	 * Note that the buffer cache's readahead and syncer threads
+	 * call us without any SFS locks. That's fine; the device does
+	 * its own locking and we don't touch anything else.
+	 */
 
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
 
+	if (uio->uio_rw == UIO_WRITE && sfs->sfs_crashed) {
+		/* Testing recovery (sfs_jcrash); pretend it went out */
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
+
  retry:
 	result = DEVOP_IO(sfs->sfs_device, uio);
 	if (result == EINVAL) {
@@ -102,7 +121,8 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block, or with LEN a multiple of the block size, that many
+ * consecutive blocks in one request.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -110,14 +130,42 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Read NBLOCKS consecutive blocks of LEN bytes each into the separate
+ * buffers described by IOV, in one request. (For buffer cache
+ * readahead.)
+ */
+int
+sfs_readblocks(struct sfs_fs *sfs, daddr_t block, struct iovec *iov,
+	       unsigned nblocks, size_t len)
+{
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(nblocks > 0 && len == SFS_BLOCKSIZE);
+	for (i=0; i<nblocks; i++) {
+		KASSERT(iov[i].iov_len == len);
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = nblocks;
+	ku.uio_offset = ((off_t)block)*SFS_BLOCKSIZE;
+	ku.uio_resid = nblocks * len;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Write a block, or consecutive blocks, likewise.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -125,21 +173,199 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
+////////////////////////////////////////////////////////////
+// Readahead
+
+/*
+ * Note where a read starts and adjust the readahead window. A read
+ * that starts where the last one left off is sequential and grows the
+ * window; anything else is a seek and shuts it off again.
+ *
+ * Reads only hold the vnode lock shared, so concurrent readers can
+ * trample each other's readahead state. That's harmless: it's only a
+ * guess about what to fetch, and the worst outcome is a wasted or
+ * missed readahead.
+ */
+static
+void
+sfs_ra_start(struct sfs_vnode *sv, off_t pos)
+{
+	if (pos == sv->sv_ra_pos) {
+		if (sv->sv_ra_window == 0) {
+			sv->sv_ra_window = SFS_RA_MINWINDOW;
+		}
+		else if (sv->sv_ra_window < SFS_RA_MAXWINDOW) {
+			sv->sv_ra_window *= 2;
+		}
+	}
+	else {
+		sv->sv_ra_window = 0;
+		sv->sv_ra_next = 0;
+	}
+}
+
+/*
+ * After a read that ended at POS, start reading the next window's
+ * worth of blocks of the file in the background. Blocks we already
+ * asked for (below sv_ra_next) aren't asked for again. Blocks that
+ * are contiguous on disk are queued as one range, so the buffer
+ * cache can fetch them with a single request.
+ */
+static
+void
+sfs_ra_finish(struct sfs_vnode *sv, off_t pos)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, endblock, eofblock;
+	daddr_t diskblock, runstart = 0;
+	unsigned runlen = 0;
+
+	sv->sv_ra_pos = pos;
+	if (sv->sv_ra_window == 0) {
+		return;
+	}
+
+	/* First block not already (at least partly) read */
+	fileblock = DIVROUNDUP(pos, SFS_BLOCKSIZE);
+	if (fileblock < sv->sv_ra_next) {
+		fileblock = sv->sv_ra_next;
+	}
+
+	/* Stop at the end of the window, or at EOF */
+	endblock = pos / SFS_BLOCKSIZE + sv->sv_ra_window;
+	eofblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (endblock > eofblock) {
+		endblock = eofblock;
+	}
+
+	for (; fileblock < endblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock, NULL)) {
+			break;
+		}
+		if (runlen > 0 && diskblock == runstart + runlen) {
+			runlen++;
+			continue;
+		}
+		if (runlen > 0) {
+			buffer_readahead(&sfs->sfs_absfs, runstart, runlen,
+					 SFS_BLOCKSIZE);
+		}
+		/* Holes have nothing to read */
+		runstart = diskblock;
+		runlen = diskblock != 0 ? 1 : 0;
+	}
+	if (runlen > 0) {
+		buffer_readahead(&sfs->sfs_absfs, runstart, runlen,
+				 SFS_BLOCKSIZE);
+	}
+	if (fileblock > sv->sv_ra_next) {
+		sv->sv_ra_next = fileblock;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Inline data
+
+/*
+ * A file or directory small enough keeps its contents in the spare
+ * space at the end of its inode, sfi_inline, with SFS_IFLAG_INLINE
+ * set and no data blocks at all. Reading it then costs nothing past
+ * loading the inode, and it doesn't use up a block. New objects start
+ * out inline; one that grows past what fits is moved to a real block
+ * by sfs_inline_spill and stays an ordinary file until it's truncated
+ * to nothing. The bytes of sfi_inline past EOF are always zero.
+ */
+
+/*
+ * How much fits inline: only the front of sfi_inline is stored in the
+ * packed format.
+ */
+size_t
+sfs_inline_max(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_sb.sb_version == SFS_VERSION_ORIG) {
+		return SFS_INLINE_MAX;
+	}
+	return SFS_PINLINE_MAX;
+}
+
+/*
+ * Move an inline file's contents out to a data block. Call with the
+ * vnode lock held for writing.
+ */
+int
+sfs_inline_spill(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	daddr_t block;
+	bool fresh;
+	char *ioptr;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_INLINE);
+	KASSERT(sv->sv_i.sfi_size <= sfs_inline_max(sfs));
+
+	if (sv->sv_i.sfi_size > 0) {
+		result = sfs_bmap(sv, 0, true, &block, &fresh);
+		if (result) {
+			return result;
+		}
+		KASSERT(fresh);
+
+		result = buffer_get(&sfs->sfs_absfs, block, SFS_BLOCKSIZE,
+				    &buf);
+		if (result == 0) {
+			ioptr = buffer_map(buf);
+			bzero(ioptr, SFS_BLOCKSIZE);
+			memcpy(ioptr, sv->sv_i.sfi_inline, sv->sv_i.sfi_size);
+			/* A directory's contents are metadata */
+			if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+				result = sfs_jmodified(sfs, buf, block);
+			}
+			else {
+				result = buffer_modified(buf);
+			}
+			buffer_release(buf);
+		}
+		if (result) {
+			/* Give the block back; the data is still inline */
+			sv->sv_i.sfi_direct[0] = 0;
+			sfs_bfree(sfs, block);
+			return result;
+		}
+		bzero(sv->sv_i.sfi_inline, sizeof(sv->sv_i.sfi_inline));
+	}
+
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_INLINE;
+	sv->sv_dirty = true;
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Do I/O to block DISKBLOCK of a file, through the buffer cache. If
+ * we're writing only part of the block, we need to read in the
+ * original block first so we don't clobber the portion of the block
+ * we're not intending to write over; if we're writing all of it, we
+ * don't.
+ *
+ * We also don't read it if there's nothing there worth keeping: if
+ * the block is FRESH (just allocated and never written; see sfs_bmap)
+ * or lies entirely past EOF. Then we build it in memory, starting
+ * from zeros. For a fresh block this is what stands in for sfs_balloc
+ * zeroing it, so it happens even if the copy from the caller fails.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -147,140 +373,250 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
  */
 static
 int
-sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
-	      uint32_t skipstart, uint32_t len)
+sfs_bufio(struct sfs_vnode *sv, struct uio *uio, daddr_t diskblock,
+	  bool fresh, uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t diskblock;
-	uint32_t fileblock;
+	struct buf *buf;
+	char *ioptr;
+	off_t blockpos;
+	bool iswrite, build;
 	int result;
 
-	/* Allocate missing blocks if and only if we're writing */
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
-
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
-	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
-
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
-	}
+	iswrite = (uio->uio_rw == UIO_WRITE);
 
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		KASSERT(!iswrite);
+		return uiomovezeros(len, uio);
+	}
+
+	/* Offset of the start of the block in the file */
+	blockpos = uio->uio_offset - skipstart;
+	KASSERT(blockpos % SFS_BLOCKSIZE == 0);
+
+	build = fresh || (iswrite && blockpos >= (off_t)sv->sv_i.sfi_size);
+	KASSERT(!fresh || iswrite);
+
+	/*
+	 * Get the block. Skip reading it if we're going to overwrite
+	 * all of it anyway, or if there's nothing in it to keep.
+	 */
+	if (build || (iswrite && len == SFS_BLOCKSIZE)) {
+		result = buffer_get(&sfs->sfs_absfs, diskblock,
+				    SFS_BLOCKSIZE, &buf);
 	}
 	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
+		result = buffer_read(&sfs->sfs_absfs, diskblock,
+				     SFS_BLOCKSIZE, &buf);
+	}
+	if (result) {
+		if (fresh) {
+			(void)sfs_clearblock(sfs, diskblock);
 		}
+		return result;
+	}
+	ioptr = buffer_map(buf);
+	if (build) {
+		bzero(ioptr, SFS_BLOCKSIZE);
 	}
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
+	 *
+	 * A write that fails partway still changed the buffer. If it
+	 * held the block contents, that's a partial write and has to
+	 * be kept like any other; if it didn't, the buffer isn't valid
+	 * and goes away when we let go of it.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
+	result = uiomove(ioptr+skipstart, len, uio);
+	if (result && !build && (!iswrite || !buffer_is_valid(buf))) {
+		buffer_release(buf);
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the block is now dirty.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
+	if (iswrite) {
+		int result2;
+
+		result2 = buffer_modified(buf);
+		if (result == 0) {
+			result = result2;
 		}
 	}
 
-	return 0;
+	buffer_release(buf);
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O to a block of a file: find (or, if writing, allocate) the
+ * block and hand off to sfs_bufio.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
+	      uint32_t skipstart, uint32_t len)
 {
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	bool fresh;
 	int result;
+
+	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
-	/* Get the block number within the file */
+	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* Get the disk block number */
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &fresh);
 	if (result) {
 		return result;
 	}
 
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+	return sfs_bufio(sv, uio, diskblock, fresh, skipstart, len);
+}
+
+/*
+ * Check whether a run of direct I/O has to stop short of DISKBLOCK
+ * because of what the buffer cache has: for a read, a cached copy
+ * (which might be dirty, or on its way in); for a write, a dirty one
+ * (whose delayed write we'd otherwise have to discard up front).
+ */
+static
+bool
+sfs_runstop(struct fs *fs, daddr_t diskblock, bool iswrite)
+{
+	if (iswrite) {
+		return buffer_is_dirty(fs, diskblock);
 	}
+	return buffer_is_cached(fs, diskblock);
+}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+/*
+ * Do I/O of one or more whole blocks. If the next blocks of the file
+ * are contiguous on disk, transfer as many of them as we can (up to
+ * SFS_MAXRUN) with a single device request, straight to or from the
+ * caller's memory. Holes, discontinuities, and blocks whose cached
+ * copy we'd have to reckon with (for reads, any; for writes, dirty
+ * ones) end the run; if that leaves only one block we go through the
+ * cache with sfs_bufio instead.
+ *
+ * Reads only cover blocks that aren't cached, so they can't miss
+ * anything dirty. Blocks the readahead thread has claimed are in the
+ * cache already, so a read run stops at them and picks them up from
+ * the cache once they arrive; readahead ranges that are still only
+ * queued are cancelled for the part the run covers, so the blocks
+ * aren't read twice.
+ *
+ * Writes go around the cache. They don't cover dirty blocks, so no
+ * delayed write is lost if the transfer stops partway; we hold the
+ * file locked, so none of the blocks can become dirty meanwhile.
+ * Afterwards, any clean cached copies of the blocks that were written
+ * (or that readahead picked up meanwhile) are discarded.
+ *
+ * Blocks allocated for a write aren't zeroed first, since we're about
+ * to overwrite them. If the write fails partway, the fresh blocks it
+ * didn't reach get zeroed then.
+ */
+static
+int
+sfs_runio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct fs *fs = &sfs->sfs_absfs;
+	struct uio ru;
+	uint32_t fileblock, maxblocks, n, i;
+	daddr_t start, diskblock;
+	size_t len, done;
+	bool iswrite, fresh;
+	uint64_t freshmask;
+	int result;
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
+	COMPILE_ASSERT(SFS_MAXRUN <= 64);
+
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
 
-	result = sfs_rwblock(sfs, uio);
+	iswrite = (uio->uio_rw == UIO_WRITE);
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	maxblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	if (maxblocks > SFS_MAXRUN) {
+		maxblocks = SFS_MAXRUN;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = sfs_bmap(sv, fileblock, iswrite, &start, &fresh);
+	if (result) {
+		return result;
+	}
+	if (start == 0 || sfs_runstop(fs, start, iswrite)) {
+		return sfs_bufio(sv, uio, start, fresh, 0, SFS_BLOCKSIZE);
+	}
+	freshmask = fresh ? 1 : 0;
+
+	for (n=1; n<maxblocks; n++) {
+		result = sfs_bmap(sv, fileblock + n, iswrite, &diskblock,
+				  &fresh);
+		if (result) {
+			/* Do what we have; we'll hit the error next time */
+			break;
+		}
+		if (diskblock != start + n ||
+		    sfs_runstop(fs, diskblock, iswrite)) {
+			if (fresh) {
+				/* We won't get to it this time; zero it */
+				(void)sfs_clearblock(sfs, diskblock);
+			}
+			break;
+		}
+		if (fresh) {
+			freshmask |= (uint64_t)1 << n;
+		}
+	}
+
+	if (n == 1) {
+		return sfs_bufio(sv, uio, start, freshmask != 0,
+				 0, SFS_BLOCKSIZE);
+	}
+	len = n * SFS_BLOCKSIZE;
+
+	if (!iswrite) {
+		buffer_readahead_cancel(fs, start, n);
+	}
+
+	/* Borrow the caller's iovecs, limited to the run */
+	ru = *uio;
+	ru.uio_offset = ((off_t)start) * SFS_BLOCKSIZE;
+	ru.uio_resid = len;
+	result = sfs_rwblock(sfs, &ru);
+
+	/* Advance the caller's uio past whatever got done */
+	done = len - ru.uio_resid;
+	uio->uio_iov = ru.uio_iov;
+	uio->uio_iovcnt = ru.uio_iovcnt;
+	uio->uio_offset += done;
+	uio->uio_resid -= done;
+
+	if (iswrite) {
+		/* Cached copies of what we wrote, even partly, are stale */
+		for (i=0; i < DIVROUNDUP(done, SFS_BLOCKSIZE); i++) {
+			buffer_drop(fs, start + i, SFS_BLOCKSIZE);
+		}
+		for (i = done / SFS_BLOCKSIZE; i<n; i++) {
+			/* Fresh blocks the write didn't cover */
+			if (freshmask & ((uint64_t)1 << i)) {
+				(void)sfs_clearblock(sfs, start + i);
+			}
+		}
+	}
 
 	return result;
 }
@@ -291,13 +627,29 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	uint32_t blkoff;
-	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	bool isinline;
 
 	origresid = uio->uio_resid;
 
+	/*
+	 * An inline file stays inline if the I/O is inside the inline
+	 * area. (Reads past EOF are trimmed off below.) Otherwise it's
+	 * a write that doesn't fit, so move the data out first.
+	 */
+	isinline = (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) != 0;
+	if (isinline && uio->uio_rw == UIO_WRITE &&
+	    uio->uio_offset + uio->uio_resid > (off_t)sfs_inline_max(sfs)) {
+		result = sfs_inline_spill(sv);
+		if (result) {
+			return result;
+		}
+		isinline = false;
+	}
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -317,6 +669,19 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (!isinline) {
+			sfs_ra_start(sv, uio->uio_offset);
+		}
+	}
+
+	if (isinline) {
+		if (uio->uio_rw == UIO_WRITE) {
+			sv->sv_dirty = true;
+		}
+		result = uiomove(sv->sv_i.sfi_inline + uio->uio_offset,
+				 uio->uio_resid, uio);
+		goto out;
 	}
 
 	/*
@@ -348,12 +713,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 * Now we should be block-aligned. Do the remaining whole
+	 * blocks, a contiguous run at a time.
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	while (uio->uio_resid >= SFS_BLOCKSIZE) {
+		result = sfs_runio(sv, uio);
 		if (result) {
 			goto out;
 		}
@@ -373,10 +738,17 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	/* If reading and we got anywhere, keep the readahead going */
+	if (uio->uio_rw == UIO_READ && uio->uio_resid != origresid &&
+	    !isinline) {
+		sfs_ra_finish(sv, uio->uio_offset);
+	}
+
 	/* If writing and we did anything, adjust file length */
 	if (uio->uio_resid != origresid &&
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
+		/* (for an inline file this also covers sv_i.sfi_inline) */
 		sv->sv_i.sfi_size = uio->uio_offset;
 		sv->sv_dirty = true;
 	}
@@ -407,24 +779,50 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	char *ioptr;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
-	bool doalloc;
+	bool doalloc, fresh;
+	size_t inlinemax, inlinelen;
 	int result;
 
 	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
+	 * Inline data lives in the inode. If a write won't fit, move
+	 * it out to a block and carry on below.
 	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		inlinemax = sfs_inline_max(sfs);
+		endpos = actualpos + len;
+		if (rw == UIO_READ) {
+			/* Past the inline area reads as zeros */
+			inlinelen = 0;
+			if (actualpos < (off_t)inlinemax) {
+				inlinelen = len;
+				if (endpos > (off_t)inlinemax) {
+					inlinelen = inlinemax - actualpos;
+				}
+				memcpy(data, sv->sv_i.sfi_inline + actualpos,
+				       inlinelen);
+			}
+			bzero((char *)data + inlinelen, len - inlinelen);
+			return 0;
+		}
+		if (endpos <= (off_t)inlinemax) {
+			memcpy(sv->sv_i.sfi_inline + actualpos, data, len);
+			if (endpos > (off_t)sv->sv_i.sfi_size) {
+				sv->sv_i.sfi_size = endpos;
+			}
+			sv->sv_dirty = true;
+			return 0;
+		}
+		result = sfs_inline_spill(sv);
+		if (result) {
+			return result;
+		}
+	}
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -432,7 +830,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc, &diskblock, &fresh);
 	if (result) {
 		return result;
 	}
@@ -446,24 +844,38 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block; if it's new, there's nothing to read */
+	if (fresh) {
+		result = buffer_get(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
+				    &buf);
+	}
+	else {
+		result = buffer_read(&sfs->sfs_absfs, diskblock,
+				     SFS_BLOCKSIZE, &buf);
+	}
 	if (result) {
+		if (fresh) {
+			(void)sfs_clearblock(sfs, diskblock);
+		}
 		return result;
 	}
+	ioptr = buffer_map(buf);
+	if (fresh) {
+		bzero(ioptr, SFS_BLOCKSIZE);
+	}
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
+		memcpy(ioptr + blockoffset, data, len);
 
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
+		/* The block is now dirty */
+		result = sfs_jmodified(sfs, buf, diskblock);
 		if (result) {
+			buffer_release(buf);
 			return result;
 		}
 
@@ -475,6 +887,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		}
 	}
 
+	buffer_release(buf);
+
 	/* Done */
 	return 0;
 }
@@ -0,0 +1,1119 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Everything that changes metadata runs as part of a transaction,
+ * between sfs_trans_begin and sfs_trans_end. Metadata buffers it
+ * changes go to sfs_jmodified instead of buffer_modified; they join
+ * the running transaction, and sfs_fs_writeblock won't let the buffer
+ * cache write them until it commits. The bitmaps and the superblock
+ * are in memory anyway, and aren't written in place except at a
+ * checkpoint. Blocks a transaction frees aren't given back to the
+ * freemap until it commits, so file data can never land on a block
+ * that the last committed state still uses for metadata.
+ *
+ * sfs_jcommit waits for the transactions in progress to finish and
+ * holds off new ones. Then it puts the inodes in the buffer cache,
+ * writes out file data, and writes the transaction to the log: the
+ * blocks it changed, the changed bitmap blocks, and the superblock,
+ * in as few requests as it can, followed by a commit block. After
+ * that the buffers can go home whenever the cache likes. An fsync
+ * that comes along while a commit is going on waits for it and is
+ * done; it doesn't need one of its own.
+ *
+ * A checkpoint writes everything in place and empties the log. Sync
+ * and unmount do one, and so does sfs_trans_begin when the log is
+ * getting full. If a transaction won't fit in what's left of the log,
+ * what's in the log is replayed in place first, which empties it; if
+ * it won't fit in an empty log, it is written in place, and isn't
+ * atomic.
+ *
+ * Transactions come before vnode locks. They nest (curthread->t_fstrans
+ * counts them), so things like sfs_reclaim that can be called from
+ * inside an operation just join the one already going. j_lock comes
+ * after everything else.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <thread.h>
+#include <current.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Where the journal is and how big; log positions are 1..size-1 */
+#define SFS_JSTART(sfs)  ((sfs)->sfs_sb.sb_journalstart)
+#define SFS_JSIZE(sfs)   ((sfs)->sfs_sb.sb_journalblocks)
+#define SFS_JCAP(sfs)    (SFS_JSIZE(sfs) - 1)
+
+/* Number of descriptor blocks needed for N block numbers */
+#define SFS_JNDESC(n)    (((n) + SFS_JPERDESC - 1) / SFS_JPERDESC)
+
+/*
+ * A growable list of block numbers.
+ */
+struct sfs_jlist {
+	daddr_t *jl_blocks;
+	unsigned jl_num;
+	unsigned jl_max;
+};
+
+/*
+ * In-memory state of the journal.
+ *
+ * The lists are only changed inside transactions, or by the thread
+ * doing a commit once there are none; the bitmaps are also looked at
+ * by the buffer cache, so they need j_lock. j_head and j_stage belong
+ * to the thread doing a commit.
+ */
+struct sfs_journal {
+	struct lock *j_lock;		/* protects everything below */
+	struct cv *j_cv;		/* for j_active and j_committing */
+	unsigned j_active;		/* transactions in progress */
+	bool j_committing;		/* a commit is going on */
+	uint32_t j_seq;			/* number of the running transaction */
+	uint32_t j_head;		/* where in the log it will go */
+	uint32_t j_used;		/* log blocks used since checkpoint */
+	uint32_t j_fixed;		/* most bitmap etc. blocks per commit */
+	struct bitmap *j_running;	/* blocks it changed */
+	struct bitmap *j_revoked;	/* blocks it freed */
+	struct bitmap *j_logged;	/* blocks with copies in the log */
+	struct sfs_jlist j_touched;	/* blocks in j_running or j_revoked */
+	struct sfs_jlist j_frees;	/* blocks to free when it commits */
+	char *j_stage;			/* blocks waiting to go to the log */
+	unsigned j_nstaged;		/* how many */
+	bool j_crash;			/* testing: crash after next commit */
+};
+
+////////////////////////////////////////////////////////////
+// Utility functions
+
+static
+int
+sfs_jlist_add(struct sfs_jlist *jl, daddr_t block)
+{
+	daddr_t *newblocks;
+	unsigned newmax;
+
+	if (jl->jl_num == jl->jl_max) {
+		newmax = jl->jl_max == 0 ? 64 : jl->jl_max * 2;
+		newblocks = kmalloc(newmax * sizeof(daddr_t));
+		if (newblocks == NULL) {
+			return ENOMEM;
+		}
+		if (jl->jl_num > 0) {
+			memcpy(newblocks, jl->jl_blocks,
+			       jl->jl_num * sizeof(daddr_t));
+		}
+		kfree(jl->jl_blocks);
+		jl->jl_blocks = newblocks;
+		jl->jl_max = newmax;
+	}
+	jl->jl_blocks[jl->jl_num++] = block;
+	return 0;
+}
+
+/*
+ * Move N blocks along the log from POS, wrapping around at the end.
+ */
+static
+uint32_t
+sfs_jadvance(struct sfs_fs *sfs, uint32_t pos, uint32_t n)
+{
+	return (pos - 1 + n) % SFS_JCAP(sfs) + 1;
+}
+
+/*
+ * Check if BLOCK is somewhere a log record may put a block back:
+ * inside the volume, and not in the journal itself.
+ */
+static
+bool
+sfs_jhome_ok(struct sfs_fs *sfs, daddr_t block)
+{
+	return block < sfs->sfs_sb.sb_nblocks &&
+		(block < SFS_JSTART(sfs) ||
+		 block >= SFS_JSTART(sfs) + SFS_JSIZE(sfs));
+}
+
+/*
+ * Clear all the bits of a bitmap sized for the whole volume.
+ */
+static
+void
+sfs_jclearmap(struct sfs_fs *sfs, struct bitmap *map)
+{
+	bzero(bitmap_getdata(map),
+	      SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks) * SFS_BLOCKSIZE);
+	bitmap_refresh(map);
+}
+
+/*
+ * Check if the log might run out of room for the running transaction
+ * once the ones in progress, and one more, have added to it. Call
+ * with j_lock held.
+ */
+static
+bool
+sfs_jfull(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t need;
+
+	need = j->j_touched.jl_num + j->j_fixed +
+		(j->j_active + 1) * SFS_JOPBLOCKS;
+	need += SFS_JNDESC(need);
+	return j->j_used + need > SFS_JCAP(sfs);
+}
+
+////////////////////////////////////////////////////////////
+// Writing the log
+
+/*
+ * Write the staged blocks to the log at j_head.
+ */
+static
+int
+sfs_jflush(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned done, run;
+	int result;
+
+	for (done = 0; done < j->j_nstaged; done += run) {
+		run = j->j_nstaged - done;
+		if (run > SFS_JSIZE(sfs) - j->j_head) {
+			run = SFS_JSIZE(sfs) - j->j_head;
+		}
+		result = sfs_writeblock(sfs, SFS_JSTART(sfs) + j->j_head,
+					j->j_stage + done * SFS_BLOCKSIZE,
+					run * SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+		j->j_head = sfs_jadvance(sfs, j->j_head, run);
+	}
+
+	lock_acquire(j->j_lock);
+	j->j_used += j->j_nstaged;
+	lock_release(j->j_lock);
+	j->j_nstaged = 0;
+	return 0;
+}
+
+/*
+ * Get the next staging block, writing out the ones before it if
+ * they fill the staging area.
+ */
+static
+int
+sfs_jslot(struct sfs_fs *sfs, void **ret)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j->j_nstaged == SFS_JSTAGEBLOCKS) {
+		result = sfs_jflush(sfs);
+		if (result) {
+			return result;
+		}
+	}
+	*ret = j->j_stage + j->j_nstaged * SFS_BLOCKSIZE;
+	bzero(*ret, SFS_BLOCKSIZE);
+	j->j_nstaged++;
+	return 0;
+}
+
+/*
+ * Copy the current contents of BLOCK into DEST.
+ */
+static
+int
+sfs_jcopy(struct sfs_fs *sfs, daddr_t block, void *dest)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	uint32_t mapblocks;
+	struct buf *buf;
+	int result;
+
+	if (block == SFS_SUPER_BLOCK) {
+		lock_acquire(sfs->sfs_freemaplock);
+		memcpy(dest, sb, SFS_BLOCKSIZE);
+		lock_release(sfs->sfs_freemaplock);
+		return 0;
+	}
+
+	mapblocks = SFS_FREEMAPBLOCKS(sb->sb_nblocks);
+	if (block >= SFS_FREEMAP_START &&
+	    block < SFS_FREEMAP_START + mapblocks) {
+		lock_acquire(sfs->sfs_freemaplock);
+		memcpy(dest, (char *)bitmap_getdata(sfs->sfs_freemap) +
+		       (block - SFS_FREEMAP_START) * SFS_BLOCKSIZE,
+		       SFS_BLOCKSIZE);
+		lock_release(sfs->sfs_freemaplock);
+		return 0;
+	}
+
+	mapblocks = SFS_INODEMAPBLOCKS(sb->sb_ninodes);
+	if (sfs->sfs_inodemap != NULL && block >= sb->sb_inodemapstart &&
+	    block < sb->sb_inodemapstart + mapblocks) {
+		lock_acquire(sfs->sfs_freemaplock);
+		memcpy(dest, (char *)bitmap_getdata(sfs->sfs_inodemap) +
+		       (block - sb->sb_inodemapstart) * SFS_BLOCKSIZE,
+		       SFS_BLOCKSIZE);
+		lock_release(sfs->sfs_freemaplock);
+		return 0;
+	}
+
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(dest, buffer_map(buf), SFS_BLOCKSIZE);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Write descriptor records for the blocks in LIST, with copies of
+ * the blocks after them if MAGIC is SFS_JDESC_MAGIC.
+ */
+static
+int
+sfs_jwrite_records(struct sfs_fs *sfs, uint32_t magic, struct sfs_jlist *list)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jdesc *jd;
+	void *data;
+	unsigned i, k, n;
+	int result;
+
+	for (i=0; i<list->jl_num; i += n) {
+		n = list->jl_num - i;
+		if (n > SFS_JPERDESC) {
+			n = SFS_JPERDESC;
+		}
+
+		result = sfs_jslot(sfs, (void **)&jd);
+		if (result) {
+			return result;
+		}
+		jd->jd_magic = magic;
+		jd->jd_seq = j->j_seq;
+		jd->jd_count = n;
+		memcpy(jd->jd_blocks, &list->jl_blocks[i], n * sizeof(daddr_t));
+
+		if (magic != SFS_JDESC_MAGIC) {
+			continue;
+		}
+		for (k=0; k<n; k++) {
+			result = sfs_jslot(sfs, &data);
+			if (result) {
+				return result;
+			}
+			result = sfs_jcopy(sfs, list->jl_blocks[i+k], data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the running transaction to the log: copies of the blocks in
+ * COPIES, revoke records for REVOKES, and, once all of that is on the
+ * disk, the commit block. If anything goes wrong, the log is left as
+ * if we hadn't started.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs, struct sfs_jlist *copies,
+	   struct sfs_jlist *revokes)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jcommit *jc;
+	uint32_t head, used;
+	int result;
+
+	head = j->j_head;
+	used = j->j_used;
+
+	result = sfs_jwrite_records(sfs, SFS_JDESC_MAGIC, copies);
+	if (result == 0) {
+		result = sfs_jwrite_records(sfs, SFS_JREVOKE_MAGIC, revokes);
+	}
+	if (result == 0) {
+		result = sfs_jflush(sfs);
+	}
+	if (result == 0) {
+		result = sfs_jslot(sfs, (void **)&jc);
+		KASSERT(result == 0);
+		jc->jc_magic = SFS_JCOMMIT_MAGIC;
+		jc->jc_seq = j->j_seq;
+		result = sfs_jflush(sfs);
+	}
+	if (result) {
+		/* Write over whatever made it out next time */
+		j->j_nstaged = 0;
+		j->j_head = head;
+		lock_acquire(j->j_lock);
+		j->j_used = used;
+		lock_release(j->j_lock);
+	}
+	return result;
+}
+
+/*
+ * Empty the log: the next transaction goes at the start of it.
+ */
+static
+int
+sfs_jreset(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jheader *jh;
+	int result;
+
+	KASSERT(j->j_nstaged == 0);
+	jh = (struct sfs_jheader *)j->j_stage;
+	bzero(jh, SFS_BLOCKSIZE);
+	jh->jh_magic = SFS_JHEADER_MAGIC;
+	jh->jh_seq = j->j_seq;
+	jh->jh_start = 1;
+	result = sfs_writeblock(sfs, SFS_JSTART(sfs), jh, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(j->j_lock);
+	j->j_head = 1;
+	j->j_used = 0;
+	sfs_jclearmap(sfs, j->j_logged);
+	lock_release(j->j_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Recovery
+
+/*
+ * Find the committed transactions in the log and write the newest
+ * copy of each block in them back in place. This doesn't go through
+ * the buffer cache. Hands back the number the next transaction should
+ * have and the number of transactions replayed.
+ *
+ * Going from the newest transaction back means the first copy of a
+ * block we see is the one to keep; a revoke record means the block
+ * was freed, and no older copy of it is wanted either.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs, uint32_t *nextseq, unsigned *ntrans)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jheader *jh;
+	struct sfs_jdesc *jd;
+	char *data;
+	struct bitmap *done;
+	uint32_t *starts;
+	uint32_t pos, seq, left, txstart, adv, block, i;
+	unsigned n, t;
+	int result;
+
+	KASSERT(j->j_nstaged == 0);
+	jd = (struct sfs_jdesc *)j->j_stage;
+	data = j->j_stage + SFS_BLOCKSIZE;
+
+	jh = (struct sfs_jheader *)jd;
+	result = sfs_readblock(sfs, SFS_JSTART(sfs), jh, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	if (jh->jh_magic != SFS_JHEADER_MAGIC || jh->jh_start == 0 ||
+	    jh->jh_start >= SFS_JSIZE(sfs)) {
+		kprintf("sfs: %s: Bad journal header\n",
+			sfs->sfs_sb.sb_volname);
+		return EINVAL;
+	}
+	pos = txstart = jh->jh_start;
+	seq = jh->jh_seq;
+
+	/* Every transaction takes at least two blocks */
+	starts = kmalloc((SFS_JCAP(sfs) / 2 + 1) * sizeof(uint32_t));
+	if (starts == NULL) {
+		return ENOMEM;
+	}
+
+	/* Find where each complete transaction starts */
+	n = 0;
+	for (left = SFS_JCAP(sfs); left > 0; left -= adv) {
+		result = sfs_readblock(sfs, SFS_JSTART(sfs) + pos, jd,
+				       SFS_BLOCKSIZE);
+		if (result) {
+			kfree(starts);
+			return result;
+		}
+		if (jd->jd_seq != seq) {
+			break;
+		}
+		if (jd->jd_magic == SFS_JDESC_MAGIC &&
+		    jd->jd_count > 0 && jd->jd_count <= SFS_JPERDESC) {
+			adv = 1 + jd->jd_count;
+		}
+		else if (jd->jd_magic == SFS_JREVOKE_MAGIC &&
+			 jd->jd_count <= SFS_JPERDESC) {
+			adv = 1;
+		}
+		else if (jd->jd_magic == SFS_JCOMMIT_MAGIC) {
+			adv = 1;
+		}
+		else {
+			break;
+		}
+		if (adv > left) {
+			break;
+		}
+		pos = sfs_jadvance(sfs, pos, adv);
+		if (jd->jd_magic == SFS_JCOMMIT_MAGIC) {
+			starts[n++] = txstart;
+			txstart = pos;
+			seq++;
+		}
+	}
+
+	done = bitmap_create(SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks));
+	if (done == NULL) {
+		kfree(starts);
+		return ENOMEM;
+	}
+
+	for (t = n; t-- > 0; ) {
+		pos = starts[t];
+		while (1) {
+			result = sfs_readblock(sfs, SFS_JSTART(sfs) + pos, jd,
+					       SFS_BLOCKSIZE);
+			if (result) {
+				goto out;
+			}
+			if (jd->jd_magic == SFS_JCOMMIT_MAGIC) {
+				break;
+			}
+			for (i=0; i<jd->jd_count; i++) {
+				block = jd->jd_blocks[i];
+				/* Skip anything that can't be right */
+				if (!sfs_jhome_ok(sfs, block) ||
+				    bitmap_isset(done, block)) {
+					continue;
+				}
+				bitmap_mark(done, block);
+				if (jd->jd_magic != SFS_JDESC_MAGIC) {
+					continue;
+				}
+				result = sfs_readblock(sfs, SFS_JSTART(sfs) +
+						sfs_jadvance(sfs, pos, 1 + i),
+						data, SFS_BLOCKSIZE);
+				if (result == 0) {
+					result = sfs_writeblock(sfs, block,
+						data, SFS_BLOCKSIZE);
+				}
+				if (result) {
+					goto out;
+				}
+			}
+			pos = sfs_jadvance(sfs, pos,
+				jd->jd_magic == SFS_JDESC_MAGIC ?
+				1 + jd->jd_count : 1);
+		}
+	}
+
+	*nextseq = seq;
+	*ntrans = n;
+	result = 0;
+ out:
+	bitmap_destroy(done);
+	kfree(starts);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Commit
+
+/*
+ * Give the blocks the running transaction freed back to the freemap.
+ */
+static
+void
+sfs_jdofrees(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned i;
+
+	for (i=0; i<j->j_frees.jl_num; i++) {
+		sfs_freemap_release(sfs, j->j_frees.jl_blocks[i]);
+	}
+	j->j_frees.jl_num = 0;
+}
+
+/*
+ * Make lists of the blocks to log for the running transaction, and
+ * of the freed blocks there are copies of in the log.
+ */
+static
+int
+sfs_jcollect(struct sfs_fs *sfs, struct sfs_jlist *copies,
+	     struct sfs_jlist *revokes)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	daddr_t block;
+	unsigned i;
+	int result = 0;
+
+	copies->jl_num = 0;
+	revokes->jl_num = 0;
+
+	lock_acquire(j->j_lock);
+	for (i=0; i<j->j_touched.jl_num && result == 0; i++) {
+		block = j->j_touched.jl_blocks[i];
+		if (bitmap_isset(j->j_revoked, block)) {
+			if (bitmap_isset(j->j_logged, block)) {
+				result = sfs_jlist_add(revokes, block);
+			}
+		}
+		else {
+			result = sfs_jlist_add(copies, block);
+		}
+	}
+	lock_release(j->j_lock);
+	if (result) {
+		return result;
+	}
+
+	/* The bitmap blocks changed since the last checkpoint */
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<SFS_FREEMAPBLOCKS(sb->sb_nblocks) && result == 0; i++) {
+		if (bitmap_isset(sfs->sfs_freemapdirtyblocks, i)) {
+			result = sfs_jlist_add(copies, SFS_FREEMAP_START + i);
+		}
+	}
+	if (sfs->sfs_inodemap != NULL) {
+		for (i=0; i<SFS_INODEMAPBLOCKS(sb->sb_ninodes) &&
+			     result == 0; i++) {
+			if (bitmap_isset(sfs->sfs_inodemapdirtyblocks, i)) {
+				result = sfs_jlist_add(copies,
+						sb->sb_inodemapstart + i);
+			}
+		}
+	}
+	if (sfs->sfs_superdirty && result == 0) {
+		result = sfs_jlist_add(copies, SFS_SUPER_BLOCK);
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return result;
+}
+
+/*
+ * The running transaction is over; let its blocks go home and start
+ * the next one. LOGGED says whether it went to the log.
+ */
+static
+void
+sfs_jendtrans(struct sfs_fs *sfs, bool logged)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	daddr_t block;
+	unsigned i;
+
+	lock_acquire(j->j_lock);
+	for (i=0; i<j->j_touched.jl_num; i++) {
+		block = j->j_touched.jl_blocks[i];
+		if (bitmap_isset(j->j_revoked, block)) {
+			bitmap_unmark(j->j_revoked, block);
+			/* Revoked now, so the old copies don't count */
+			if (bitmap_isset(j->j_logged, block)) {
+				bitmap_unmark(j->j_logged, block);
+			}
+		}
+		else if (logged && !bitmap_isset(j->j_logged, block)) {
+			bitmap_mark(j->j_logged, block);
+		}
+		if (bitmap_isset(j->j_running, block)) {
+			bitmap_unmark(j->j_running, block);
+		}
+	}
+	j->j_touched.jl_num = 0;
+	if (logged) {
+		j->j_seq++;
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Checkpoint: write everything in place and empty the log. There
+ * must not be a running transaction with anything in it.
+ */
+static
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(sfs->sfs_journal->j_touched.jl_num == 0);
+
+	result = buffer_sync_fs(&sfs->sfs_absfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_sync_superblock(sfs);
+	if (result) {
+		return result;
+	}
+	return sfs_jreset(sfs);
+}
+
+/*
+ * Do the work of a commit. There are no transactions in progress.
+ */
+static
+int
+sfs_jdocommit(struct sfs_fs *sfs, bool checkpoint)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jlist copies = { NULL, 0, 0 }, revokes = { NULL, 0, 0 };
+	uint32_t need, seq;
+	unsigned ntrans;
+	int result;
+
+	/* Get the inodes into the buffer cache */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Nothing else will be freed now */
+	sfs_jdofrees(sfs);
+
+	/*
+	 * Write out file data before the metadata that refers to it.
+	 * The transaction's metadata stays in the cache; buffer_sync_fs
+	 * passes it over.
+	 */
+	result = buffer_sync_fs(&sfs->sfs_absfs);
+	if (result) {
+		return result;
+	}
+
+	result = sfs_jcollect(sfs, &copies, &revokes);
+	if (result) {
+		goto out;
+	}
+	if (copies.jl_num == 0 && revokes.jl_num == 0) {
+		sfs_jendtrans(sfs, false);
+		goto done;
+	}
+
+	need = SFS_JNDESC(copies.jl_num) + copies.jl_num +
+		SFS_JNDESC(revokes.jl_num) + 1;
+	if (need > SFS_JCAP(sfs) - j->j_used) {
+		/* Not enough room; get what's in the log out of it */
+		result = sfs_jreplay(sfs, &seq, &ntrans);
+		if (result) {
+			goto out;
+		}
+		result = sfs_jreset(sfs);
+		if (result) {
+			goto out;
+		}
+		/* Nothing is in the log now, so nothing needs revoking */
+		revokes.jl_num = 0;
+		need = SFS_JNDESC(copies.jl_num) + copies.jl_num + 1;
+	}
+
+	if (need > SFS_JCAP(sfs)) {
+		kprintf("sfs: %s: Transaction of %u blocks too big for the "
+			"journal; writing it in place\n",
+			sfs->sfs_sb.sb_volname, need);
+		sfs_jendtrans(sfs, false);
+		checkpoint = true;
+	}
+	else {
+		result = sfs_jwrite(sfs, &copies, &revokes);
+		if (result) {
+			goto out;
+		}
+		sfs_jendtrans(sfs, true);
+		if (j->j_crash) {
+			kprintf("sfs: %s: Crashing after transaction %u\n",
+				sfs->sfs_sb.sb_volname, j->j_seq - 1);
+			sfs->sfs_crashed = true;
+		}
+	}
+
+ done:
+	if (checkpoint) {
+		result = sfs_jcheckpoint(sfs);
+	}
+ out:
+	kfree(copies.jl_blocks);
+	kfree(revokes.jl_blocks);
+	return result;
+}
+
+/*
+ * Commit the running transaction, and do a checkpoint after it if
+ * CHECKPOINT is set. Must not be called from inside a transaction.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs, bool checkpoint)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t seq;
+	int result;
+
+	KASSERT(j != NULL);
+	KASSERT(curthread->t_fstrans == 0);
+
+	lock_acquire(j->j_lock);
+	seq = j->j_seq;
+	while (j->j_committing) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	if (!checkpoint && j->j_seq != seq) {
+		/*
+		 * Whatever the caller did was finished by the time that
+		 * commit was waiting for transactions to end, so it went
+		 * with that one.
+		 */
+		lock_release(j->j_lock);
+		return 0;
+	}
+	j->j_committing = true;
+	while (j->j_active > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+
+	/* Anything we do (sfs_reclaim, say) joins the running transaction */
+	curthread->t_fstrans = 1;
+	result = sfs_jdocommit(sfs, checkpoint);
+	curthread->t_fstrans = 0;
+
+	lock_acquire(j->j_lock);
+	j->j_committing = false;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+	return result;
+}
+
+/*
+ * For testing recovery: the next transaction that goes to the log is
+ * the last thing written to the volume, as in a crash right after it
+ * commits. After that sfs_rwblock drops every write, including the
+ * checkpoint at unmount, so the next mount has to replay the log.
+ */
+int
+sfs_jcrash(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return EINVAL;
+	}
+	lock_acquire(j->j_lock);
+	j->j_crash = true;
+	lock_release(j->j_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Transactions
+
+/*
+ * Start (or join) a transaction.
+ */
+void
+sfs_trans_begin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return;
+	}
+	if (curthread->t_fstrans > 0) {
+		curthread->t_fstrans++;
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	if (!j->j_committing &&
+	    (j->j_used > 0 || j->j_touched.jl_num > 0) && sfs_jfull(sfs)) {
+		lock_release(j->j_lock);
+		result = sfs_jcommit(sfs, true);
+		if (result) {
+			kprintf("sfs: %s: journal checkpoint: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
+		lock_acquire(j->j_lock);
+	}
+	while (j->j_committing) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_active++;
+	lock_release(j->j_lock);
+
+	curthread->t_fstrans = 1;
+}
+
+/*
+ * Finish a transaction.
+ */
+void
+sfs_trans_end(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(curthread->t_fstrans > 0);
+	if (--curthread->t_fstrans > 0) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_active > 0);
+	j->j_active--;
+	if (j->j_active == 0 && j->j_committing) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Use instead of buffer_modified for a held metadata buffer BUF, which
+ * is for block BLOCK. With a journal, the buffer becomes part of the
+ * running transaction, and stays in the cache until it commits.
+ */
+int
+sfs_jmodified(struct sfs_fs *sfs, struct buf *buf, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return buffer_modified(buf);
+	}
+	KASSERT(curthread->t_fstrans > 0);
+
+	lock_acquire(j->j_lock);
+	if (!bitmap_isset(j->j_running, block)) {
+		if (!bitmap_isset(j->j_revoked, block)) {
+			result = sfs_jlist_add(&j->j_touched, block);
+			if (result) {
+				lock_release(j->j_lock);
+				return result;
+			}
+		}
+		bitmap_mark(j->j_running, block);
+	}
+	if (bitmap_isset(j->j_revoked, block)) {
+		bitmap_unmark(j->j_revoked, block);
+	}
+	lock_release(j->j_lock);
+
+	buffer_mark_dirty(buf);
+	return 0;
+}
+
+/*
+ * Called from sfs_bfree. With a journal the block isn't freed until
+ * the running transaction commits; returns true if that's arranged,
+ * false if the caller should free it now.
+ */
+bool
+sfs_jfree(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool revoke;
+
+	if (j == NULL) {
+		return false;
+	}
+	KASSERT(curthread->t_fstrans > 0);
+
+	lock_acquire(j->j_lock);
+	if (sfs_jlist_add(&j->j_frees, block)) {
+		lock_release(j->j_lock);
+		return false;
+	}
+
+	/* Don't log it, and don't replay old copies of it either */
+	revoke = !bitmap_isset(j->j_revoked, block) &&
+		(bitmap_isset(j->j_running, block) ||
+		 bitmap_isset(j->j_logged, block));
+	if (revoke) {
+		if (!bitmap_isset(j->j_running, block) &&
+		    sfs_jlist_add(&j->j_touched, block)) {
+			j->j_frees.jl_num--;
+			lock_release(j->j_lock);
+			return false;
+		}
+		bitmap_mark(j->j_revoked, block);
+	}
+	lock_release(j->j_lock);
+	return true;
+}
+
+/*
+ * Check if BLOCK belongs to a transaction that hasn't committed yet,
+ * so it mustn't be written in place.
+ */
+bool
+sfs_jheld(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool ret;
+
+	if (j == NULL || block >= sfs->sfs_sb.sb_nblocks) {
+		return false;
+	}
+	lock_acquire(j->j_lock);
+	ret = bitmap_isset(j->j_running, block);
+	lock_release(j->j_lock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// Setup and teardown
+
+void
+sfs_journal_destroy(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_active == 0);
+	kfree(j->j_stage);
+	kfree(j->j_touched.jl_blocks);
+	kfree(j->j_frees.jl_blocks);
+	if (j->j_logged != NULL) {
+		bitmap_destroy(j->j_logged);
+	}
+	if (j->j_revoked != NULL) {
+		bitmap_destroy(j->j_revoked);
+	}
+	if (j->j_running != NULL) {
+		bitmap_destroy(j->j_running);
+	}
+	if (j->j_cv != NULL) {
+		cv_destroy(j->j_cv);
+	}
+	if (j->j_lock != NULL) {
+		lock_destroy(j->j_lock);
+	}
+	kfree(j);
+	sfs->sfs_journal = NULL;
+}
+
+/*
+ * Set up the journal at mount time, if the volume has one, and
+ * recover from the log. On error the caller's cleanup gets rid of
+ * whatever we set up.
+ */
+int
+sfs_journal_mount(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	struct sfs_journal *j;
+	unsigned nbits, ntrans;
+	int result;
+
+	if (sb->sb_journalblocks == 0) {
+		return 0;
+	}
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	bzero(j, sizeof(*j));
+	sfs->sfs_journal = j;
+
+	nbits = SFS_FREEMAPBITS(sb->sb_nblocks);
+	j->j_lock = lock_create("sfs journal");
+	j->j_cv = cv_create("sfs journal");
+	j->j_running = bitmap_create(nbits);
+	j->j_revoked = bitmap_create(nbits);
+	j->j_logged = bitmap_create(nbits);
+	j->j_stage = kmalloc(SFS_JSTAGEBLOCKS * SFS_BLOCKSIZE);
+	if (j->j_lock == NULL || j->j_cv == NULL || j->j_running == NULL ||
+	    j->j_revoked == NULL || j->j_logged == NULL ||
+	    j->j_stage == NULL) {
+		return ENOMEM;
+	}
+
+	/* Every commit may log all the bitmap blocks and the superblock */
+	j->j_fixed = SFS_FREEMAPBLOCKS(sb->sb_nblocks) + 2;
+	if (sb->sb_version == SFS_VERSION_PACKED) {
+		j->j_fixed += SFS_INODEMAPBLOCKS(sb->sb_ninodes);
+	}
+
+	result = sfs_jreplay(sfs, &j->j_seq, &ntrans);
+	if (result) {
+		return result;
+	}
+	if (ntrans > 0) {
+		kprintf("sfs: %s: Replayed %u transaction%s from the "
+			"journal\n", sb->sb_volname, ntrans,
+			ntrans == 1 ? "" : "s");
+
+		/* That may have included the superblock */
+		result = sfs_readblock(sfs, SFS_SUPER_BLOCK, sb, sizeof(*sb));
+		if (result) {
+			return result;
+		}
+		sb->sb_volname[sizeof(sb->sb_volname)-1] = 0;
+	}
+	return sfs_jreset(sfs);
+}
@@ -37,8 +37,10 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -102,9 +104,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
@@ -117,13 +119,16 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
+	sfs_trans_end(sfs);
 
 	return result;
 }
@@ -164,8 +169,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	rwlock_release_read(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -185,16 +192,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -215,18 +219,36 @@ sfs_isseekable(struct vnode *v)
 
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * and some other cases. Writes the inode and whatever of the file's
+ * blocks are still dirty in the buffer cache.
+ *
+ * With a journal, committing the running transaction does that (for
+ * every file, not just this one), and takes no vnode locks.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	daddr_t block;
+	size_t offset, size;
 	int result;
 
-	vfs_biglock_acquire();
+	if (sfs->sfs_journal != NULL) {
+		return sfs_jcommit(sfs, false);
+	}
+
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	if (result == 0) {
+		result = sfs_flushblocks(sv);
+	}
+	if (result == 0) {
+		sfs_inodeloc(sfs, sv->sv_ino, &block, &offset, &size);
+		result = buffer_flush(v->vn_fs, block, SFS_BLOCKSIZE);
+	}
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -250,8 +272,16 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	sfs_trans_begin(sfs);
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	rwlock_release_write(sv->sv_lock);
+	sfs_trans_end(sfs);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -289,18 +319,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return EEXIST;
 	}
 
@@ -308,18 +341,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			rwlock_release_write(sv->sv_lock);
+			sfs_trans_end(sfs);
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, sv, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return result;
 	}
 
@@ -330,19 +366,23 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	rwlock_acquire_write(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	rwlock_release_write(newguy->sv_lock);
 
 	*ret = &newguy->sv_absvn;
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
+	sfs_trans_end(sfs);
 	return 0;
 }
 
@@ -356,23 +396,29 @@ int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *f = file->vn_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
-	/* Hard links to directories aren't allowed. */
+	/* Hard links to directories aren't allowed. (Types don't change.) */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
+	sfs_trans_begin(sfs);
+
+	/* Directory first, then the file */
+	rwlock_acquire_write(sv->sv_lock);
+	rwlock_acquire_write(f->sv_lock);
+
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(f->sv_lock);
+		rwlock_release_write(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return result;
 	}
 
@@ -380,7 +426,9 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
 
-	vfs_biglock_release();
+	rwlock_release_write(f->sv_lock);
+	rwlock_release_write(sv->sv_lock);
+	sfs_trans_end(sfs);
 	return 0;
 }
 
@@ -392,32 +440,40 @@ int
 sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return result;
 	}
+	KASSERT(victim != sv);
 
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		rwlock_acquire_write(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		rwlock_release_write(victim->sv_lock);
 	}
 
+	rwlock_release_write(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
+	sfs_trans_end(sfs);
 	return result;
 }
 
@@ -438,17 +494,25 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	sfs_trans_begin(sfs);
+	/*
+	 * Lock the directory, then (once we know what it is) the file.
+	 * If there were two directories, we'd lock them both first, in
+	 * inode number order.
+	 */
+	rwlock_acquire_write(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return result;
 	}
+	rwlock_acquire_write(g1->sv_lock);
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
@@ -470,6 +534,12 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
 
+	/* Adding a name can move entries in a hashed directory */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
+
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
 	if (result) {
@@ -484,10 +554,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
 
+	rwlock_release_write(g1->sv_lock);
+	rwlock_release_write(sv->sv_lock);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
+	sfs_trans_end(sfs);
 	return 0;
 
  puke_harder:
@@ -505,9 +578,12 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	rwlock_release_write(g1->sv_lock);
+	rwlock_release_write(sv->sv_lock);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
+	sfs_trans_end(sfs);
 	return result;
 }
 
@@ -516,7 +592,10 @@ sfs_rename(struct vnode *d1, const char *n1,
  * directory it's in as a vnode.
  *
  * Since we don't support subdirectories, this is very easy -
- * return the root dir and copy the path.
+ * return the root dir and copy the path. Nothing here can change
+ * under us (a vnode's type is fixed once it's loaded), so we don't
+ * lock anything; that keeps lookparent out of the lock order
+ * entirely.
  */
 static
 int
@@ -525,15 +604,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +616,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -559,22 +633,33 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
-	result = sfs_lookonce(sv, path, &final, NULL);
+	/*
+	 * Usually a shared lock is enough. If the directory has no name
+	 * index yet, lock it exclusively so sfs_dir_findname can build
+	 * one; hashed directories don't need one. Checking these
+	 * unlocked is fine, since they're only a hint about which lock
+	 * to take.
+	 */
+	if (sv->sv_dirindex == NULL &&
+	    !(sv->sv_i.sfi_flags & SFS_IFLAG_HASHED)) {
+		rwlock_acquire_write(sv->sv_lock);
+		result = sfs_lookonce(sv, path, &final, NULL);
+		rwlock_release_write(sv->sv_lock);
+	}
+	else {
+		rwlock_acquire_read(sv->sv_lock);
+		result = sfs_lookonce(sv, path, &final, NULL);
+		rwlock_release_read(sv->sv_lock);
+	}
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
-
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -32,25 +32,57 @@
 
 #include <uio.h> /* for uio_rw */
 
+struct buf;	/* from <buf.h> */
+struct iovec;	/* from <kern/iovec.h> */
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
-/* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+/* Readahead window limits, in blocks */
+#define SFS_RA_MINWINDOW  2
+#define SFS_RA_MAXWINDOW  32
+
+/* Initial number of vnode hash chains; grows with the vnode count */
+#define SFS_VNHASH_INITSIZE  32
+
+/* Initial number of hash chains in a directory's name index */
+#define SFS_DIRINDEX_INITSIZE  16
+
+/* A full flat directory with this many entries becomes hashed */
+#define SFS_DIRHASH_MINENTRIES  64
+
+/* Most blocks sfs_io will send to the device in one request */
+#define SFS_MAXRUN  64
+
+/* Blocks the journal gathers up before writing them to the log */
+#define SFS_JSTAGEBLOCKS  32
+
+/* Log space set aside for each transaction in progress */
+#define SFS_JOPBLOCKS  16
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_clearblock(struct sfs_fs *sfs, daddr_t block);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, bool clear,
+	       daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_freemap_release(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
+int sfs_ialloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *ino);
+void sfs_ifree(struct sfs_fs *sfs, uint32_t ino);
+int sfs_iused(struct sfs_fs *sfs, uint32_t ino);
+void sfs_groups_setup(struct sfs_fs *sfs);
+uint32_t sfs_dirgoal(struct sfs_fs *sfs);
+daddr_t sfs_datagoal(struct sfs_fs *sfs, uint32_t ino);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock);
+		daddr_t *diskblock, bool *fresh);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+void sfs_bmap_dropcache(struct sfs_vnode *sv);
+int sfs_flushblocks(struct sfs_vnode *sv);
 
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -58,21 +90,45 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_vnodes(struct sfs_fs *sfs);
+int sfs_sync_freemap(struct sfs_fs *sfs);
+int sfs_sync_superblock(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
+void sfs_inodeloc(struct sfs_fs *sfs, uint32_t ino, daddr_t *block,
+		size_t *offset, size_t *size);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
-int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+		struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
+/* Functions in sfs_journal.c */
+int sfs_journal_mount(struct sfs_fs *sfs);
+void sfs_journal_destroy(struct sfs_fs *sfs);
+void sfs_trans_begin(struct sfs_fs *sfs);
+void sfs_trans_end(struct sfs_fs *sfs);
+int sfs_jmodified(struct sfs_fs *sfs, struct buf *buf, daddr_t block);
+bool sfs_jfree(struct sfs_fs *sfs, daddr_t block);
+bool sfs_jheld(struct sfs_fs *sfs, daddr_t block);
+int sfs_jcommit(struct sfs_fs *sfs, bool checkpoint);
+int sfs_jcrash(struct sfs_fs *sfs);
+
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_readblocks(struct sfs_fs *sfs, daddr_t block, struct iovec *iov,
+		   unsigned nblocks, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+size_t sfs_inline_max(struct sfs_fs *sfs);
+int sfs_inline_spill(struct sfs_vnode *sv);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
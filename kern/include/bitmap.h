@@ -37,7 +37,15 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
+ *     bitmap_refresh - call after changing the raw bit data directly.
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_near - likewise, but take the first cleared bit at or
+ *                      after GOAL, wrapping around to the start if
+ *                      there isn't one.
+ *     bitmap_alloc_range - locate N consecutive cleared bits, set them,
+ *                      and return the index of the first.
+ *     bitmap_findset - return the index of the first set bit at or after
+ *                      START, or ENOENT if there isn't one.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -49,7 +57,14 @@ struct bitmap;  /* Opaque. */
 
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
+void           bitmap_refresh(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned goal,
+                                 unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned n,
+                                  unsigned *index);
+int            bitmap_findset(struct bitmap *, unsigned start,
+                              unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
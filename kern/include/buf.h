@@ -0,0 +1,105 @@
+/*
+ * Declarations for the disk buffer cache.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+struct fs;	/* from <fs.h> */
+
+/*
+ * Buffer cache.
+ *
+ * Buffers hold copies of filesystem blocks and are named by the
+ * struct fs they belong to and the block number within it. Blocks are
+ * brought in with the filesystem's fsop_readblock and written back
+ * with its fsop_writeblock, so the cache itself knows nothing about
+ * devices or on-disk formats.
+ *
+ * A buffer handed out by buffer_read or buffer_get is pinned (it
+ * cannot be evicted) and held exclusively by the calling thread until
+ * it is handed back with buffer_release. Other threads asking for the
+ * same block wait. Unpinned buffers are kept on an LRU list and are
+ * recycled, least recently used first, when the cache is full; dirty
+ * buffers are written back before being recycled.
+ *
+ * By default writes are delayed: a modified buffer is left dirty and a
+ * background syncer thread writes it back after a few seconds, or
+ * sooner if too much of the cache is dirty. Filesystems that need a
+ * block on disk now (fsync, sync, unmount) use buffer_flush or
+ * buffer_sync_fs.
+ *
+ * A filesystem that needs a dirty block to stay off the disk for now
+ * (because it hasn't been journaled yet, say) can have its
+ * fsop_writeblock fail with EAGAIN. The buffer stays dirty; eviction
+ * and the syncer pass it over and buffer_sync_fs skips it, but
+ * buffer_sync and buffer_flush hand the EAGAIN back to the caller.
+ *
+ * Functions:
+ *     buffer_bootstrap   - set up the cache at boot time.
+ *     buffer_setmax      - change the maximum number of buffers.
+ *     buffer_setwriteback - turn delayed writes on or off.
+ *     buffer_read        - get a buffer for a block, reading it in if
+ *                          it isn't already cached.
+ *     buffer_get         - get a buffer for a block without reading
+ *                          it; for callers that will overwrite the
+ *                          whole block. Check buffer_is_valid to see
+ *                          whether the old contents were cached.
+ *     buffer_release     - unpin a buffer obtained from one of the
+ *                          above.
+ *     buffer_is_cached   - check if a block is in the cache.
+ *     buffer_is_dirty    - check if a block is in the cache and dirty.
+ *     buffer_map         - return a pointer to the buffer's data.
+ *     buffer_is_valid    - true if the buffer holds the block contents.
+ *     buffer_mark_valid  - declare that the caller has filled in the
+ *                          whole buffer.
+ *     buffer_mark_dirty  - note that the buffer has been modified;
+ *                          implies buffer_mark_valid.
+ *     buffer_modified    - mark a held buffer dirty, and in
+ *                          write-through mode write it back now.
+ *     buffer_sync        - write a held buffer back if it's dirty.
+ *     buffer_flush       - write a block back if it's cached and dirty.
+ *     buffer_sync_fs     - write back all dirty buffers of a fs.
+ *     buffer_drop        - discard any cached copy of a block without
+ *                          writing it (e.g. because it was freed).
+ *     buffer_drop_fs     - discard all buffers of a fs (at unmount).
+ *                          Fails if a dirty one can't be written.
+ *     buffer_readahead   - start reading a range of consecutive blocks
+ *                          into the cache in the background, skipping
+ *                          any that are there already.
+ *     buffer_readahead_cancel - forget queued readahead of blocks the
+ *                          caller has read some other way.
+ */
+
+struct buf;	/* Opaque. */
+
+/* Number of buffers the cache holds unless told otherwise. */
+#define BUFFER_DEFAULT_MAX	256
+
+void buffer_bootstrap(void);
+void buffer_setmax(unsigned max);
+int buffer_setwriteback(bool on);
+
+int buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret);
+int buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret);
+void buffer_release(struct buf *b);
+bool buffer_is_cached(struct fs *fs, daddr_t block);
+bool buffer_is_dirty(struct fs *fs, daddr_t block);
+
+void *buffer_map(struct buf *b);
+bool buffer_is_valid(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+int buffer_modified(struct buf *b);
+
+int buffer_sync(struct buf *b);
+int buffer_flush(struct fs *fs, daddr_t block, size_t size);
+int buffer_sync_fs(struct fs *fs);
+void buffer_drop(struct fs *fs, daddr_t block, size_t size);
+int buffer_drop_fs(struct fs *fs);
+void buffer_readahead(struct fs *fs, daddr_t block, unsigned nblocks,
+		      size_t size);
+void buffer_readahead_cancel(struct fs *fs, daddr_t block, unsigned nblocks);
+
+
+#endif /* _BUF_H_ */
@@ -10,30 +10,49 @@
  */
 #include <limits.h>
 #include <mips/trapframe.h>
+#include <spinlock.h>
 
 /*
     file related data structures
 */
 
+/*
+    The fdt starts with OPEN_MAX slots and doubles whenever it fills, up to the process's
+    RLIMIT_NOFILE soft limit (fdt_limit), which defaults to OPEN_MAX and can be raised with
+    setrlimit as far as the hard limit (fdt_hardlimit, at most FDT_MAXFILES). Open slots are
+    marked in fdt_used, whose summary levels make finding the lowest free fd cheap however big
+    the table gets.
+*/
+#define FDT_MAXFILES 4096
+
 struct fdt {
 	int count; 		    /* Number of fdt entries */
 	struct lock *fdt_mutex; 		/* maintain exclusion over fdt when modifying */
-	struct oft_entry *fdt_entry[OPEN_MAX];
+	struct spinlock fdt_lock;	/* protects fdt_entry and fdt_size, so lookups need not sleep */
+	struct oft_entry **fdt_entry;	/* fdt_size slots */
+	unsigned fdt_size;		/* number of slots allocated; a multiple of 32 */
+	struct bitmap *fdt_used;	/* which slots are open; under fdt_mutex */
+	unsigned fdt_limit;		/* RLIMIT_NOFILE soft limit: fds must be below this */
+	unsigned fdt_hardlimit;		/* RLIMIT_NOFILE hard limit */
 };
 
 /*
     The optional mode argument provides the file permissions to use and
     is only meaningful in Unix, or if you choose to implement Unix-style
     security later on. it can be ignored in OS/161.
+
+    vn, mode and flags are set at open and never change, so they can be read
+    by anyone holding a reference. Only seek_pos needs the oft_mutex.
 */
 
 struct oft_entry {
-	struct lock *oft_mutex; 	/* lock to maintain mutual exclusion between dup and children */
+	struct lock *oft_mutex; 	/* serialises I/O that uses or moves seek_pos */
+	struct spinlock oft_reflock;	/* protects ref_cnt */
 	struct vnode *vn;  /*lock when writing or reading*/
 	mode_t mode;       /* not used by os161 */
     int flags;               /* if mode is read then only read actions, can access this fd */
     off_t seek_pos;     /* position in file */
-	int ref_cnt; 			/* count of handles to this entry used by dup2 and fork */
+	int ref_cnt; 			/* fdt slots pointing here (dup2 and fork) plus lookups in progress */
 };
 
 
@@ -65,6 +84,23 @@ int sys_write(int fd, void *buf, size_t nbytes, ssize_t *retval);
 */
 int sys_read(int fd, void *buf, size_t nbytes, ssize_t *retval);
 
+/*
+    Positional and scatter/gather variants of read and write. They return the
+    same values as read and write. The positional ones (pread, pwrite, preadv,
+    pwritev) take their 64bit offset from the user stack, as lseek takes whence,
+    and neither use nor update the seek position; they fail with ESPIPE on
+    objects that are not seekable.
+*/
+struct iovec;
+int sys_pread(int fd, void *buf, size_t nbytes, ssize_t *retval, struct trapframe *tf);
+int sys_pwrite(int fd, void *buf, size_t nbytes, ssize_t *retval, struct trapframe *tf);
+int sys_readv(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval);
+int sys_writev(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval);
+int sys_preadv(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval,
+               struct trapframe *tf);
+int sys_pwritev(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval,
+                struct trapframe *tf);
+
 /*
     dup2 returns newfd. On error, -1 is returned, and errno is set
     according to the error encountered.
@@ -77,6 +113,13 @@ int sys_dup2(int oldfd, int newfd, int *retval); //returns newfd on success
 */
 int sys_lseek(int fd, int *retval, struct trapframe *tf);
 
+/*
+    getrlimit and setrlimit. Only RLIMIT_NOFILE is supported; other resources
+    fail with EINVAL. Raising the hard limit fails with EPERM.
+*/
+int sys_getrlimit(int resource, userptr_t rlp);
+int sys_setrlimit(int resource, const_userptr_t rlp);
+
 
 
 /*
@@ -84,6 +127,26 @@ int sys_lseek(int fd, int *retval, struct trapframe *tf);
 */
 int oft_acquire(struct vnode *vn, int flags, mode_t mode, int *retval);
 
+/*
+    Set up the object caches that oft entries and fdts are allocated from.
+    Called once at boot, before the first process is created.
+*/
+void file_bootstrap(void);
+
+/*
+    Create an empty fdt, copy the open fds of one fdt into an empty one (for fork),
+    and destroy an fdt, dropping its references to any oft entries still open.
+*/
+struct fdt *fdt_create(void);
+int fdt_copy(struct fdt *src, struct fdt *dst);
+void fdt_destroy(struct fdt *fdt);
+
+/*
+    Drops a reference to an oft entry, closing the vnode and freeing the entry
+    when the last one goes.
+*/
+void oft_release(struct oft_entry *oft_entry);
+
 
 /*
     On success, fork returns the new child process id to the parent and 0 to the child. On error, -1 is returned,
@@ -31,6 +31,20 @@
 #define _FS_H_
 
 struct vnode; /* in vnode.h */
+struct iovec; /* in kern/iovec.h */
+
+
+/*
+ * Space usage of a file system, as returned by fsop_statfs. Sizes are
+ * in units of fst_blocksize bytes.
+ */
+struct fs_stats {
+	size_t fst_blocksize;		/* size of a block */
+	uint32_t fst_blocks;		/* total blocks */
+	uint32_t fst_freeblocks;	/* blocks not in use */
+	uint32_t fst_files;		/* total inodes */
+	uint32_t fst_freefiles;		/* inodes not in use */
+};
 
 
 /*
@@ -51,6 +65,10 @@ struct fs {
  *      fsop_getvolname - Return volume name of filesystem.
  *      fsop_getroot    - Return root vnode of filesystem.
  *      fsop_unmount    - Attempt unmount of filesystem.
+ *      fsop_readblock  - Read a block of the volume (for the buffer cache).
+ *      fsop_readblocks - Read consecutive blocks into separate buffers.
+ *      fsop_writeblock - Write a block of the volume (for the buffer cache).
+ *      fsop_statfs     - Report space usage in a struct fs_stats.
  *
  * fsop_getvolname may return NULL on filesystem types that don't
  * support the concept of a volume name. The string returned is
@@ -68,12 +86,34 @@ struct fs {
  * consequently the struct fs instance should remain valid. On success,
  * however, the filesystem object and all storage associated with the
  * filesystem should have been discarded/released.
+ *
+ * fsop_readblock and fsop_writeblock do raw I/O on one block and are
+ * called by the buffer cache (buf.h) to fill and flush buffers. They
+ * may be NULL in filesystems that don't use the buffer cache.
+ * fsop_readblocks reads NBLOCKS consecutive blocks of LEN bytes each,
+ * starting at BLOCK, into the buffers described by IOV (one iovec per
+ * block), in a single device request; the buffer cache uses it for
+ * readahead. It may be NULL, in which case blocks are read one at a
+ * time with fsop_readblock.
+ * fsop_writeblock may fail with EAGAIN to keep a block off the disk
+ * for the time being; the buffer cache tries again later.
+ *
+ * fsop_statfs may be NULL in filesystems that can't say how full they
+ * are; vfs_statfs then fails with ENOSYS.
  */
 struct fs_ops {
 	int           (*fsop_sync)(struct fs *);
 	const char   *(*fsop_getvolname)(struct fs *);
 	int           (*fsop_getroot)(struct fs *, struct vnode **);
 	int           (*fsop_unmount)(struct fs *);
+	int           (*fsop_readblock)(struct fs *, daddr_t block,
+					void *data, size_t len);
+	int           (*fsop_readblocks)(struct fs *, daddr_t block,
+					 struct iovec *iov, unsigned nblocks,
+					 size_t len);
+	int           (*fsop_writeblock)(struct fs *, daddr_t block,
+					 void *data, size_t len);
+	int           (*fsop_statfs)(struct fs *, struct fs_stats *);
 };
 
 /*
@@ -83,6 +123,7 @@ struct fs_ops {
 #define FSOP_GETVOLNAME(fs)  ((fs)->fs_ops->fsop_getvolname(fs))
 #define FSOP_GETROOT(fs, ret) ((fs)->fs_ops->fsop_getroot(fs, ret))
 #define FSOP_UNMOUNT(fs)     ((fs)->fs_ops->fsop_unmount(fs))
+#define FSOP_STATFS(fs, st)  ((fs)->fs_ops->fsop_statfs(fs, st))
 
 /* Initialization functions for builtin fake file systems. */
 void semfs_bootstrap(void);
@@ -86,7 +86,8 @@
 
 /*
  * UNSW: Max open files per process. Again, this is artificially low
- * at 32. A more reasonable number is 128.
+ * at 32. A more reasonable number is 128. This is only the default
+ * RLIMIT_NOFILE soft limit; processes can raise it with setrlimit().
  */
 #define __OPEN_MAX      32
 
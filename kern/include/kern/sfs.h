@@ -37,18 +37,22 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
+#define SFS_VERSION_ORIG  0             /* one inode per block */
+#define SFS_VERSION_PACKED 1            /* inodes packed in an inode table */
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
+#define SFS_PINODESIZE    128           /* bytes per inode in inode table */
+#define SFS_INOPB         (SFS_BLOCKSIZE / SFS_PINODESIZE) /* inodes/block */
 
 /* Number of bits in a block */
 #define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
@@ -62,6 +66,36 @@
 /* Size of free block bitmap (in blocks) */
 #define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
 
+/*
+ * Allocation groups. The volume is cut into at most SFS_MAXGROUPS
+ * groups of SFS_GROUPBLOCKS blocks each, a whole number of freemap
+ * blocks; the last group may be short. In the packed format the
+ * inodes are cut up the same way, SFS_GROUPINODES to a group.
+ */
+#define SFS_MAXGROUPS     32
+#define SFS_GROUPBLOCKS(nblocks) \
+	SFS_ROUNDUP(((nblocks) + SFS_MAXGROUPS - 1) / SFS_MAXGROUPS, \
+		    SFS_BITSPERBLOCK)
+#define SFS_NGROUPS(nblocks) \
+	(((nblocks) + SFS_GROUPBLOCKS(nblocks) - 1) / SFS_GROUPBLOCKS(nblocks))
+#define SFS_GROUPINODES(ninodes, ngroups) \
+	(((ninodes) + (ngroups) - 1) / (ngroups))
+
+/* Size of the inode bitmap and inode table (in blocks), packed format */
+#define SFS_INODEMAPBLOCKS(ninodes)   SFS_FREEMAPBLOCKS(ninodes)
+#define SFS_INODETABLEBLOCKS(ninodes) (((ninodes) + SFS_INOPB - 1) / SFS_INOPB)
+
+/*
+ * Space for inline data at the end of an inode (sfi_inline), in the
+ * original format and in the packed format.
+ */
+#define SFS_INLINE_MAX    (SFS_BLOCKSIZE - 4*(6+SFS_NDIRECT))
+#define SFS_PINLINE_MAX   (SFS_PINODESIZE - 4*(6+SFS_NDIRECT))
+
+/* Flags for sfi_flags */
+#define SFS_IFLAG_INLINE  0x1     /* contents are in sfi_inline */
+#define SFS_IFLAG_HASHED  0x2     /* directory is a hash table */
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -69,16 +103,52 @@
 
 /*
  * On-disk superblock
+ *
+ * In the original format (SFS_VERSION_ORIG) each inode takes a whole
+ * block and the inode number is the block number. In the packed
+ * format (SFS_VERSION_PACKED) inodes live SFS_INOPB to a block in an
+ * inode table, which follows a bitmap of the inodes in use; the inode
+ * number is the index into the table. Inode 0 (SFS_NOINO) is never
+ * allocated, so the root directory is the second inode of the first
+ * table block. The sb_ninodes and sb_inode* fields are 0 in the
+ * original format.
+ *
+ * sb_groupfree holds the number of free blocks in each allocation
+ * group, and in the packed format sb_groupifree the number of free
+ * inodes; they must agree with the bitmaps. Volumes made before
+ * allocation groups existed have sb_ngroups 0, and get groups when
+ * first mounted.
+ *
+ * If sb_journalblocks is nonzero the volume has a metadata journal in
+ * that many blocks starting at sb_journalstart; see below.
  */
 struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_version;			/* One of SFS_VERSION_* */
+	uint32_t sb_ninodes;			/* Number of inodes */
+	uint32_t sb_inodemapstart;		/* 1st block of inode bitmap */
+	uint32_t sb_inodetablestart;		/* 1st block of inode table */
+	uint32_t sb_ngroups;			/* Number of allocation groups */
+	uint32_t sb_groupblocks;		/* Blocks per group */
+	uint32_t sb_groupinodes;		/* Inodes per group (packed) */
+	uint32_t sb_groupfree[SFS_MAXGROUPS];	/* Free blocks per group */
+	uint32_t sb_groupifree[SFS_MAXGROUPS];	/* Free inodes per group */
+	uint32_t sb_journalstart;		/* 1st block of journal */
+	uint32_t sb_journalblocks;		/* Size of journal, or 0 */
+	uint32_t reserved[45];			/* unused, set to 0 */
 };
 
 /*
  * On-disk inode
+ *
+ * In the packed format only the first SFS_PINODESIZE bytes are
+ * stored; the rest of sfi_inline reads as zero.
+ *
+ * If SFS_IFLAG_INLINE is set, the file's contents are the first
+ * sfi_size bytes of sfi_inline and there are no data blocks.
+ * Otherwise sfi_inline is unused and set to 0.
  */
 struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -86,7 +156,10 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* */
+	uint8_t sfi_inline[SFS_INLINE_MAX];	/* inline data */
 };
 
 /*
@@ -97,5 +170,103 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Hashed directories
+ *
+ * A directory with SFS_IFLAG_HASHED set is an extendible hash table
+ * keyed on the hash of the entry name, rather than a flat array of
+ * entries. The hash is 32 bits, computed as h = h*33 + c over the
+ * bytes of the name starting from h = 5381.
+ *
+ *   - File block 0 is a struct sfs_dirheader.
+ *   - File blocks 1 through SFS_DIRHASH_TABLEBLOCKS hold the bucket
+ *     table: 2^dh_depth 32-bit file block numbers, indexed by the low
+ *     dh_depth bits of the hash. The rest of the area is a hole.
+ *   - Buckets start at file block SFS_DIRHASH_FIRSTBUCKET and take
+ *     one block each. All names in a bucket agree in the low db_depth
+ *     bits of their hash, and the 2^(dh_depth-db_depth) table entries
+ *     with those bits all point to it.
+ *   - A bucket that fills up at SFS_DIRHASH_MAXDEPTH is continued in
+ *     an overflow bucket named by db_next.
+ *
+ * The "slot" of an entry is still its byte offset in the directory
+ * divided by the size of an entry, so entries can be read and cleared
+ * the same way as in a flat directory.
+ */
+#define SFS_DIRHASH_MAGIC      0x48736664  /* "Hsfd" */
+#define SFS_DIRHASH_MAXDEPTH   16
+#define SFS_DIRHASH_TABLEBLOCKS \
+	((1 << SFS_DIRHASH_MAXDEPTH) * sizeof(uint32_t) / SFS_BLOCKSIZE)
+#define SFS_DIRHASH_FIRSTBUCKET (1 + SFS_DIRHASH_TABLEBLOCKS)
+#define SFS_DIRHASH_PERBUCKET \
+	(SFS_BLOCKSIZE / sizeof(struct sfs_direntry) - 1)
+
+struct sfs_dirheader {
+	uint32_t dh_magic;			/* SFS_DIRHASH_MAGIC */
+	uint32_t dh_depth;			/* log2 of table size */
+	uint32_t dh_reserved[126];		/* unused, set to 0 */
+};
+
+struct sfs_dirbucket {
+	uint32_t db_depth;			/* # of hash bits in common */
+	uint32_t db_next;			/* overflow bucket, or 0 */
+	uint32_t db_reserved[14];		/* unused, set to 0 */
+	struct sfs_direntry db_entries[SFS_DIRHASH_PERBUCKET];
+};
+
+/*
+ * Metadata journal
+ *
+ * Changes to inodes, directories, indirect blocks, the bitmaps, and
+ * the superblock are written to the journal, a whole transaction at
+ * a time, before any of them is written in place. File data is not
+ * journaled, but is written before the transaction that refers to it.
+ *
+ * The first block of the journal is a struct sfs_jheader. The rest is
+ * a circular log of transactions, starting at jh_start. Each
+ * transaction is some number of records followed by a commit block:
+ *
+ *   - SFS_JDESC_MAGIC: jd_count block numbers, followed by new
+ *     copies of those blocks, in order.
+ *   - SFS_JREVOKE_MAGIC: jd_count block numbers that were freed;
+ *     copies of them in earlier transactions must not be replayed.
+ *   - SFS_JCOMMIT_MAGIC: the end of the transaction.
+ *
+ * All records of a transaction carry its sequence number. Numbers go
+ * up by one from jh_seq, and the log ends at the first record with
+ * the wrong number or the first transaction without a commit block.
+ * Recovery writes the newest copy of each block back in place and
+ * then empties the log: jh_seq moves past the last transaction and
+ * jh_start goes back to the beginning.
+ */
+#define SFS_JHEADER_MAGIC  0x4a736664  /* "Jsfd" */
+#define SFS_JDESC_MAGIC    0x4a736644  /* "JsfD" */
+#define SFS_JREVOKE_MAGIC  0x4a736652  /* "JsfR" */
+#define SFS_JCOMMIT_MAGIC  0x4a736643  /* "JsfC" */
+#define SFS_JOURNAL_MINBLOCKS  64      /* smallest journal allowed */
+#define SFS_JPERDESC \
+	((SFS_BLOCKSIZE - 4 * sizeof(uint32_t)) / sizeof(uint32_t))
+
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JHEADER_MAGIC */
+	uint32_t jh_seq;			/* # of first transaction */
+	uint32_t jh_start;			/* where it is in the journal */
+	uint32_t jh_reserved[125];		/* unused, set to 0 */
+};
+
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_J{DESC,REVOKE}_MAGIC */
+	uint32_t jd_seq;			/* transaction number */
+	uint32_t jd_count;			/* # of entries in jd_blocks */
+	uint32_t jd_reserved;			/* unused, set to 0 */
+	uint32_t jd_blocks[SFS_JPERDESC];	/* block numbers */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JCOMMIT_MAGIC */
+	uint32_t jc_seq;			/* transaction number */
+	uint32_t jc_reserved[126];		/* unused, set to 0 */
+};
+
 
 #endif /* _KERN_SFS_H_ */
@@ -0,0 +1,50 @@
+/*
+ * Declarations for object caches.
+ */
+
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object cache.
+ *
+ * An object cache hands out fixed-size objects that are kept in a
+ * constructed state between uses. The constructor runs when an object
+ * is first allocated from kmalloc, and the destructor only when the
+ * cache gives the memory back; in between, objects returned with
+ * objcache_put sit on a free list and are handed out again as they
+ * are. This saves both the allocator round trip and whatever
+ * expensive setup the constructor does (creating locks, say) for
+ * objects that are allocated and freed over and over.
+ *
+ * The contract is that an object must be put back in the same state
+ * the constructor left it in: locks released, lists empty, and so on.
+ * Fields that are filled in on every use need not be reset.
+ *
+ * At most MAXFREE objects are kept on the free list; beyond that,
+ * objcache_put destroys and frees them.
+ *
+ * The constructor returns 0 or an error code, and may sleep. The
+ * destructor may also sleep. Either may be NULL.
+ *
+ * Functions:
+ *     objcache_create  - make a new cache. Returns NULL on error.
+ *     objcache_get     - get a constructed object. Returns NULL if
+ *                        out of memory or the constructor failed.
+ *     objcache_put     - give an object back to the cache.
+ *     objcache_destroy - destroy a cache and every object on its free
+ *                        list. All objects must have been put back.
+ */
+
+struct objcache;	/* Opaque. */
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 unsigned maxfree,
+				 int (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void *objcache_get(struct objcache *oc);
+void objcache_put(struct objcache *oc, void *obj);
+void objcache_destroy(struct objcache *oc);
+
+
+#endif /* _OBJCACHE_H_ */
@@ -48,14 +48,52 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * Each vnode has a reader-writer lock, sv_lock, covering the in-memory
+ * inode and the file's contents (including its block map). Each
+ * volume has sfs_vnlock, for the table of loaded vnodes, and
+ * sfs_freemaplock, for the freemap, the inode bitmap, and the
+ * superblock. On volumes with a journal, operations that change
+ * things are transactions (see sfs_journal.c). The order is:
+ *
+ *    transaction
+ *    directory vnode(s), in increasing inode number
+ *    file vnode(s), in increasing inode number
+ *    sfs_vnlock
+ *    sfs_freemaplock
+ *    buffer cache
+ *    the journal's own lock
+ *
+ * So rename locks the directory (both directories, by inode number, if
+ * there were ever two) before touching the file it moves, and
+ * lookparent, which only needs the directory, takes nothing else.
+ * Nothing in SFS uses vfs_biglock; callers in the VFS layer that hold
+ * it come first in the order.
+ */
+
 /*
  * In-memory inode
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct rwlock *sv_lock;         /* protects everything below */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hashnext;  /* vnode hash chain */
+	unsigned sv_index;              /* where we are in sfs_vnodes */
+	struct sfs_dirindex *sv_dirindex; /* name index (directories) */
+	off_t sv_ra_pos;                /* where the last read ended */
+	uint32_t sv_ra_window;          /* readahead window (blocks) */
+	uint32_t sv_ra_next;            /* first block not yet read ahead */
+	bool sv_reclaiming;             /* in sfs_reclaim (sfs_vnlock) */
+	daddr_t sv_goal;                /* where to put the next new block */
+	struct spinlock sv_ibclock;     /* protects sv_ibc* */
+	uint32_t sv_ibcbase;            /* first file block sv_ibcdata maps */
+	daddr_t sv_ibcblock;            /* index block cached (0 = none) */
+	uint32_t *sv_ibcdata;           /* copy of its entries */
 };
 
 /*
@@ -66,9 +104,19 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
+	struct lock *sfs_vnlock;        /* protects sfs_vnodes, sfs_vnhash */
+	struct cv *sfs_vncv;            /* for waiting out sfs_reclaim */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vnhash;  /* same, hashed by inode number */
+	unsigned sfs_vnhashsize;        /* number of hash chains */
+	struct lock *sfs_freemaplock;   /* protects freemaps and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	bool sfs_freemapdirty;          /* true if either bitmap modified */
+	struct bitmap *sfs_freemapdirtyblocks; /* which freemap blocks */
+	struct bitmap *sfs_inodemap;    /* inodes in use (packed format) */
+	struct bitmap *sfs_inodemapdirtyblocks; /* which inode map blocks */
+	struct sfs_journal *sfs_journal; /* metadata journal, or NULL */
+	bool sfs_crashed;               /* testing: writes are dropped */
 };
 
 /*
@@ -76,5 +124,11 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * For testing journal recovery: stop writing to the sfs on DEVICE
+ * after its next commit, as if the system went down.
+ */
+int sfs_crash(const char *device);
+
 
 #endif /* _SFS_H_ */
@@ -54,6 +54,7 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -86,6 +87,7 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
+int journaltest(int, char **);
 int printfile(int, char **);
 
 /* other tests */
@@ -106,6 +106,12 @@ struct thread {
 	 * Public fields
 	 */
 
+	/* Depth of nested filesystem transactions (see sfs_journal.c) */
+	unsigned t_fstrans;
+
+	/* PATH_MAX scratch buffer for pathname syscalls; made on first use */
+	char *t_pathbuf;
+
 	/* add more here as needed */
 };
 
@@ -45,6 +45,7 @@ struct uio;    /* kernel or userspace I/O buffer (uio.h) */
 struct device; /* abstract structure for a device (dev.h) */
 struct fs;     /* abstract structure for a filesystem (fs.h) */
 struct vnode;  /* abstract structure for an on-disk file (vnode.h) */
+struct fs_stats; /* space usage of a filesystem (fs.h) */
 
 /*
  * VFS layer low-level operations.
@@ -81,6 +82,22 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * VFS name cache. vfs_lookup and vfs_lookparent walk paths one
+ * component at a time and consult it before each VOP_LOOKUP; anything
+ * that changes a directory must purge the names it touched.
+ *
+ *    vfs_dcache_purge    - forget NAME in directory DIR.
+ *    vfs_dcache_purgedir - likewise, where NAME is a directory; also
+ *                          forget the names looked up in it.
+ *    vfs_dcache_purgefs  - forget everything on FS (before unmount).
+ */
+
+void vfs_dcache_bootstrap(void);
+void vfs_dcache_purge(struct vnode *dir, const char *name);
+void vfs_dcache_purgedir(struct vnode *dir, const char *name);
+void vfs_dcache_purgefs(struct fs *fs);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
@@ -156,6 +173,9 @@ int vfs_getcwd(struct uio *buf);
  *    vfs_unmount   - Unmount the filesystem presently mounted on the
  *                    specified device.
  *
+ *    vfs_statfs    - Report the space usage of the filesystem mounted
+ *                    on the specified device, in RESULT.
+ *
  *    vfs_swapon    - Look up DEVNAME and mark it as a swap device,
  *                    returning a vnode. Similar to vfs_mount.
  *
@@ -179,6 +199,7 @@ int vfs_mount(const char *devname, void *data,
 			       struct device *dev,
 			       struct fs **result));
 int vfs_unmount(const char *devname);
+int vfs_statfs(const char *devname, struct fs_stats *result);
 int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
 int vfs_unmountall(void);
@@ -29,6 +29,18 @@
 
 /*
  * Fixed-size array of bits. (Intended for storage management.)
+ *
+ * The bits themselves are kept as an array of bytes, which is what
+ * bitmap_getdata hands out for I/O. On top of that we keep summary
+ * levels in memory: level 1 has one bit per 32 bits of the data,
+ * which is set if those 32 bits are all set; level 2 has one bit per
+ * 32 bits of level 1, and so on up to a level that fits in one word.
+ * Finding a clear bit then means following clear summary bits down
+ * from the top, instead of scanning the whole map.
+ *
+ * A second set of summary levels does the same for set bits: each bit
+ * there is set if any of the 32 bits below it is set, so finding the
+ * next set bit skips empty stretches the same way.
  */
 
 #include <types.h>
@@ -41,23 +53,292 @@
  * or unsigned long as the base type for holding bits. But we don't,
  * because if one uses any data type more than a single byte wide,
  * bitmap data saved on disk becomes endian-dependent, which is a
- * severe nuisance.
+ * severe nuisance. (The summary levels never go to disk, so they use
+ * 32-bit words, and we read the data 32 bits at a time by assembling
+ * four bytes.)
  */
 #define BITS_PER_WORD   (CHAR_BIT)
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+#define SUM_BITS        32
+#define SUM_ALLBITS     (0xffffffffU)
+
+/* Enough summary levels for 2^32 bits */
+#define BITMAP_MAXLEVELS 6
+
+/* No such bit */
+#define NOBIT           ((unsigned)-1)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+
+        /*
+         * Summary levels 1..nlevels are sum[0]..sum[nlevels-1] (for
+         * "all set") and any[0]..any[nlevels-1] (for "any set").
+         * lbits[L] is the number of bits at level L (level 0 being
+         * the data itself).
+         */
+        unsigned nlevels;
+        uint32_t *sum[BITMAP_MAXLEVELS];
+        uint32_t *any[BITMAP_MAXLEVELS];
+        unsigned lbits[BITMAP_MAXLEVELS+1];
 };
 
+/*
+ * Find the lowest clear bit in a 32-bit word, which must have one.
+ */
+static
+unsigned
+bitmap_ffz(uint32_t w)
+{
+        unsigned n = 0;
+
+        KASSERT(w != SUM_ALLBITS);
+        w = ~w;
+        if ((w & 0xffff) == 0) { n += 16; w >>= 16; }
+        if ((w & 0xff) == 0) { n += 8; w >>= 8; }
+        if ((w & 0xf) == 0) { n += 4; w >>= 4; }
+        if ((w & 0x3) == 0) { n += 2; w >>= 2; }
+        if ((w & 0x1) == 0) { n += 1; }
+        return n;
+}
+
+/*
+ * Return 32-bit word IX of level LEVEL. At level 0 this is four bytes
+ * of the data; bytes past the end count as all set, so the padding
+ * never looks free.
+ */
+static
+uint32_t
+bitmap_getword(struct bitmap *b, unsigned level, unsigned ix)
+{
+        unsigned nbytes, byte, j;
+        uint32_t w;
+
+        if (level > 0) {
+                return b->sum[level-1][ix];
+        }
+
+        nbytes = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        w = 0;
+        for (j=0; j<SUM_BITS/BITS_PER_WORD; j++) {
+                byte = ix*(SUM_BITS/BITS_PER_WORD) + j;
+                w |= (uint32_t)(byte < nbytes ? b->v[byte] : WORD_ALLBITS)
+                        << (j*BITS_PER_WORD);
+        }
+        return w;
+}
+
+/*
+ * Like bitmap_getword, but for the "any set" levels. At level 0 the
+ * bits past the end count as clear instead, so they're never found.
+ */
+static
+uint32_t
+bitmap_getanyword(struct bitmap *b, unsigned level, unsigned ix)
+{
+        unsigned base;
+        uint32_t w;
+
+        if (level > 0) {
+                return b->any[level-1][ix];
+        }
+
+        base = ix * SUM_BITS;
+        if (base >= b->nbits) {
+                return 0;
+        }
+        w = bitmap_getword(b, 0, ix);
+        if (b->nbits - base < SUM_BITS) {
+                w &= ((uint32_t)1 << (b->nbits - base)) - 1;
+        }
+        return w;
+}
+
+/*
+ * Recompute summary bit IX of level LEVEL (>= 1) from the word below
+ * it. Returns true if it changed.
+ */
+static
+bool
+bitmap_setsummary(struct bitmap *b, unsigned level, unsigned ix)
+{
+        uint32_t *wp, mask;
+        bool full;
+
+        full = bitmap_getword(b, level-1, ix) == SUM_ALLBITS;
+        wp = &b->sum[level-1][ix / SUM_BITS];
+        mask = (uint32_t)1 << (ix % SUM_BITS);
+        if (full == ((*wp & mask) != 0)) {
+                return false;
+        }
+        if (full) {
+                *wp |= mask;
+        }
+        else {
+                *wp &= ~mask;
+        }
+        return true;
+}
+
+/*
+ * Likewise for "any set" summary bit IX of level LEVEL (>= 1).
+ */
+static
+bool
+bitmap_setany(struct bitmap *b, unsigned level, unsigned ix)
+{
+        uint32_t *wp, mask;
+        bool nonempty;
+
+        nonempty = bitmap_getanyword(b, level-1, ix) != 0;
+        wp = &b->any[level-1][ix / SUM_BITS];
+        mask = (uint32_t)1 << (ix % SUM_BITS);
+        if (nonempty == ((*wp & mask) != 0)) {
+                return false;
+        }
+        if (nonempty) {
+                *wp |= mask;
+        }
+        else {
+                *wp &= ~mask;
+        }
+        return true;
+}
+
+/*
+ * Bring the summaries up to date after data bit INDEX changed.
+ */
+static
+void
+bitmap_propagate(struct bitmap *b, unsigned index)
+{
+        unsigned level, ix;
+
+        ix = index;
+        for (level=1; level<=b->nlevels; level++) {
+                ix /= SUM_BITS;
+                if (!bitmap_setsummary(b, level, ix)) {
+                        break;
+                }
+        }
+
+        ix = index;
+        for (level=1; level<=b->nlevels; level++) {
+                ix /= SUM_BITS;
+                if (!bitmap_setany(b, level, ix)) {
+                        break;
+                }
+        }
+}
+
+/*
+ * Find the first clear bit at level LEVEL with index >= START, or
+ * NOBIT if there isn't one.
+ */
+static
+unsigned
+bitmap_findzero(struct bitmap *b, unsigned level, unsigned start)
+{
+        unsigned ix, bit;
+        uint32_t w;
+
+        if (start >= b->lbits[level]) {
+                return NOBIT;
+        }
+        ix = start / SUM_BITS;
+        w = bitmap_getword(b, level, ix);
+        /* Pretend the bits before START are set */
+        w |= ((uint32_t)1 << (start % SUM_BITS)) - 1;
+
+        if (w == SUM_ALLBITS) {
+                /* Nothing here; ask the level above for the next word */
+                if (level == b->nlevels) {
+                        return NOBIT;
+                }
+                ix = bitmap_findzero(b, level+1, ix+1);
+                if (ix == NOBIT) {
+                        return NOBIT;
+                }
+                w = bitmap_getword(b, level, ix);
+        }
+
+        bit = ix * SUM_BITS + bitmap_ffz(w);
+        return bit < b->lbits[level] ? bit : NOBIT;
+}
+
+/*
+ * Find the first set bit at level LEVEL with index >= START, or NOBIT
+ * if there isn't one. This is bitmap_findzero for the "any set"
+ * levels.
+ */
+static
+unsigned
+bitmap_findone(struct bitmap *b, unsigned level, unsigned start)
+{
+        unsigned ix, bit;
+        uint32_t w;
+
+        if (start >= b->lbits[level]) {
+                return NOBIT;
+        }
+        ix = start / SUM_BITS;
+        w = bitmap_getanyword(b, level, ix);
+        /* Pretend the bits before START are clear */
+        w &= ~(((uint32_t)1 << (start % SUM_BITS)) - 1);
+
+        if (w == 0) {
+                /* Nothing here; ask the level above for the next word */
+                if (level == b->nlevels) {
+                        return NOBIT;
+                }
+                ix = bitmap_findone(b, level+1, ix+1);
+                if (ix == NOBIT) {
+                        return NOBIT;
+                }
+                w = bitmap_getanyword(b, level, ix);
+        }
+
+        bit = ix * SUM_BITS + bitmap_ffz(~w);
+        return bit < b->lbits[level] ? bit : NOBIT;
+}
+
+/*
+ * Rebuild all the summaries from the data.
+ */
+static
+void
+bitmap_resummarize(struct bitmap *b)
+{
+        unsigned level, ix, nwords;
+
+        for (level=1; level<=b->nlevels; level++) {
+                nwords = DIVROUNDUP(b->lbits[level], SUM_BITS);
+                for (ix=0; ix<nwords; ix++) {
+                        /* Padding past the end counts as full */
+                        b->sum[level-1][ix] = SUM_ALLBITS;
+                }
+                for (ix=0; ix<b->lbits[level]; ix++) {
+                        b->sum[level-1][ix / SUM_BITS] &=
+                                ~((uint32_t)1 << (ix % SUM_BITS));
+                        bitmap_setsummary(b, level, ix);
+                }
+
+                /* Padding past the end counts as empty */
+                bzero(b->any[level-1], nwords * sizeof(uint32_t));
+                for (ix=0; ix<b->lbits[level]; ix++) {
+                        bitmap_setany(b, level, ix);
+                }
+        }
+}
 
 struct bitmap *
 bitmap_create(unsigned nbits)
 {
         struct bitmap *b;
-        unsigned words;
+        unsigned words, level, nsum;
 
         words = DIVROUNDUP(nbits, BITS_PER_WORD);
         b = kmalloc(sizeof(struct bitmap));
@@ -86,40 +367,138 @@ bitmap_create(unsigned nbits)
                 }
         }
 
+        /* Add summary levels until one fits in a single word */
+        b->lbits[0] = nbits;
+        b->nlevels = 0;
+        do {
+                KASSERT(b->nlevels < BITMAP_MAXLEVELS);
+                level = ++b->nlevels;
+                b->lbits[level] = DIVROUNDUP(b->lbits[level-1], SUM_BITS);
+                nsum = DIVROUNDUP(b->lbits[level], SUM_BITS);
+                b->sum[level-1] = kmalloc(nsum * sizeof(uint32_t));
+                b->any[level-1] = kmalloc(nsum * sizeof(uint32_t));
+                if (b->sum[level-1] == NULL || b->any[level-1] == NULL) {
+                        kfree(b->sum[level-1]);
+                        kfree(b->any[level-1]);
+                        b->nlevels--;
+                        bitmap_destroy(b);
+                        return NULL;
+                }
+        } while (b->lbits[level] > SUM_BITS);
+
+        bitmap_resummarize(b);
         return b;
 }
 
+/*
+ * Anyone who changes the data through this pointer (e.g. by reading
+ * it in from disk) must call bitmap_refresh afterwards.
+ */
 void *
 bitmap_getdata(struct bitmap *b)
 {
         return b->v;
 }
 
+void
+bitmap_refresh(struct bitmap *b)
+{
+        unsigned words = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned j;
+
+        /* Make sure the leftover bits at the end are still in use */
+        for (j = b->nbits % BITS_PER_WORD; j != 0 && j<BITS_PER_WORD; j++) {
+                b->v[words-1] |= ((WORD_TYPE)1 << j);
+        }
+
+        bitmap_resummarize(b);
+}
+
+/*
+ * Set bit INDEX, which must be clear, and hand it back.
+ */
+static
+void
+bitmap_take(struct bitmap *b, unsigned index, unsigned *ret)
+{
+        bitmap_mark(b, index);
+        *ret = index;
+}
+
 int
 bitmap_alloc(struct bitmap *b, unsigned *index)
 {
         unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+        ix = bitmap_findzero(b, 0, 0);
+        if (ix == NOBIT) {
+                return ENOSPC;
+        }
+        bitmap_take(b, ix, index);
+        return 0;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned ix;
+
+        ix = bitmap_findzero(b, 0, goal);
+        if (ix == NOBIT) {
+                /* Wrap around */
+                ix = bitmap_findzero(b, 0, 0);
+                if (ix == NOBIT) {
+                        return ENOSPC;
+                }
+        }
+        bitmap_take(b, ix, index);
+        return 0;
+}
+
+int
+bitmap_alloc_range(struct bitmap *b, unsigned n, unsigned *index)
+{
+        unsigned start, ix;
+
+        KASSERT(n > 0);
+
+        start = 0;
+        while ((start = bitmap_findzero(b, 0, start)) != NOBIT) {
+                /* See how far the clear run goes, up to N */
+                for (ix = start+1; ix < start+n; ix++) {
+                        if (ix >= b->nbits || bitmap_isset(b, ix)) {
+                                break;
+                        }
+                }
+                if (ix == start+n) {
+                        for (ix = start; ix < start+n; ix++) {
+                                bitmap_mark(b, ix);
                         }
-                        KASSERT(0);
+                        *index = start;
+                        return 0;
+                }
+                if (ix >= b->nbits) {
+                        break;
                 }
+                /* Bit IX is set; start looking again after it */
+                start = ix+1;
         }
         return ENOSPC;
 }
 
+int
+bitmap_findset(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned ix;
+
+        ix = bitmap_findone(b, 0, start);
+        if (ix == NOBIT) {
+                return ENOENT;
+        }
+        *index = ix;
+        return 0;
+}
+
 static
 inline
 void
@@ -142,6 +521,7 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        bitmap_propagate(b, index);
 }
 
 void
@@ -155,6 +535,7 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        bitmap_propagate(b, index);
 }
 
 
@@ -171,6 +552,12 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        unsigned level;
+
+        for (level=0; level<b->nlevels; level++) {
+                kfree(b->sum[level]);
+                kfree(b->any[level]);
+        }
         kfree(b->v);
         kfree(b);
 }
@@ -45,6 +45,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
@@ -108,10 +109,12 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	file_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	buffer_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
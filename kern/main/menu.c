@@ -40,6 +40,8 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <fs.h>
+#include <buf.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -424,6 +426,95 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+/*
+ * Command to show how full a filesystem is.
+ */
+static
+int
+cmd_df(int nargs, char **args)
+{
+	struct fs_stats st;
+	char *device;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: df device:\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	result = vfs_statfs(device, &st);
+	if (result) {
+		return result;
+	}
+
+	kprintf("%s: %u of %u blocks free (%zu bytes each), "
+		"%u of %u inodes free\n", device,
+		st.fst_freeblocks, st.fst_blocks, st.fst_blocksize,
+		st.fst_freefiles, st.fst_files);
+	return 0;
+}
+
+/*
+ * Command to set the size of the buffer cache, in blocks. Put it on
+ * the boot command line to have it take effect before anything is
+ * mounted.
+ */
+static
+int
+cmd_bufcache(int nargs, char **args)
+{
+	int nbufs;
+
+	if (nargs != 2) {
+		kprintf("Usage: bufcache nbuffers\n");
+		return EINVAL;
+	}
+
+	nbufs = atoi(args[1]);
+	if (nbufs <= 0) {
+		kprintf("bufcache: Invalid size %s\n", args[1]);
+		return EINVAL;
+	}
+
+	buffer_setmax(nbufs);
+	return 0;
+}
+
+/*
+ * Command to turn delayed writes in the buffer cache on or off. With
+ * write-back off, every modified block is written immediately.
+ */
+static
+int
+cmd_writeback(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: writeback on|off\n");
+		return EINVAL;
+	}
+
+	if (!strcmp(args[1], "on")) {
+		result = buffer_setwriteback(true);
+	}
+	else if (!strcmp(args[1], "off")) {
+		result = buffer_setwriteback(false);
+	}
+	else {
+		kprintf("Usage: writeback on|off\n");
+		return EINVAL;
+	}
+	return result;
+}
+
 /*
  * Command to set the "boot fs".
  *
@@ -528,11 +619,14 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+	"[df]      Show free space           ",
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[bufcache] Set buffer cache size    ",
+	"[writeback] Delayed writes on/off   ",
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
@@ -570,6 +664,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sy5] RW lock test                  ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -577,6 +672,9 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+#if OPT_SFS
+	"[fs7] SFS journal replay test       ",
+#endif
 	NULL
 };
 
@@ -634,11 +732,14 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+	{ "df",		cmd_df },
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "bufcache",	cmd_bufcache },
+	{ "writeback",	cmd_writeback },
 	{ "debug",	cmd_debug },
 	{ "panic",	cmd_panic },
 	{ "deadlock",	cmd_deadlock },
@@ -672,6 +773,7 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -704,6 +806,9 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+#if OPT_SFS
+	{ "fs7",	journaltest },
+#endif
 
 	{ NULL, NULL }
 };
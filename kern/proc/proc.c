@@ -59,7 +59,6 @@ struct proc *kproc;
 struct proc *lastproc;
 int proc_cnt;
 
-static struct fdt *proc_acquirefdt(void);
 static int proc_acquirepid(struct proc *proc);
 static void proc_removepid(struct proc *proc);
 
@@ -103,7 +102,7 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 
 	/* FDT fields */
-	proc->p_fdt = proc_acquirefdt();
+	proc->p_fdt = fdt_create();
 	if (proc->p_fdt== NULL) {
 		kfree(proc);
 		return NULL;
@@ -113,29 +112,6 @@ proc_create(const char *name)
 }
 
 
-static struct fdt *proc_acquirefdt(void){
-	struct fdt * fdt = kmalloc(sizeof(struct fdt));
-	if (fdt== NULL) {
-		kfree(fdt);
-		return NULL;
-	}
-
-	fdt->fdt_mutex = lock_create("fdt_mutex");
-	if(fdt->fdt_mutex == NULL){
-		kfree(fdt);
-		return NULL;
-	}
-
-	for(int i = 0; i<OPEN_MAX; i++){
-		fdt->fdt_entry[i] = NULL;
-	}
-
-	fdt->count = 0;
-	return fdt;
-}
-
-
-
 static int proc_acquirepid(struct proc *proc){
 	if(proc==NULL){
 		return -1;
@@ -243,28 +219,8 @@ proc_destroy(struct proc *proc)
 
 	/* FDT fields */
 	if (proc->p_fdt) {
-		for(int i = 0; i<OPEN_MAX; i++){
-			struct oft_entry *oft_entry = proc->p_fdt->fdt_entry[i];
-			if(oft_entry!=NULL){
-				/* check no other process is sharing access before destroying */
-					if(oft_entry->ref_cnt <= 1){
-						vfs_close(oft_entry->vn);
-						kfree(oft_entry);
-					}else{
-						lock_acquire(oft_entry->oft_mutex);
-						proc->p_fdt->count--;
-						lock_release(oft_entry->oft_mutex);
-					}
-					proc->p_fdt->fdt_entry[i] = NULL;
-					proc->p_fdt->count--;
-			}
-		}
-
-		if(proc->p_fdt->fdt_mutex!=NULL){
-			lock_destroy(proc->p_fdt->fdt_mutex);
-		}
-
-		kfree(proc->p_fdt);
+		/* oft entries still shared with other processes survive */
+		fdt_destroy(proc->p_fdt);
 		proc->p_fdt = NULL;
 	}
 
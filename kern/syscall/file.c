@@ -4,12 +4,16 @@
 #include <kern/limits.h>
 #include <kern/stat.h>
 #include <kern/seek.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <endian.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <bitmap.h>
+#include <objcache.h>
 #include <vfs.h>
 #include <vnode.h>
 #include <file.h>
@@ -22,12 +26,37 @@
 #include <addrspace.h>
 
 
-#define INVALID_FD(fd) (fd < 0 || fd >= OPEN_MAX)
+#define INVALID_FD(fd) (fd < 0 || fd >= FDT_MAXFILES)
 #define INVALID_READ(flags) (!((flags & O_RDONLY) || (flags & O_RDWR) ))
 #define INVALID_WRITE(flags) (!((flags & O_WRONLY) || (flags & O_RDWR) ))
 
+/* iovec arrays up to this long are copied in onto the stack rather than kmalloc'd */
+#define UIO_FASTIOV 8
+
+/* initial fdt size, and how many idle oft entries and fdts the caches hold on to */
+#define FDT_INITSIZE ROUNDUP(OPEN_MAX, 32)
+#define OFT_CACHEMAX 128
+#define FDT_CACHEMAX 16
+
+/* oft entries and fdts are kept constructed (locks and all) between uses */
+static struct objcache *oft_cache;
+static struct objcache *fdt_cache;
+
 static int validflag(int flag, int io_type);
-static int sys_io(int fd, void *buf, size_t nbytes, ssize_t *retval, int uio_rw_flag);
+static int oft_ctor(void *obj);
+static void oft_dtor(void *obj);
+static int fdt_ctor(void *obj);
+static void fdt_dtor(void *obj);
+static char *pathbuf_get(void);
+static int sys_io(int fd, struct iovec *iov, unsigned iovcnt, bool positional, off_t pos,
+                  ssize_t *retval, int uio_rw_flag);
+static int sys_iov(int fd, const struct iovec *uiov, int iovcnt, bool positional, off_t pos,
+                   ssize_t *retval, int uio_rw_flag);
+static int getoffset(struct trapframe *tf, off_t *pos);
+static void oft_incref(struct oft_entry *oft_entry);
+static struct oft_entry *fd_get(int fd);
+static int fdt_grow(struct fdt *fdt, unsigned want);
+static int fd_alloc(struct fdt *fdt, struct oft_entry *oft_entry, int *fd);
 
 
 /*
@@ -48,6 +77,113 @@ static int validflag(int flag, int io_type){
 }
 
 
+/*
+    void file_bootstrap(void)
+
+    Create the oft entry and fdt object caches.
+*/
+void file_bootstrap(void){
+    oft_cache = objcache_create("oft_entry", sizeof(struct oft_entry), OFT_CACHEMAX,
+                                oft_ctor, oft_dtor);
+    fdt_cache = objcache_create("fdt", sizeof(struct fdt), FDT_CACHEMAX,
+                                fdt_ctor, fdt_dtor);
+    if(oft_cache==NULL || fdt_cache==NULL){
+        panic("file_bootstrap: Out of memory\n");
+    }
+}
+
+
+
+/*
+    static int oft_ctor(void *obj), static void oft_dtor(void *obj)
+
+    Object cache hooks for oft entries: the oft_mutex and ref lock persist across reuse,
+    so opening a file doesn't have to create a lock.
+*/
+static int oft_ctor(void *obj){
+    struct oft_entry *oft_entry = obj;
+
+    oft_entry->oft_mutex = lock_create("oft_mutex");
+    if(oft_entry->oft_mutex == NULL){
+        return ENOMEM;
+    }
+    spinlock_init(&oft_entry->oft_reflock);
+    return 0;
+}
+
+static void oft_dtor(void *obj){
+    struct oft_entry *oft_entry = obj;
+
+    spinlock_cleanup(&oft_entry->oft_reflock);
+    lock_destroy(oft_entry->oft_mutex);
+}
+
+
+
+/*
+    static int fdt_ctor(void *obj), static void fdt_dtor(void *obj)
+
+    Object cache hooks for fdts. A cached fdt is empty (every slot NULL and the used map
+    clear) but keeps its locks, slot array and map, including any growth from an earlier
+    process, which the next process can then use without growing.
+*/
+static int fdt_ctor(void *obj){
+    struct fdt *fdt = obj;
+
+    fdt->fdt_entry = kmalloc(FDT_INITSIZE * sizeof(struct oft_entry *));
+    if(fdt->fdt_entry==NULL){
+        return ENOMEM;
+    }
+
+    fdt->fdt_used = bitmap_create(FDT_INITSIZE);
+    if(fdt->fdt_used==NULL){
+        kfree(fdt->fdt_entry);
+        return ENOMEM;
+    }
+
+    fdt->fdt_mutex = lock_create("fdt_mutex");
+    if(fdt->fdt_mutex==NULL){
+        bitmap_destroy(fdt->fdt_used);
+        kfree(fdt->fdt_entry);
+        return ENOMEM;
+    }
+
+    spinlock_init(&fdt->fdt_lock);
+
+    for(unsigned i = 0; i<FDT_INITSIZE; i++){
+        fdt->fdt_entry[i] = NULL;
+    }
+    fdt->fdt_size = FDT_INITSIZE;
+    return 0;
+}
+
+static void fdt_dtor(void *obj){
+    struct fdt *fdt = obj;
+
+    spinlock_cleanup(&fdt->fdt_lock);
+    lock_destroy(fdt->fdt_mutex);
+    bitmap_destroy(fdt->fdt_used);
+    kfree(fdt->fdt_entry);
+}
+
+
+
+/*
+    static char *pathbuf_get(void)
+
+    Return the current thread's PATH_MAX scratch buffer for copying in pathnames,
+    allocating it the first time. A syscall never needs more than one at once, and the
+    buffer is freed with the thread.
+*/
+static char *pathbuf_get(void){
+    if(curthread->t_pathbuf==NULL){
+        curthread->t_pathbuf = kmalloc(PATH_MAX);
+    }
+    return curthread->t_pathbuf;
+}
+
+
+
 /*
     int sys_open(const char *filename, int flags, mode_t mode, int *retval)
 
@@ -64,16 +200,11 @@ int sys_open(const char *filename, int flags, mode_t mode, int *retval){
         return EFAULT;
     }
 
-    /* intial check does not require fdt lock simply saves time from fail later on*/
-    if (curproc_fdt->count >= OPEN_MAX){
-        return EMFILE;
-    }
-
     /* safely copy filename from userspace to kernelspace */
     int result;
-    char *file = kmalloc(sizeof(char)*PATH_MAX);
+    char *file = pathbuf_get();
     if(file == NULL){
-        return EMFILE;
+        return ENOMEM;
     }
 
     size_t got_len = 0;
@@ -86,10 +217,8 @@ int sys_open(const char *filename, int flags, mode_t mode, int *retval){
     struct vnode *vn;
     result = vfs_open (file, flags, mode, &vn);
     if(result){
-        kfree(file);
         return result;
     }
-    kfree(file);
 
     /* create oft entry and allocate to process fdt */
     result = oft_acquire(vn, flags, mode, retval);
@@ -118,8 +247,8 @@ int oft_acquire(struct vnode *vn, int flags, mode_t mode, int *retval){
         return EFAULT;
     }
 
-    /* initialise oft entry */
-    struct oft_entry *oft_entry =  kmalloc(sizeof(struct oft_entry));
+    /* initialise oft entry; the cache has already made its locks */
+    struct oft_entry *oft_entry = objcache_get(oft_cache);
     if(oft_entry==NULL){
         return ENOMEM;
     }
@@ -130,41 +259,265 @@ int oft_acquire(struct vnode *vn, int flags, mode_t mode, int *retval){
     oft_entry->seek_pos = 0;
     oft_entry->ref_cnt = 1;
 
-    oft_entry->oft_mutex = lock_create("oft_mutex");
-    if(oft_entry->oft_mutex == NULL){
-        kfree(oft_entry);
+    lock_acquire(curproc_fdt->fdt_mutex);
+    int result = fd_alloc(curproc_fdt, oft_entry, retval);
+    lock_release(curproc_fdt->fdt_mutex);
+
+    if(result){
+        objcache_put(oft_cache, oft_entry);
+        return result;
+    }
+
+    return 0;
+}
+
+
+
+/*
+    struct fdt *fdt_create(void)
+
+    Get an empty fdt with the default limits.
+*/
+struct fdt *fdt_create(void){
+    struct fdt *fdt = objcache_get(fdt_cache);
+    if(fdt==NULL){
+        return NULL;
+    }
+
+    fdt->fdt_limit = OPEN_MAX;
+    fdt->fdt_hardlimit = FDT_MAXFILES;
+    fdt->count = 0;
+    return fdt;
+}
+
+
+
+/*
+    void fdt_destroy(struct fdt *fdt)
+
+    Empty an fdt, dropping its references to whatever oft entries it still has open,
+    and give it back to the cache. Only the open slots are visited, found through the
+    used map.
+*/
+void fdt_destroy(struct fdt *fdt){
+    unsigned i = 0;
+
+    while(bitmap_findset(fdt->fdt_used, i, &i) == 0){
+        struct oft_entry *oft_entry = fdt->fdt_entry[i];
+        KASSERT(oft_entry != NULL);
+        fdt->fdt_entry[i] = NULL;
+        bitmap_unmark(fdt->fdt_used, i);
+        fdt->count--;
+        oft_release(oft_entry);
+        i++;
+    }
+    KASSERT(fdt->count == 0);
+
+    objcache_put(fdt_cache, fdt);
+}
+
+
+
+/*
+    static int fdt_grow(struct fdt *fdt, unsigned want)
+
+    Make the fdt at least want slots big, doubling its size as often as needed.
+    Caller holds the fdt_mutex (or owns the fdt outright). The new slot array is swapped
+    in under the fdt_lock, so fd_get sees either the old array or the new one, both of
+    which hold the same entries.
+*/
+static int fdt_grow(struct fdt *fdt, unsigned want){
+    unsigned size = fdt->fdt_size;
+
+    KASSERT(want <= FDT_MAXFILES);
+    while(size < want){
+        size *= 2;
+    }
+    if(size > FDT_MAXFILES){
+        size = FDT_MAXFILES;
+    }
+    if(size == fdt->fdt_size){
+        return 0;
+    }
+
+    struct oft_entry **entry = kmalloc(size * sizeof(struct oft_entry *));
+    if(entry==NULL){
+        return ENOMEM;
+    }
+    struct bitmap *used = bitmap_create(size);
+    if(used==NULL){
+        kfree(entry);
         return ENOMEM;
     }
 
-    lock_acquire(curproc_fdt->fdt_mutex);
-    if (curproc_fdt->count >= OPEN_MAX){
-        kfree(oft_entry);
-        lock_release(curproc_fdt->fdt_mutex);
-        return EMFILE;
+    /* sizes are multiples of 32, so the old map is a whole number of bytes */
+    memcpy(bitmap_getdata(used), bitmap_getdata(fdt->fdt_used), fdt->fdt_size / CHAR_BIT);
+    bitmap_refresh(used);
+
+    memcpy(entry, fdt->fdt_entry, fdt->fdt_size * sizeof(struct oft_entry *));
+    for(unsigned i = fdt->fdt_size; i<size; i++){
+        entry[i] = NULL;
     }
 
-    /* allocate oft entry into process fdt */
-    for(int i = 0; i<OPEN_MAX; i++){
-        if(curproc_fdt_entry(i)==NULL){
-            curproc_fdt_entry(i) = oft_entry;
-            *retval = i;
-            break;
+    spinlock_acquire(&fdt->fdt_lock);
+    struct oft_entry **old = fdt->fdt_entry;
+    fdt->fdt_entry = entry;
+    fdt->fdt_size = size;
+    spinlock_release(&fdt->fdt_lock);
+
+    kfree(old);
+    bitmap_destroy(fdt->fdt_used);
+    fdt->fdt_used = used;
+
+    return 0;
+}
+
+
+
+/*
+    static int fd_alloc(struct fdt *fdt, struct oft_entry *oft_entry, int *fd)
+
+    Install oft_entry (whose reference passes to the fdt) in the lowest free slot, growing
+    the table if it is full. Fails with EMFILE if that slot would be at or above the
+    RLIMIT_NOFILE soft limit. Caller holds the fdt_mutex.
+*/
+static int fd_alloc(struct fdt *fdt, struct oft_entry *oft_entry, int *fd){
+    unsigned ix;
+    int result;
+
+    if(bitmap_alloc(fdt->fdt_used, &ix)){
+        /* every slot is in use; make more if the limit allows */
+        if(fdt->fdt_size >= fdt->fdt_limit){
+            return EMFILE;
         }
+        result = fdt_grow(fdt, fdt->fdt_size + 1);
+        if(result){
+            return result;
+        }
+        result = bitmap_alloc(fdt->fdt_used, &ix);
+        KASSERT(result == 0);
     }
 
-    curproc_fdt->count++;
-    lock_release(curproc_fdt->fdt_mutex);
+    if(ix >= fdt->fdt_limit){
+        bitmap_unmark(fdt->fdt_used, ix);
+        return EMFILE;
+    }
+
+    spinlock_acquire(&fdt->fdt_lock);
+    fdt->fdt_entry[ix] = oft_entry;
+    spinlock_release(&fdt->fdt_lock);
 
+    fdt->count++;
+    *fd = ix;
     return 0;
 }
 
 
 
+/*
+    int fdt_copy(struct fdt *src, struct fdt *dst)
+
+    Give the empty fdt dst the same open fds (sharing src's oft entries) and limits as src,
+    for fork. Only the open slots are visited, found through the used map.
+*/
+int fdt_copy(struct fdt *src, struct fdt *dst){
+    int result;
+
+    KASSERT(dst->count == 0);
+
+    lock_acquire(src->fdt_mutex);
+
+    result = fdt_grow(dst, src->fdt_size);
+    if(result){
+        lock_release(src->fdt_mutex);
+        return result;
+    }
+
+    unsigned i = 0;
+    while(bitmap_findset(src->fdt_used, i, &i) == 0){
+        oft_incref(src->fdt_entry[i]);
+        dst->fdt_entry[i] = src->fdt_entry[i];
+        bitmap_mark(dst->fdt_used, i);
+        i++;
+    }
+
+    dst->count = src->count;
+    dst->fdt_limit = src->fdt_limit;
+    dst->fdt_hardlimit = src->fdt_hardlimit;
+
+    lock_release(src->fdt_mutex);
+    return 0;
+}
+
+
+
+/*
+    static void oft_incref(struct oft_entry *oft_entry)
+
+    Take another reference to an oft entry.
+*/
+static void oft_incref(struct oft_entry *oft_entry){
+    spinlock_acquire(&oft_entry->oft_reflock);
+    oft_entry->ref_cnt++;
+    spinlock_release(&oft_entry->oft_reflock);
+}
+
+
+
+/*
+    void oft_release(struct oft_entry *oft_entry)
+
+    Drop a reference to an oft entry. The last one out closes the vnode and frees the entry.
+    Must not be called with a spinlock held, since vfs_close may sleep.
+*/
+void oft_release(struct oft_entry *oft_entry){
+    bool last;
+
+    spinlock_acquire(&oft_entry->oft_reflock);
+    KASSERT(oft_entry->ref_cnt > 0);
+    oft_entry->ref_cnt--;
+    last = (oft_entry->ref_cnt == 0);
+    spinlock_release(&oft_entry->oft_reflock);
+
+    if(last){
+        vfs_close(oft_entry->vn);
+        objcache_put(oft_cache, oft_entry);
+    }
+}
+
+
+
+/*
+    static struct oft_entry *fd_get(int fd)
+
+    Look up fd in the current process fdt and return its oft entry with a reference held,
+    or NULL if fd is not open. Only the fdt_lock spinlock is taken, for a few instructions,
+    so threads doing I/O on the same process's descriptors never sleep on the fdt_mutex,
+    which is only held while the table is being changed. The reference keeps the entry (and
+    its vnode) alive even if fd is closed or replaced by dup2 while the caller is using it;
+    drop it with oft_release.
+*/
+static struct oft_entry *fd_get(int fd){
+    struct oft_entry *oft_entry;
+
+    spinlock_acquire(&curproc_fdt->fdt_lock);
+    oft_entry = (unsigned)fd < curproc_fdt->fdt_size ? curproc_fdt_entry(fd) : NULL;
+    if(oft_entry!=NULL){
+        oft_incref(oft_entry);
+    }
+    spinlock_release(&curproc_fdt->fdt_lock);
+
+    return oft_entry;
+}
+
+
+
 /*
     int sys_close(int fd)
 
     Closes requested file descriptor. Other file handles are not affected in any way,
     even if they are sharing the same file vnode or oft_entry (ie dup2 and fork).
+    I/O already in progress on fd holds its own reference and finishes normally.
 */
 int sys_close(int fd){
     if(curproc_fdt==NULL){
@@ -176,50 +529,48 @@ int sys_close(int fd){
 
     lock_acquire(curproc_fdt->fdt_mutex);
 
-    struct oft_entry *oft_entry = curproc_fdt_entry(fd);
-    if (oft_entry==NULL){
+    /* slots only change under fdt_mutex, so they can be read here without the fdt_lock */
+    if ((unsigned)fd >= curproc_fdt->fdt_size || curproc_fdt_entry(fd)==NULL){
         lock_release(curproc_fdt->fdt_mutex);
         return EBADF;
     }
 
-    lock_acquire(oft_entry->oft_mutex);
-
-    if (curproc_fdt->count <= 0){
-        lock_acquire(oft_entry->oft_mutex);
-        lock_release(curproc_fdt->fdt_mutex);
-        return EMFILE;
-    }
-
-    /* release and cleanup oft_entry and fdt pointer */
-    /* do not cleanup oft_entry if other processes using it (dup2 and fork) */
-    if(oft_entry->ref_cnt > 1){
-        oft_entry->ref_cnt--;
-        curproc_fdt_entry(fd) = NULL;
-        lock_release(oft_entry->oft_mutex);
-    }else{
-        vfs_close(oft_entry->vn);
-        lock_release(oft_entry->oft_mutex);
-        lock_destroy(oft_entry->oft_mutex);
-        kfree(oft_entry);
-        curproc_fdt_entry(fd) = NULL;
-    }
+    spinlock_acquire(&curproc_fdt->fdt_lock);
+    struct oft_entry *oft_entry = curproc_fdt_entry(fd);
+    curproc_fdt_entry(fd) = NULL;
+    spinlock_release(&curproc_fdt->fdt_lock);
 
+    bitmap_unmark(curproc_fdt->fdt_used, fd);
+    KASSERT(curproc_fdt->count > 0);
     curproc_fdt->count--;
     lock_release(curproc_fdt->fdt_mutex);
 
+    /* release the fdt slot's reference; the entry goes once no other fd (dup2 and fork) uses it */
+    oft_release(oft_entry);
+
     return 0;
 }
 
 
 
 /*
-    int sys_io(int fd, void *buf, size_t nbytes, ssize_t *retval,  int rw_flag, int uio_rw_flag)
+    static int sys_io(int fd, struct iovec *iov, unsigned iovcnt, bool positional, off_t pos,
+                      ssize_t *retval, int uio_rw_flag)
 
-    Read or write up to nbytes of a file specified by fd, at the seek position of the file.
-    The file must have been opened with a valid matching read/write operation.
-    Each read/write operation is atomic relative to other I/O to the same file.
+    Read or write the iovcnt user buffers described by iov (in order) from/to the file
+    specified by fd. The file must have been opened with a valid matching read/write operation.
+
+    Without positional the I/O happens at the seek position of the file, which is advanced by
+    the number of bytes transferred; each such operation is atomic relative to other seek-position
+    I/O to the same file.
+
+    With positional the I/O happens at pos and the seek position is neither used nor updated,
+    so the oft_mutex is not taken at all: threads and processes sharing the oft entry (dup2 and
+    fork) can do positional I/O on it in parallel. The fields read (vn and flags) never change
+    after open, and the reference taken by fd_get keeps them valid across a concurrent close.
 */
-static int sys_io(int fd, void *buf, size_t nbytes, ssize_t *retval, int uio_rw_flag) {
+static int sys_io(int fd, struct iovec *iov, unsigned iovcnt, bool positional, off_t pos,
+                  ssize_t *retval, int uio_rw_flag) {
 
     if(curproc_fdt==NULL){
         return EFAULT;
@@ -229,68 +580,137 @@ static int sys_io(int fd, void *buf, size_t nbytes, ssize_t *retval, int uio_rw_
         return EBADF;
     }
 
-    if(buf==NULL){
+    if(retval==NULL){
         return EFAULT;
     }
 
-    if(retval==NULL){
-        return EFAULT;
+    if(positional && pos < 0){
+        return EINVAL;
     }
 
-    lock_acquire(curproc_fdt->fdt_mutex);
-    struct oft_entry *oft_entry = curproc_fdt_entry(fd);
+    /* total transfer size, which has to fit in the ssize_t return value */
+    size_t nbytes = 0;
+    for(unsigned i = 0; i<iovcnt; i++){
+        if(iov[i].iov_ubase==NULL && iov[i].iov_len > 0){
+            return EFAULT;
+        }
+        if(nbytes + iov[i].iov_len < nbytes || (ssize_t)(nbytes + iov[i].iov_len) < 0){
+            return EINVAL;
+        }
+        nbytes += iov[i].iov_len;
+    }
+
+    struct oft_entry *oft_entry = fd_get(fd);
     if(oft_entry==NULL){
-        lock_release(curproc_fdt->fdt_mutex);
         return EBADF;
     }
 
-    lock_acquire(oft_entry->oft_mutex);
-    lock_release(curproc_fdt->fdt_mutex);
-
-    struct iovec iov;
+    struct vnode *vn = oft_entry->vn;
     struct uio uio;
     int result;
 
     /* check file read/write status matches request */
     if(!validflag(oft_entry->flags, uio_rw_flag)) {
-        lock_release(oft_entry->oft_mutex);
+        oft_release(oft_entry);
         return EBADF;
     }
 
-    /* initialise the uio structure */
-    uio_kinit(&iov, &uio, (void *)buf, nbytes, oft_entry->seek_pos, uio_rw_flag);
+    if(positional){
+        if(!VOP_ISSEEKABLE(vn)){
+            oft_release(oft_entry);
+            return ESPIPE;
+        }
+    }else{
+        lock_acquire(oft_entry->oft_mutex);
+        pos = oft_entry->seek_pos;
+    }
 
+    /* initialise the uio structure */
+    uio.uio_iov = iov;
+    uio.uio_iovcnt = iovcnt;
+    uio.uio_offset = pos;
+    uio.uio_resid = nbytes;
     uio.uio_segflg = UIO_USERSPACE;
-	uio.uio_space = curproc->p_addrspace;
-
+    uio.uio_rw = uio_rw_flag;
+    uio.uio_space = curproc->p_addrspace;
 
     if (uio_rw_flag == UIO_WRITE) {
-        result = VOP_WRITE(oft_entry->vn, &uio);
-        if (result) {
-            lock_release(oft_entry->oft_mutex);
-            return result;
-        }
+        result = VOP_WRITE(vn, &uio);
     } else {
-        result = VOP_READ(oft_entry->vn, &uio);
-        if (result) {
-            lock_release(oft_entry->oft_mutex);
-            return result;
+        result = VOP_READ(vn, &uio);
+    }
+
+    if(!positional){
+        /* update the seek position */
+        if(!result){
+            oft_entry->seek_pos = uio.uio_offset;
         }
+        lock_release(oft_entry->oft_mutex);
     }
+    oft_release(oft_entry);
 
-    /* update the seek position */
-    oft_entry->seek_pos = uio.uio_offset;
+    if(result){
+        return result;
+    }
 
-    /* set number of bytes written */
+    /* set number of bytes transferred */
     *retval = nbytes - uio.uio_resid;
 
-    lock_release(oft_entry->oft_mutex);
-
     return 0;
 }
 
 
 
+/*
+    static int sys_iov(int fd, const struct iovec *uiov, int iovcnt, bool positional, off_t pos,
+                       ssize_t *retval, int uio_rw_flag)
+
+    Copy in the user's iovec array for readv/writev/preadv/pwritev and hand it to sys_io.
+    Short arrays are copied onto the stack; only long ones cost a kmalloc.
+*/
+static int sys_iov(int fd, const struct iovec *uiov, int iovcnt, bool positional, off_t pos,
+                   ssize_t *retval, int uio_rw_flag) {
+    struct iovec fastiov[UIO_FASTIOV];
+    struct iovec *iov = fastiov;
+    int result;
+
+    if(iovcnt <= 0 || iovcnt > IOV_MAX){
+        return EINVAL;
+    }
+
+    if(iovcnt > UIO_FASTIOV){
+        iov = kmalloc(iovcnt * sizeof(struct iovec));
+        if(iov==NULL){
+            return ENOMEM;
+        }
+    }
+
+    result = copyin((const_userptr_t)uiov, iov, iovcnt * sizeof(struct iovec));
+    if(!result){
+        result = sys_io(fd, iov, iovcnt, positional, pos, retval, uio_rw_flag);
+    }
+
+    if(iov != fastiov){
+        kfree(iov);
+    }
+    return result;
+}
+
+
+
+/*
+    static int getoffset(struct trapframe *tf, off_t *pos)
+
+    Fetch the 64bit file offset of pread/pwrite/preadv/pwritev. The first three arguments
+    use a0-a2, and since a 64bit value needs an aligned register pair and a3 is unpaired
+    the offset is passed in the first two argument slots on the user stack.
+*/
+static int getoffset(struct trapframe *tf, off_t *pos){
+    return copyin((userptr_t)tf->tf_sp + 16, pos, sizeof(off_t));
+}
+
+
+
 /*
     int sys_write(int fd, void *buf, size_t nbytes, ssize_t *retval)
 
@@ -301,7 +721,14 @@ static int sys_io(int fd, void *buf, size_t nbytes, ssize_t *retval, int uio_rw_
     Each write (or read) operation is atomic relative to other I/O to the same file.
 */
 int sys_write(int fd, void *buf, size_t nbytes, ssize_t *retval){
-    return sys_io(fd, buf, nbytes, retval, UIO_WRITE);
+    struct iovec iov;
+
+    if(buf==NULL){
+        return EFAULT;
+    }
+    iov.iov_ubase = (userptr_t)buf;
+    iov.iov_len = nbytes;
+    return sys_io(fd, &iov, 1, false, 0, retval, UIO_WRITE);
 }
 
 
@@ -316,7 +743,128 @@ int sys_write(int fd, void *buf, size_t nbytes, ssize_t *retval){
     Each read (or write) operation is atomic relative to other I/O to the same file.
 */
 int sys_read(int fd, void *buf, size_t nbytes, ssize_t *retval){
-    return sys_io(fd, buf, nbytes, retval, UIO_READ);
+    struct iovec iov;
+
+    if(buf==NULL){
+        return EFAULT;
+    }
+    iov.iov_ubase = (userptr_t)buf;
+    iov.iov_len = nbytes;
+    return sys_io(fd, &iov, 1, false, 0, retval, UIO_READ);
+}
+
+
+
+/*
+    int sys_pwrite(int fd, void *buf, size_t nbytes, ssize_t *retval, struct trapframe *tf)
+
+    Like write, but at the offset given as the fourth argument rather than the seek position,
+    which is left untouched. The file must be seekable.
+*/
+int sys_pwrite(int fd, void *buf, size_t nbytes, ssize_t *retval, struct trapframe *tf){
+    struct iovec iov;
+    off_t pos;
+    int result;
+
+    if(buf==NULL){
+        return EFAULT;
+    }
+    result = getoffset(tf, &pos);
+    if(result){
+        return result;
+    }
+    iov.iov_ubase = (userptr_t)buf;
+    iov.iov_len = nbytes;
+    return sys_io(fd, &iov, 1, true, pos, retval, UIO_WRITE);
+}
+
+
+
+/*
+    int sys_pread(int fd, void *buf, size_t nbytes, ssize_t *retval, struct trapframe *tf)
+
+    Like read, but at the offset given as the fourth argument rather than the seek position,
+    which is left untouched. The file must be seekable.
+*/
+int sys_pread(int fd, void *buf, size_t nbytes, ssize_t *retval, struct trapframe *tf){
+    struct iovec iov;
+    off_t pos;
+    int result;
+
+    if(buf==NULL){
+        return EFAULT;
+    }
+    result = getoffset(tf, &pos);
+    if(result){
+        return result;
+    }
+    iov.iov_ubase = (userptr_t)buf;
+    iov.iov_len = nbytes;
+    return sys_io(fd, &iov, 1, true, pos, retval, UIO_READ);
+}
+
+
+
+/*
+    int sys_writev(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval)
+
+    Like write, but gathers the data from the iovcnt buffers in iov, in order, in one
+    atomic operation.
+*/
+int sys_writev(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval){
+    return sys_iov(fd, iov, iovcnt, false, 0, retval, UIO_WRITE);
+}
+
+
+
+/*
+    int sys_readv(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval)
+
+    Like read, but scatters the data into the iovcnt buffers in iov, in order, filling
+    each before moving to the next.
+*/
+int sys_readv(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval){
+    return sys_iov(fd, iov, iovcnt, false, 0, retval, UIO_READ);
+}
+
+
+
+/*
+    int sys_pwritev(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval,
+                    struct trapframe *tf)
+
+    writev at an explicit offset (passed like pwrite's); the seek position is left untouched.
+*/
+int sys_pwritev(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval,
+                struct trapframe *tf){
+    off_t pos;
+    int result;
+
+    result = getoffset(tf, &pos);
+    if(result){
+        return result;
+    }
+    return sys_iov(fd, iov, iovcnt, true, pos, retval, UIO_WRITE);
+}
+
+
+
+/*
+    int sys_preadv(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval,
+                   struct trapframe *tf)
+
+    readv at an explicit offset (passed like pread's); the seek position is left untouched.
+*/
+int sys_preadv(int fd, const struct iovec *iov, int iovcnt, ssize_t *retval,
+               struct trapframe *tf){
+    off_t pos;
+    int result;
+
+    result = getoffset(tf, &pos);
+    if(result){
+        return result;
+    }
+    return sys_iov(fd, iov, iovcnt, true, pos, retval, UIO_READ);
 }
 
 
@@ -340,42 +888,50 @@ int sys_dup2(int oldfd, int newfd, int *retval){
         return EBADF;
     }
 
-    if (oldfd == newfd){
-        *retval = oldfd;
-        return 0;
-    }
+    lock_acquire(curproc_fdt->fdt_mutex);
 
+    /* slots only change under fdt_mutex, so they can be read here without the fdt_lock */
+    if((unsigned)oldfd >= curproc_fdt->fdt_size || curproc_fdt_entry(oldfd)==NULL){
+        lock_release(curproc_fdt->fdt_mutex);
+        return EBADF;
+    }
     struct oft_entry *old_oft = curproc_fdt_entry(oldfd);
-    struct oft_entry *new_oft = curproc_fdt_entry(newfd);
 
-    lock_acquire(curproc_fdt->fdt_mutex);
-    if(old_oft==NULL){
+    if((unsigned)newfd >= curproc_fdt->fdt_limit){
         lock_release(curproc_fdt->fdt_mutex);
         return EBADF;
     }
 
-    lock_acquire(old_oft->oft_mutex);
+    if (oldfd == newfd){
+        lock_release(curproc_fdt->fdt_mutex);
+        *retval = oldfd;
+        return 0;
+    }
 
-    /* if newfd already exists, close newfd, and replace with oldfd */
-    if(new_oft!=NULL){
-        lock_acquire(new_oft->oft_mutex);
-        int chk = sys_close(newfd);
-        if(chk){
-            lock_release(new_oft->oft_mutex);
-            lock_release(old_oft->oft_mutex);
-            lock_release(curproc_fdt->fdt_mutex);
-            return chk;
-        }
+    int result = fdt_grow(curproc_fdt, newfd + 1);
+    if(result){
+        lock_release(curproc_fdt->fdt_mutex);
+        return result;
     }
 
+    /* point newfd at the old_oft entry, closing whatever newfd named before */
+    oft_incref(old_oft);
+    spinlock_acquire(&curproc_fdt->fdt_lock);
+    struct oft_entry *new_oft = curproc_fdt_entry(newfd);
+    curproc_fdt_entry(newfd) = old_oft;
+    spinlock_release(&curproc_fdt->fdt_lock);
+
+    if(new_oft==NULL){
+        bitmap_mark(curproc_fdt->fdt_used, newfd);
+        curproc_fdt->count++;
+    }
     lock_release(curproc_fdt->fdt_mutex);
 
-    /* point new_oft to the old_oft entry */
-    curproc_fdt_entry(newfd) = old_oft;
-    curproc_fdt_entry(newfd)->ref_cnt++;
-    *retval = newfd;
+    if(new_oft!=NULL){
+        oft_release(new_oft);
+    }
 
-    lock_release(old_oft->oft_mutex);
+    *retval = newfd;
 
     return 0;
 }
@@ -411,19 +967,16 @@ int sys_lseek(int fd, int *retval, struct trapframe *tf){
         return result;
     }
 
-    lock_acquire(curproc_fdt->fdt_mutex);
-
-    struct oft_entry *oft_entry = curproc_fdt_entry(fd);
+    struct oft_entry *oft_entry = fd_get(fd);
     if(oft_entry == NULL){
-        lock_release(curproc_fdt->fdt_mutex);
         return EBADF;
     }
 
     lock_acquire(oft_entry->oft_mutex);
-    lock_release(curproc_fdt->fdt_mutex);
 
     if (!(VOP_ISSEEKABLE(oft_entry->vn))) {
         lock_release(oft_entry->oft_mutex);
+        oft_release(oft_entry);
         return ESPIPE;
     }
 
@@ -431,16 +984,16 @@ int sys_lseek(int fd, int *retval, struct trapframe *tf){
         /* Seek relative to beginning of file */
         case SEEK_SET:
             if (offset < 0) {
-                lock_release(oft_entry->oft_mutex);
-                return EINVAL;
+                result = EINVAL;
+                break;
             }
             oft_entry->seek_pos = offset;
             break;
         /* Seek relative to current position in file */
         case SEEK_CUR:
             if ((oft_entry->seek_pos + offset) < 0) {
-                lock_release(oft_entry->oft_mutex);
-                return EINVAL;
+                result = EINVAL;
+                break;
             }
             oft_entry->seek_pos += offset;
             break;
@@ -448,26 +1001,30 @@ int sys_lseek(int fd, int *retval, struct trapframe *tf){
         case SEEK_END:
             result = VOP_STAT(oft_entry->vn, &fstat);
             if (result) {
-                lock_release(oft_entry->oft_mutex);
-                return result;
+                break;
             }
             file_size = fstat.st_size;
             if ((file_size + offset) < 0) {
-
-                lock_release(oft_entry->oft_mutex);
-                return EINVAL;
+                result = EINVAL;
+                break;
             }
             oft_entry->seek_pos = file_size + offset;
             break;
         default:
-            lock_release(oft_entry->oft_mutex);
-            return EINVAL;
+            result = EINVAL;
             break;
     }
 
+    if (result) {
+        lock_release(oft_entry->oft_mutex);
+        oft_release(oft_entry);
+        return result;
+    }
+
     /* Split 64bit value into seperate return arguments */
     split64to32(oft_entry->seek_pos, &tf->tf_v0, &tf->tf_v1);
     lock_release(oft_entry->oft_mutex);
+    oft_release(oft_entry);
 
     /* Set retval to v0 value as v0 is overwritten by syscall on return */
     *retval = (uint32_t)tf->tf_v0;
@@ -478,6 +1035,77 @@ int sys_lseek(int fd, int *retval, struct trapframe *tf){
 
 
 
+/*
+    int sys_getrlimit(int resource, userptr_t rlp)
+
+    Copy out the soft and hard limits for resource. Only RLIMIT_NOFILE, the bound on
+    file descriptor numbers (one more than the highest fd that may be opened), is kept.
+*/
+int sys_getrlimit(int resource, userptr_t rlp){
+    struct rlimit rl;
+
+    if(curproc_fdt==NULL){
+        return EFAULT;
+    }
+
+    if(resource != RLIMIT_NOFILE){
+        return EINVAL;
+    }
+
+    lock_acquire(curproc_fdt->fdt_mutex);
+    rl.rlim_cur = curproc_fdt->fdt_limit;
+    rl.rlim_max = curproc_fdt->fdt_hardlimit;
+    lock_release(curproc_fdt->fdt_mutex);
+
+    return copyout(&rl, rlp, sizeof(struct rlimit));
+}
+
+
+
+/*
+    int sys_setrlimit(int resource, const_userptr_t rlp)
+
+    Set the soft and hard limits for resource (RLIMIT_NOFILE only). The soft limit may be
+    anything up to the hard limit; the hard limit may be lowered but not raised. Lowering
+    the soft limit below fds that are already open leaves them open, but no new fd at or
+    above it can be created. The fdt grows lazily, so a large limit costs nothing until
+    the fds are actually opened.
+*/
+int sys_setrlimit(int resource, const_userptr_t rlp){
+    struct rlimit rl;
+    int result;
+
+    if(curproc_fdt==NULL){
+        return EFAULT;
+    }
+
+    result = copyin(rlp, &rl, sizeof(struct rlimit));
+    if(result){
+        return result;
+    }
+
+    if(resource != RLIMIT_NOFILE){
+        return EINVAL;
+    }
+
+    if(rl.rlim_cur > rl.rlim_max){
+        return EINVAL;
+    }
+
+    lock_acquire(curproc_fdt->fdt_mutex);
+    if(rl.rlim_max > curproc_fdt->fdt_hardlimit){
+        lock_release(curproc_fdt->fdt_mutex);
+        return EPERM;
+    }
+    curproc_fdt->fdt_limit = rl.rlim_cur;
+    curproc_fdt->fdt_hardlimit = rl.rlim_max;
+    lock_release(curproc_fdt->fdt_mutex);
+
+    return 0;
+}
+
+
+
 /*
     pid_t fork(void)
 
@@ -510,23 +1138,14 @@ int sys_fork(pid_t *retval, struct trapframe *tf){
         return ENOMEM;
     }
 
-    /* copy VFS information onto child */
-    cproc->p_fdt->fdt_mutex = lock_create("fdt_mutex");
-    if(cproc->p_fdt->fdt_mutex == NULL){
+    /* copy VFS information onto child; each fd keeps its number and shares the parent's oft entry */
+    result = fdt_copy(curproc_fdt, cproc->p_fdt);
+    if (result) {
         proc_destroy(cproc);
         kfree(ctf);
-        return ENOMEM;
-    }
-
-    for (int ci = 0, pi = 0; pi < OPEN_MAX; pi++) {
-        if (curproc_fdt_entry(pi) != NULL) {
-            cproc->p_fdt->fdt_entry[ci++] = curproc_fdt_entry(pi);
-            curproc_fdt_entry(pi)->ref_cnt++;
-        }
+        return result;
     }
 
-    cproc->p_fdt->count = curproc_fdt->count;
-
     /* copy address space of parent and assign to child */
     result = as_copy(curproc->p_addrspace, &cproc->p_addrspace);
     if (result) {
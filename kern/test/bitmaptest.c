@@ -28,11 +28,128 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
 
 #define TESTSIZE 533
+#define BIGTESTSIZE 40000	/* enough for three summary levels */
+#define RUNSIZE 37
+
+/*
+ * Check bitmap_alloc_near and bitmap_alloc_range on a large, mostly
+ * full bitmap.
+ */
+static
+void
+bitmaptest_big(void)
+{
+	struct bitmap *b;
+	uint32_t x, goal;
+	unsigned i, hole;
+
+	b = bitmap_create(BIGTESTSIZE);
+	KASSERT(b != NULL);
+
+	/* Fill it completely */
+	for (i=0; i<BIGTESTSIZE; i++) {
+		KASSERT(bitmap_alloc(b, &x) == 0);
+		KASSERT(x == i);
+	}
+	KASSERT(bitmap_alloc(b, &x) == ENOSPC);
+	KASSERT(bitmap_alloc_near(b, 0, &x) == ENOSPC);
+	KASSERT(bitmap_alloc_range(b, 1, &x) == ENOSPC);
+
+	/* Single holes: near finds the next one, wrapping around */
+	hole = BIGTESTSIZE / 3;
+	bitmap_unmark(b, hole);
+	bitmap_unmark(b, BIGTESTSIZE - 1);
+	KASSERT(bitmap_alloc_near(b, hole + 1, &x) == 0);
+	KASSERT(x == BIGTESTSIZE - 1);
+	KASSERT(bitmap_alloc_near(b, hole + 1, &x) == 0);
+	KASSERT(x == hole);
+	KASSERT(bitmap_alloc_near(b, hole + 1, &x) == ENOSPC);
+
+	/* Random holes; near always gets the first at or after goal */
+	for (i=0; i<BIGTESTSIZE/100; i++) {
+		x = random() % BIGTESTSIZE;
+		if (bitmap_isset(b, x)) {
+			bitmap_unmark(b, x);
+		}
+	}
+	goal = random() % BIGTESTSIZE;
+	while (bitmap_alloc_near(b, goal, &x) == 0) {
+		for (i=goal; i != x; i = (i+1) % BIGTESTSIZE) {
+			KASSERT(bitmap_isset(b, i));
+		}
+		goal = x;
+	}
+	for (i=0; i<BIGTESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i));
+	}
+
+	/* A run too short, then one long enough */
+	for (i=0; i<RUNSIZE-1; i++) {
+		bitmap_unmark(b, 100 + i);
+	}
+	for (i=0; i<RUNSIZE; i++) {
+		bitmap_unmark(b, 30000 + i);
+	}
+	KASSERT(bitmap_alloc_range(b, RUNSIZE, &x) == 0);
+	KASSERT(x == 30000);
+	for (i=0; i<RUNSIZE; i++) {
+		KASSERT(bitmap_isset(b, 30000 + i));
+	}
+	KASSERT(bitmap_alloc_range(b, RUNSIZE, &x) == ENOSPC);
+	KASSERT(bitmap_alloc_range(b, RUNSIZE-1, &x) == 0);
+	KASSERT(x == 100);
+
+	bitmap_destroy(b);
+}
+
+/*
+ * Check bitmap_findset on a large, sparse bitmap.
+ */
+static
+void
+bitmaptest_findset(void)
+{
+	struct bitmap *b;
+	uint32_t x;
+	unsigned i, next, count;
+
+	b = bitmap_create(BIGTESTSIZE);
+	KASSERT(b != NULL);
+	KASSERT(bitmap_findset(b, 0, &x) == ENOENT);
+
+	count = 0;
+	for (i=0; i<BIGTESTSIZE/500; i++) {
+		x = random() % BIGTESTSIZE;
+		if (!bitmap_isset(b, x)) {
+			bitmap_mark(b, x);
+			count++;
+		}
+	}
+	bitmap_mark(b, BIGTESTSIZE - 1);
+	count++;
+
+	/* Walking the set bits finds each one, skipping nothing */
+	next = 0;
+	while (bitmap_findset(b, next, &x) == 0) {
+		for (i=next; i<x; i++) {
+			KASSERT(bitmap_isset(b, i)==0);
+		}
+		KASSERT(bitmap_isset(b, x));
+		KASSERT(count > 0);
+		count--;
+		next = x + 1;
+	}
+	KASSERT(count == 0);
+	KASSERT(next == BIGTESTSIZE);
+
+	bitmap_destroy(b);
+}
 
 int
 bitmaptest(int nargs, char **args)
@@ -101,6 +218,11 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	bitmap_destroy(b);
+
+	bitmaptest_big();
+	bitmaptest_findset();
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
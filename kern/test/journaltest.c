@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2026
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * journaltest - SFS journal recovery test
+ *
+ * Runs a few transactions on an SFS volume with a journal, "crashes"
+ * the volume right after the last one commits (see sfs_crash), and
+ * unmounts and remounts it so the mount has to replay the log. Then
+ * checks that what comes back is what was committed.
+ *
+ * The transactions are picked so replay has to get two things right:
+ * the directory and one inode are logged twice, so only the newest
+ * copy of each will do, and a file whose inode and indirect block are
+ * in the log is removed, so those copies are revoked. The file written
+ * after that is big enough to get the blocks back as data, which
+ * replaying the revoked copies would clobber.
+ *
+ * This only checks the files; to check the rest of the metadata,
+ * unmount the volume afterwards and run sfsck on it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/sfs.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <sfs.h>
+#include <test.h>
+
+#define DIRNAME  "journaltest.tmp"
+#define NREUSE   48	/* blocks in the file written after the remove */
+
+/*
+ * Make "DEV:DIRNAME/NAME", or just "DEV:DIRNAME" if NAME is NULL.
+ */
+static
+void
+jt_makename(char *buf, size_t buflen, const char *dev, const char *name)
+{
+	if (name == NULL) {
+		snprintf(buf, buflen, "%s:%s", dev, DIRNAME);
+	}
+	else {
+		snprintf(buf, buflen, "%s:%s/%s", dev, DIRNAME, name);
+	}
+	KASSERT(strlen(buf) < buflen);
+}
+
+/*
+ * Contents of block BLOCK of a file; SEED tells the files apart.
+ */
+static
+void
+jt_fill(char *buf, unsigned block, unsigned seed)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		buf[i] = 'A' + (block + seed + i / 64) % 26;
+	}
+}
+
+/*
+ * Check a block read back from a file against jt_fill.
+ */
+static
+bool
+jt_same(const char *buf, unsigned block, unsigned seed)
+{
+	char expected[SFS_BLOCKSIZE];
+	unsigned i;
+
+	jt_fill(expected, block, seed);
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		if (buf[i] != expected[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Write blocks START..START+NUM-1 of file NAME, creating it if need be.
+ */
+static
+int
+jt_write(const char *dev, const char *name, unsigned start, unsigned num,
+	 unsigned seed)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char path[64];
+	char buf[SFS_BLOCKSIZE];
+	unsigned i;
+	int err;
+
+	/* vfs_open destroys the string it's passed */
+	jt_makename(path, sizeof(path), dev, name);
+	err = vfs_open(path, O_WRONLY|O_CREAT, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for write: %s\n",
+			name, strerror(err));
+		return -1;
+	}
+
+	for (i=start; i<start+num; i++) {
+		jt_fill(buf, i, seed);
+		uio_kinit(&iov, &ku, buf, SFS_BLOCKSIZE,
+			  (off_t)i * SFS_BLOCKSIZE, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err) {
+			kprintf("%s: Write error: %s\n", name, strerror(err));
+			vfs_close(vn);
+			return -1;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short write: %lu bytes left over\n",
+				name, (unsigned long) ku.uio_resid);
+			vfs_close(vn);
+			return -1;
+		}
+	}
+
+	vfs_close(vn);
+	return 0;
+}
+
+/*
+ * Check that blocks START..START+NUM-1 of file NAME are what jt_write
+ * put there, and that the file ends after them.
+ */
+static
+int
+jt_check(const char *dev, const char *name, unsigned start, unsigned num,
+	 unsigned seed)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char path[64];
+	char buf[SFS_BLOCKSIZE];
+	unsigned i;
+	int err;
+
+	jt_makename(path, sizeof(path), dev, name);
+	err = vfs_open(path, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for read: %s\n",
+			name, strerror(err));
+		return -1;
+	}
+
+	for (i=start; i<start+num+1; i++) {
+		uio_kinit(&iov, &ku, buf, SFS_BLOCKSIZE,
+			  (off_t)i * SFS_BLOCKSIZE, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("%s: Read error: %s\n", name, strerror(err));
+			vfs_close(vn);
+			return -1;
+		}
+		if (i == start+num) {
+			if (ku.uio_resid != SFS_BLOCKSIZE) {
+				kprintf("%s: File is too long\n", name);
+				vfs_close(vn);
+				return -1;
+			}
+			break;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short read at block %u\n", name, i);
+			vfs_close(vn);
+			return -1;
+		}
+		if (!jt_same(buf, i, seed)) {
+			kprintf("%s: Block %u has the wrong contents\n",
+				name, i);
+			vfs_close(vn);
+			return -1;
+		}
+	}
+
+	vfs_close(vn);
+	kprintf("%s: %u blocks ok\n", name, num);
+	return 0;
+}
+
+/*
+ * Commit the running transaction (fsync commits everything, not just
+ * the file it's called on).
+ */
+static
+int
+jt_commit(const char *dev)
+{
+	struct vnode *vn;
+	char path[64];
+	int err;
+
+	jt_makename(path, sizeof(path), dev, NULL);
+	err = vfs_open(path, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s: %s\n", DIRNAME, strerror(err));
+		return -1;
+	}
+	err = VOP_FSYNC(vn);
+	vfs_close(vn);
+	if (err) {
+		kprintf("fsync: %s\n", strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+jt_remove(const char *dev, const char *name, bool quiet)
+{
+	char path[64];
+	int err;
+
+	jt_makename(path, sizeof(path), dev, name);
+	err = name == NULL ? vfs_rmdir(path) : vfs_remove(path);
+	if (err) {
+		if (!quiet) {
+			kprintf("Could not remove %s: %s\n",
+				name == NULL ? DIRNAME : name,
+				strerror(err));
+		}
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+jt_checkgone(const char *dev, const char *name)
+{
+	struct vnode *vn;
+	char path[64];
+	int err;
+
+	jt_makename(path, sizeof(path), dev, name);
+	err = vfs_open(path, O_RDONLY, 0664, &vn);
+	if (err == ENOENT) {
+		kprintf("%s: gone, ok\n", name);
+		return 0;
+	}
+	if (err) {
+		kprintf("%s: open: %s\n", name, strerror(err));
+		return -1;
+	}
+	vfs_close(vn);
+	kprintf("%s: Removed file came back\n", name);
+	return -1;
+}
+
+/*
+ * Set up the volume and crash it after the last commit.
+ */
+static
+int
+jt_run(const char *dev)
+{
+	char path[64];
+	int err;
+
+	/* Anything left over from a failed run */
+	jt_remove(dev, "keep", true);
+	jt_remove(dev, "gone", true);
+	jt_remove(dev, "new", true);
+	jt_remove(dev, "reuse", true);
+	jt_remove(dev, NULL, true);
+
+	/* Start with an empty log */
+	err = vfs_sync();
+	if (err) {
+		kprintf("sync: %s\n", strerror(err));
+		return -1;
+	}
+
+	jt_makename(path, sizeof(path), dev, NULL);
+	err = vfs_mkdir(path, 0775);
+	if (err) {
+		kprintf("Could not create %s: %s\n", DIRNAME, strerror(err));
+		return -1;
+	}
+
+	/* 1: two files, one big enough to have an indirect block */
+	if (jt_write(dev, "keep", 0, 4, 0) ||
+	    jt_write(dev, "gone", SFS_NDIRECT, 4, 1) ||
+	    jt_commit(dev)) {
+		return -1;
+	}
+
+	/* 2: the directory and keep's inode again */
+	if (jt_write(dev, "new", 0, 2, 2) ||
+	    jt_write(dev, "keep", 4, 2, 0) ||
+	    jt_commit(dev)) {
+		return -1;
+	}
+
+	/* 3: revokes gone's inode and indirect block */
+	if (jt_remove(dev, "gone", false) ||
+	    jt_commit(dev)) {
+		return -1;
+	}
+
+	/* 4: puts file data on the blocks gone had, then crash */
+	if (jt_write(dev, "reuse", 0, NREUSE, 3)) {
+		return -1;
+	}
+	err = sfs_crash(dev);
+	if (err) {
+		kprintf("sfs_crash: %s (does %s have a journal?)\n",
+			strerror(err), dev);
+		return -1;
+	}
+	return jt_commit(dev);
+}
+
+static
+void
+dojournaltest(const char *dev)
+{
+	int err;
+
+	kprintf("*** Starting journal replay test on %s:\n", dev);
+
+	if (jt_run(dev)) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	err = vfs_unmount(dev);
+	if (err) {
+		kprintf("unmount %s: %s\n", dev, strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+	err = sfs_mount(dev);
+	if (err) {
+		kprintf("mount %s: %s\n", dev, strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	if (jt_check(dev, "keep", 0, 6, 0) ||
+	    jt_check(dev, "new", 0, 2, 2) ||
+	    jt_check(dev, "reuse", 0, NREUSE, 3) ||
+	    jt_checkgone(dev, "gone")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	kprintf("*** Journal replay test done; unmount %s: and run sfsck "
+		"on it to check the rest\n", dev);
+}
+
+int
+journaltest(int nargs, char **args)
+{
+	char *device;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs7 filesystem:\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	dojournaltest(device);
+	return 0;
+}
@@ -399,3 +399,103 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test. Writers update the test values together;
+ * readers check that they never see a half-done update. Some of the
+ * readers should also overlap with each other.
+ */
+
+#define NRWLOOPS 60
+
+static struct rwlock *testrw;
+static volatile unsigned long rwreaders;
+static volatile unsigned long rwmaxreaders;
+static volatile bool rwfailed;
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	unsigned long n;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrw);
+			testval1 = num;
+			thread_yield();
+			testval2 = num*num;
+			testval3 = num%3;
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			lock_acquire(testlock);
+			n = ++rwreaders;
+			if (n > rwmaxreaders) {
+				rwmaxreaders = n;
+			}
+			lock_release(testlock);
+
+			for (j=0; j<300; j++);
+			if (testval2 != testval1*testval1 ||
+			    testval3 != testval1%3) {
+				rwfailed = true;
+			}
+
+			lock_acquire(testlock);
+			rwreaders--;
+			lock_release(testlock);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (testrw == NULL) {
+		testrw = rwlock_create("testrw");
+		if (testrw == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = testval2 = testval3 = 0;
+	rwreaders = rwmaxreaders = 0;
+	rwfailed = false;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	if (rwfailed) {
+		kprintf("Reader saw a partial update\n");
+		kprintf("Test failed\n");
+	}
+	kprintf("Most readers at once: %lu\n", rwmaxreaders);
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
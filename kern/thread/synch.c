@@ -315,3 +315,121 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock
+
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_lock = lock_create(rw->rwlock_name);
+	if (rw->rw_lock == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_cv = cv_create(rw->rwlock_name);
+	if (rw->rw_cv == NULL) {
+		lock_destroy(rw->rw_lock);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writerswaiting == 0);
+	KASSERT(rw->rw_writer == NULL);
+	cv_destroy(rw->rw_cv);
+	lock_destroy(rw->rw_lock);
+
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	lock_acquire(rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0) {
+		cv_wait(rw->rw_cv, rw->rw_lock);
+	}
+	rw->rw_readers++;
+	lock_release(rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	lock_acquire(rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+		cv_broadcast(rw->rw_cv, rw->rw_lock);
+	}
+	lock_release(rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	lock_acquire(rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		cv_wait(rw->rw_cv, rw->rw_lock);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+	lock_release(rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	lock_acquire(rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	cv_broadcast(rw->rw_cv, rw->rw_lock);
+	lock_release(rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	lock_acquire(rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	lock_release(rw->rw_lock);
+
+	return ret;
+}
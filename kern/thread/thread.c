@@ -147,6 +147,10 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	thread->t_fstrans = 0;
+	thread->t_pathbuf = NULL;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -280,6 +284,11 @@ thread_destroy(struct thread *thread)
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
+	/* Public fields */
+	if (thread->t_pathbuf != NULL) {
+		kfree(thread->t_pathbuf);
+	}
+
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
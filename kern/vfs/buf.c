@@ -0,0 +1,1138 @@
+/*
+ * Disk buffer cache.
+ *
+ * Buffers live in a hash table keyed on (fs, block) and, when nobody
+ * has them pinned, on an LRU list. Everything here is protected by
+ * buffer_lock; the contents of a buffer are protected by holding it
+ * (b_holder), which is what buffer_read/buffer_get hand out. Disk I/O
+ * is always done with the buffer held and buffer_lock released.
+ *
+ * Readahead requests are queued and filled by a kernel thread, so the
+ * thread that asks for them doesn't wait. Requests are ranges of
+ * blocks; the thread claims a buffer for each block of a range that
+ * isn't cached yet and fills each contiguous stretch of them with a
+ * single fsop_readblocks call.
+ *
+ * Normally writes are delayed: buffer_modified only marks the buffer
+ * dirty, and the syncer thread writes it back once it has been dirty
+ * for a while, or sooner if too much of the cache is dirty. Eviction
+ * and explicit syncs write dirty buffers as before. Turning write-back
+ * off (buffer_setwriteback) makes buffer_modified write immediately.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <current.h>
+#include <thread.h>
+#include <clock.h>
+#include <vfs.h>
+#include <fs.h>
+#include <buf.h>
+
+struct buf {
+	/* What this buffer holds */
+	struct fs *b_fs;		/* filesystem it belongs to */
+	daddr_t b_block;		/* block number within that fs */
+	size_t b_size;			/* size of the block */
+	void *b_data;			/* the data */
+
+	/* State */
+	unsigned b_refcount;		/* pins: the holder plus waiters */
+	struct thread *b_holder;	/* thread using the buffer, if any */
+	bool b_valid;			/* b_data holds the block contents */
+	bool b_dirty;			/* b_data differs from the disk */
+	time_t b_dirtytime;		/* when it last became dirty (secs) */
+
+	/* Linkage */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list (only when unpinned) */
+	struct buf *b_lrunext;
+};
+
+/* Number of hash chains. Consecutive blocks land on consecutive chains. */
+#define BUFFER_HASHSIZE	1024
+
+static struct lock *buffer_lock;	/* protects everything below */
+static struct cv *buffer_cv;		/* for waiting on held buffers */
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf buffer_lru;		/* LRU bookends; next is oldest */
+static unsigned buffer_count;		/* buffers in existence */
+static unsigned buffer_max;		/* how many we'd like to have */
+static unsigned buffer_ndirty;		/* how many are dirty */
+static bool buffer_writeback;		/* delay writes for the syncer */
+
+/*
+ * Syncer policy. Dirty buffers are written once they're BUFFER_AGE
+ * seconds old; if more than BUFFER_HIWAT percent of the cache is
+ * dirty, the oldest ones are written regardless until it's down to
+ * BUFFER_LOWAT percent. Every BUFFER_SYNC_INTERVAL seconds the syncer
+ * also does a full vfs_sync so inodes and other in-memory metadata
+ * get out too.
+ */
+#define BUFFER_AGE		5
+#define BUFFER_HIWAT		50
+#define BUFFER_LOWAT		25
+#define BUFFER_SYNC_INTERVAL	30
+
+/*
+ * Readahead queue, drained by buffer_readahead_thread. Each request is
+ * a range of up to BUFFER_RA_MAXRUN consecutive blocks, which the
+ * thread reads with one device request where it can.
+ */
+#define BUFFER_RA_QUEUE	64
+#define BUFFER_RA_MAXRUN	32
+
+static struct {
+	struct fs *fs;
+	daddr_t block;
+	unsigned nblocks;
+	size_t size;
+} buffer_raq[BUFFER_RA_QUEUE];
+static unsigned buffer_raq_head;	/* next request to do */
+static unsigned buffer_raq_count;	/* number of requests queued */
+static struct fs *buffer_ra_fs;		/* fs of request in progress */
+static struct cv *buffer_ra_cv;		/* for the readahead thread */
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list
+
+static
+unsigned
+buffer_hashfunc(struct fs *fs, daddr_t block)
+{
+	return (((uintptr_t)fs >> 4) + block) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_hash_find(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfunc(fs, block)];
+	     b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_fs == fs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hash_add(struct buf *b)
+{
+	unsigned ix = buffer_hashfunc(b->b_fs, b->b_block);
+
+	b->b_hashnext = buffer_hash[ix];
+	buffer_hash[ix] = b;
+}
+
+static
+void
+buffer_hash_remove(struct buf *b)
+{
+	struct buf **bp;
+
+	bp = &buffer_hash[buffer_hashfunc(b->b_fs, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+/*
+ * Put a buffer on the LRU list; at the young end normally, or at the
+ * old end if OLDEST is set (so it's the next thing to be recycled).
+ */
+static
+void
+buffer_lru_add(struct buf *b, bool oldest)
+{
+	struct buf *prev, *next;
+
+	KASSERT(b->b_lruprev == NULL && b->b_lrunext == NULL);
+	if (oldest) {
+		prev = &buffer_lru;
+		next = buffer_lru.b_lrunext;
+	}
+	else {
+		prev = buffer_lru.b_lruprev;
+		next = &buffer_lru;
+	}
+	b->b_lruprev = prev;
+	b->b_lrunext = next;
+	prev->b_lrunext = b;
+	next->b_lruprev = b;
+}
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	KASSERT(b->b_lruprev != NULL && b->b_lrunext != NULL);
+	b->b_lruprev->b_lrunext = b->b_lrunext;
+	b->b_lrunext->b_lruprev = b->b_lruprev;
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Buffer objects
+
+/*
+ * Current time in seconds, for aging dirty buffers.
+ */
+static
+time_t
+buffer_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return ts.tv_sec;
+}
+
+static
+struct buf *
+buffer_create(size_t size)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(size);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_fs = NULL;
+	b->b_block = 0;
+	b->b_size = size;
+	b->b_refcount = 0;
+	b->b_holder = NULL;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_dirtytime = 0;
+	b->b_hashnext = NULL;
+	b->b_lruprev = b->b_lrunext = NULL;
+
+	buffer_count++;
+	return b;
+}
+
+static
+void
+buffer_destroy(struct buf *b)
+{
+	KASSERT(b->b_refcount == 0);
+	KASSERT(!b->b_dirty);
+	KASSERT(b->b_lruprev == NULL && b->b_lrunext == NULL);
+	kfree(b->b_data);
+	kfree(b);
+	KASSERT(buffer_count > 0);
+	buffer_count--;
+}
+
+/*
+ * Pin a buffer and wait until we can hold it. Call with buffer_lock
+ * held; it may be released and reacquired while waiting.
+ */
+static
+void
+buffer_pin(struct buf *b)
+{
+	KASSERT(b->b_holder != curthread);
+	if (b->b_refcount == 0 && b->b_lrunext != NULL) {
+		/* Unpinned and cached; a brand new buffer isn't listed */
+		buffer_lru_remove(b);
+	}
+	b->b_refcount++;
+	while (b->b_holder != NULL) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	b->b_holder = curthread;
+}
+
+/*
+ * Undo buffer_pin. If nobody else wants the buffer, it goes back on
+ * the LRU list, or away entirely if it doesn't hold anything useful.
+ */
+static
+void
+buffer_unpin(struct buf *b, bool oldest)
+{
+	KASSERT(b->b_holder == curthread);
+	KASSERT(b->b_refcount > 0);
+
+	b->b_holder = NULL;
+	b->b_refcount--;
+	if (b->b_refcount > 0) {
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+	else if (!b->b_valid) {
+		buffer_hash_remove(b);
+		buffer_destroy(b);
+	}
+	else {
+		buffer_lru_add(b, oldest);
+	}
+}
+
+/*
+ * Write out a buffer we hold. Call with buffer_lock held; it is
+ * released during the I/O.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	int result;
+
+	KASSERT(b->b_holder == curthread);
+	KASSERT(b->b_dirty);
+
+	lock_release(buffer_lock);
+	result = b->b_fs->fs_ops->fsop_writeblock(b->b_fs, b->b_block,
+						  b->b_data, b->b_size);
+	lock_acquire(buffer_lock);
+
+	if (result == 0) {
+		b->b_dirty = false;
+		KASSERT(buffer_ndirty > 0);
+		buffer_ndirty--;
+	}
+	return result;
+}
+
+/*
+ * Get rid of clean unpinned buffers, oldest first, until we're no
+ * bigger than we're supposed to be.
+ */
+static
+void
+buffer_trim(void)
+{
+	struct buf *b, *next;
+
+	for (b = buffer_lru.b_lrunext;
+	     b != &buffer_lru && buffer_count > buffer_max;
+	     b = next) {
+		next = b->b_lrunext;
+		if (!b->b_dirty) {
+			buffer_lru_remove(b);
+			buffer_hash_remove(b);
+			buffer_destroy(b);
+		}
+	}
+}
+
+/*
+ * Come up with an unattached buffer of size SIZE, recycling the least
+ * recently used one if the cache is full. Call with buffer_lock held;
+ * it may be released and reacquired to write back a dirty buffer.
+ *
+ * If every buffer is pinned (or the ones that aren't won't write
+ * back), we go over the limit rather than wait; buffer_trim shrinks
+ * the cache back down later. Buffers the filesystem won't let go of
+ * yet (EAGAIN) go to the young end of the list and we keep looking.
+ */
+static
+struct buf *
+buffer_obtain(size_t size)
+{
+	struct buf *b;
+	unsigned skipped = 0;
+	int result;
+
+	while (buffer_count >= buffer_max) {
+		b = buffer_lru.b_lrunext;
+		if (b == &buffer_lru) {
+			break;
+		}
+
+		if (b->b_dirty) {
+			buffer_pin(b);
+			result = buffer_writeout(b);
+			buffer_unpin(b, result == 0);
+			if (result == EAGAIN) {
+				if (++skipped > buffer_count) {
+					break;
+				}
+				continue;
+			}
+			if (result) {
+				kprintf("buffer cache: block %u: write error "
+					"%s\n", b->b_block, strerror(result));
+				break;
+			}
+			continue;
+		}
+
+		buffer_lru_remove(b);
+		buffer_hash_remove(b);
+		if (b->b_size == size) {
+			b->b_valid = false;
+			return b;
+		}
+		buffer_destroy(b);
+	}
+
+	return buffer_create(size);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Get a held buffer for BLOCK of FS. It may or may not be valid.
+ */
+int
+buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+{
+	struct buf *b, *newb;
+
+	KASSERT(fs->fs_ops->fsop_readblock != NULL);
+	KASSERT(fs->fs_ops->fsop_writeblock != NULL);
+
+	lock_acquire(buffer_lock);
+
+	b = buffer_hash_find(fs, block);
+	if (b == NULL) {
+		newb = buffer_obtain(size);
+		if (newb == NULL) {
+			lock_release(buffer_lock);
+			return ENOMEM;
+		}
+
+		/* Someone may have loaded it while buffer_obtain slept. */
+		b = buffer_hash_find(fs, block);
+		if (b == NULL) {
+			b = newb;
+			b->b_fs = fs;
+			b->b_block = block;
+			b->b_valid = false;
+			b->b_dirty = false;
+			buffer_hash_add(b);
+		}
+		else {
+			buffer_destroy(newb);
+		}
+	}
+	KASSERT(b->b_size == size);
+
+	buffer_pin(b);
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get a held buffer for BLOCK of FS, reading it in if necessary.
+ */
+int
+buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_get(fs, block, size, &b);
+	if (result) {
+		return result;
+	}
+
+	if (!b->b_valid) {
+		result = fs->fs_ops->fsop_readblock(fs, block, b->b_data, size);
+		if (result) {
+			buffer_release(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Let go of a buffer.
+ */
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	buffer_unpin(b, false);
+	if (buffer_count > buffer_max) {
+		buffer_trim();
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Check if BLOCK of FS is in the cache (or on its way in). The answer
+ * may be out of date by the time the caller looks at it, so it's only
+ * good for deciding how to do something, not whether it's safe to.
+ */
+bool
+buffer_is_cached(struct fs *fs, daddr_t block)
+{
+	bool ret;
+
+	lock_acquire(buffer_lock);
+	ret = buffer_hash_find(fs, block) != NULL;
+	lock_release(buffer_lock);
+	return ret;
+}
+
+/*
+ * Check if BLOCK of FS is cached and dirty. Like buffer_is_cached this
+ * is only a snapshot, unless the caller has the block locked against
+ * being modified (by holding the file it belongs to, say).
+ */
+bool
+buffer_is_dirty(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+	bool ret;
+
+	lock_acquire(buffer_lock);
+	b = buffer_hash_find(fs, block);
+	ret = b != NULL && b->b_dirty;
+	lock_release(buffer_lock);
+	return ret;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	return b->b_data;
+}
+
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+
+	lock_acquire(buffer_lock);
+	if (!b->b_dirty) {
+		b->b_dirty = true;
+		b->b_dirtytime = buffer_now();
+		buffer_ndirty++;
+	}
+	b->b_valid = true;
+	lock_release(buffer_lock);
+}
+
+/*
+ * Note that a held buffer has been modified. In write-back mode that's
+ * all; otherwise write it out now.
+ */
+int
+buffer_modified(struct buf *b)
+{
+	buffer_mark_dirty(b);
+	if (!buffer_writeback) {
+		return buffer_sync(b);
+	}
+	return 0;
+}
+
+/*
+ * Write back a buffer we hold, if it needs it.
+ */
+int
+buffer_sync(struct buf *b)
+{
+	int result = 0;
+
+	KASSERT(b->b_holder == curthread);
+
+	lock_acquire(buffer_lock);
+	if (b->b_dirty) {
+		result = buffer_writeout(b);
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Write back BLOCK of FS if it's cached and dirty. Unlike buffer_read,
+ * this never reads anything in.
+ */
+int
+buffer_flush(struct fs *fs, daddr_t block, size_t size)
+{
+	struct buf *b;
+	int result = 0;
+
+	lock_acquire(buffer_lock);
+	b = buffer_hash_find(fs, block);
+	if (b != NULL && b->b_dirty) {
+		KASSERT(b->b_size == size);
+		buffer_pin(b);
+		if (b->b_dirty) {
+			result = buffer_writeout(b);
+		}
+		buffer_unpin(b, false);
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Write back every dirty buffer belonging to FS, or to anything if FS
+ * is NULL. Call with buffer_lock held.
+ */
+static
+int
+buffer_sync_matching(struct fs *fs)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+	 again:
+		for (b = buffer_hash[i]; b != NULL; b = b->b_hashnext) {
+			if ((fs != NULL && b->b_fs != fs) || !b->b_dirty) {
+				continue;
+			}
+			buffer_pin(b);
+			result = 0;
+			if (b->b_dirty) {
+				result = buffer_writeout(b);
+			}
+			buffer_unpin(b, false);
+			if (result == EAGAIN) {
+				/* Held back by the filesystem; skip it */
+				continue;
+			}
+			if (result) {
+				return result;
+			}
+			/* The chain may have changed while we slept. */
+			goto again;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write back every dirty buffer belonging to FS.
+ */
+int
+buffer_sync_fs(struct fs *fs)
+{
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_sync_matching(fs);
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Forget about BLOCK of FS without writing it, because the block is
+ * no longer in use. If someone else has the buffer (e.g. the
+ * readahead thread) wait for them first, so they can't mark it valid
+ * again behind our back. If others are waiting for it, it goes away
+ * when they're done with it.
+ */
+void
+buffer_drop(struct fs *fs, daddr_t block, size_t size)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	b = buffer_hash_find(fs, block);
+	if (b != NULL) {
+		KASSERT(b->b_size == size);
+		buffer_pin(b);
+		if (b->b_dirty) {
+			b->b_dirty = false;
+			buffer_ndirty--;
+		}
+		b->b_valid = false;
+		buffer_unpin(b, true);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Remove queued readahead of FS (any of it if NBLOCKS is 0, otherwise
+ * just blocks BLOCK through BLOCK+NBLOCKS-1). A range that overlaps
+ * is trimmed to its part before the cancelled blocks, or if there
+ * isn't one, its part after. (Readahead is only a hint; losing the
+ * tail of a range split down the middle costs nothing but a later
+ * cache miss.) Call with buffer_lock held.
+ */
+static
+void
+buffer_raq_remove(struct fs *fs, daddr_t block, unsigned nblocks)
+{
+	unsigned i, j, n;
+	daddr_t rstart, rend, end;
+
+	end = block + nblocks;
+	n = buffer_raq_count;
+	buffer_raq_count = 0;
+	for (i=0; i<n; i++) {
+		j = (buffer_raq_head + i) % BUFFER_RA_QUEUE;
+		if (buffer_raq[j].fs == fs) {
+			if (nblocks == 0) {
+				continue;
+			}
+			rstart = buffer_raq[j].block;
+			rend = rstart + buffer_raq[j].nblocks;
+			if (rstart < end && block < rend) {
+				if (rstart < block) {
+					rend = block;
+				}
+				else if (end < rend) {
+					rstart = end;
+				}
+				else {
+					continue;
+				}
+				buffer_raq[j].block = rstart;
+				buffer_raq[j].nblocks = rend - rstart;
+			}
+		}
+		buffer_raq[(buffer_raq_head + buffer_raq_count++)
+			  % BUFFER_RA_QUEUE] = buffer_raq[j];
+	}
+}
+
+/*
+ * Throw away all buffers belonging to FS. It should have been synced
+ * first and nothing but readahead and the syncer should be using it.
+ * A buffer can still be dirty if writing it back failed; we try once
+ * more, and if that fails too, give up and return the error, leaving
+ * the rest of the buffers where they are.
+ */
+int
+buffer_drop_fs(struct fs *fs)
+{
+	struct buf *b, *next;
+	unsigned i;
+	int result;
+
+	lock_acquire(buffer_lock);
+
+	/* Cancel queued readahead and wait out any in progress. */
+	buffer_raq_remove(fs, 0, 0);
+	while (buffer_ra_fs == fs) {
+		cv_wait(buffer_ra_cv, buffer_lock);
+	}
+
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+	 again:
+		for (b = buffer_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_fs != fs) {
+				continue;
+			}
+			if (b->b_refcount > 0 || b->b_dirty) {
+				/*
+				 * The syncer has it, or it didn't get
+				 * written; wait, write it if need be, and
+				 * start over.
+				 */
+				buffer_pin(b);
+				if (b->b_dirty) {
+					result = buffer_writeout(b);
+					if (result) {
+						buffer_unpin(b, false);
+						lock_release(buffer_lock);
+						return result;
+					}
+				}
+				b->b_valid = false;
+				buffer_unpin(b, true);
+				goto again;
+			}
+			buffer_lru_remove(b);
+			buffer_hash_remove(b);
+			buffer_destroy(b);
+		}
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+/*
+ * Ask for NBLOCKS blocks of FS starting at BLOCK to be read into the
+ * cache in the background. This is only a hint: blocks that are
+ * already cached are skipped, and if the queue is full, nothing
+ * happens. A range that continues the last one queued is merged into
+ * it, so callers asking a block at a time still get big reads.
+ */
+void
+buffer_readahead(struct fs *fs, daddr_t block, unsigned nblocks, size_t size)
+{
+	unsigned ix, n;
+
+	lock_acquire(buffer_lock);
+	while (nblocks > 0) {
+		if (buffer_raq_count > 0) {
+			ix = (buffer_raq_head + buffer_raq_count - 1)
+				% BUFFER_RA_QUEUE;
+			if (buffer_raq[ix].fs == fs &&
+			    buffer_raq[ix].size == size &&
+			    buffer_raq[ix].block + buffer_raq[ix].nblocks
+			    == block &&
+			    buffer_raq[ix].nblocks < BUFFER_RA_MAXRUN) {
+				n = BUFFER_RA_MAXRUN - buffer_raq[ix].nblocks;
+				if (n > nblocks) {
+					n = nblocks;
+				}
+				buffer_raq[ix].nblocks += n;
+				block += n;
+				nblocks -= n;
+				continue;
+			}
+		}
+		if (buffer_raq_count >= BUFFER_RA_QUEUE) {
+			break;
+		}
+		n = nblocks < BUFFER_RA_MAXRUN ? nblocks : BUFFER_RA_MAXRUN;
+		ix = (buffer_raq_head + buffer_raq_count) % BUFFER_RA_QUEUE;
+		buffer_raq[ix].fs = fs;
+		buffer_raq[ix].block = block;
+		buffer_raq[ix].nblocks = n;
+		buffer_raq[ix].size = size;
+		buffer_raq_count++;
+		block += n;
+		nblocks -= n;
+	}
+	cv_broadcast(buffer_ra_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Forget any queued readahead of NBLOCKS blocks of FS starting at
+ * BLOCK, because the caller has read them itself (without going
+ * through the cache) and reading them again would be wasted I/O.
+ */
+void
+buffer_readahead_cancel(struct fs *fs, daddr_t block, unsigned nblocks)
+{
+	KASSERT(nblocks > 0);
+
+	lock_acquire(buffer_lock);
+	buffer_raq_remove(fs, block, nblocks);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Fill the N buffers in BATCH, which the readahead thread holds and
+ * which are for consecutive blocks, with one request if the
+ * filesystem can do that. Buffers that get filled are marked valid;
+ * all of them are then let go, and the ones that didn't get filled
+ * go away (or are left to whoever is waiting for them to read for
+ * themselves). Call with buffer_lock held; it is released for the I/O.
+ */
+static
+void
+buffer_readahead_fill(struct fs *fs, struct buf **batch, unsigned n)
+{
+	struct iovec iov[BUFFER_RA_MAXRUN];
+	unsigned i;
+	int result = 0;
+
+	if (n == 0) {
+		return;
+	}
+
+	lock_release(buffer_lock);
+	if (n > 1 && fs->fs_ops->fsop_readblocks != NULL) {
+		for (i=0; i<n; i++) {
+			iov[i].iov_kbase = batch[i]->b_data;
+			iov[i].iov_len = batch[i]->b_size;
+		}
+		result = fs->fs_ops->fsop_readblocks(fs, batch[0]->b_block,
+						     iov, n,
+						     batch[0]->b_size);
+	}
+	else {
+		for (i=0; i<n && result == 0; i++) {
+			result = fs->fs_ops->fsop_readblock(fs,
+				batch[i]->b_block, batch[i]->b_data,
+				batch[i]->b_size);
+			if (result == 0) {
+				batch[i]->b_valid = true;
+			}
+		}
+	}
+	lock_acquire(buffer_lock);
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			batch[i]->b_valid = true;
+		}
+		buffer_unpin(batch[i], false);
+	}
+}
+
+/*
+ * Readahead thread. Takes ranges off the queue, claims a buffer for
+ * each block that isn't cached (which makes anyone else who wants the
+ * block wait for us), and reads each contiguous stretch of claimed
+ * blocks in one go.
+ */
+static
+void
+buffer_readahead_thread(void *unused1, unsigned long unused2)
+{
+	struct buf *batch[BUFFER_RA_MAXRUN];
+	struct fs *fs;
+	daddr_t block, end;
+	size_t size;
+	struct buf *b;
+	unsigned n;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_raq_count == 0) {
+			cv_wait(buffer_ra_cv, buffer_lock);
+		}
+		fs = buffer_raq[buffer_raq_head].fs;
+		block = buffer_raq[buffer_raq_head].block;
+		end = block + buffer_raq[buffer_raq_head].nblocks;
+		size = buffer_raq[buffer_raq_head].size;
+		buffer_raq_head = (buffer_raq_head + 1) % BUFFER_RA_QUEUE;
+		buffer_raq_count--;
+
+		/* Keep buffer_drop_fs from pulling FS out from under us */
+		buffer_ra_fs = fs;
+
+		n = 0;
+		for (; block < end; block++) {
+			if (buffer_hash_find(fs, block) != NULL) {
+				/* Already here (or on its way); read what
+				   we have so far */
+				buffer_readahead_fill(fs, batch, n);
+				n = 0;
+				continue;
+			}
+			b = buffer_obtain(size);
+			if (b == NULL) {
+				break;
+			}
+			/* Someone may have loaded it while we slept. */
+			if (buffer_hash_find(fs, block) != NULL) {
+				buffer_destroy(b);
+				buffer_readahead_fill(fs, batch, n);
+				n = 0;
+				continue;
+			}
+			b->b_fs = fs;
+			b->b_block = block;
+			b->b_valid = false;
+			b->b_dirty = false;
+			buffer_hash_add(b);
+			buffer_pin(b);
+			batch[n++] = b;
+		}
+		buffer_readahead_fill(fs, batch, n);
+
+		buffer_ra_fs = NULL;
+		cv_broadcast(buffer_ra_cv, buffer_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Syncer
+
+/*
+ * Write back dirty buffers that have been dirty too long, and if too
+ * much of the cache is dirty, the least recently used dirty ones. Only
+ * unpinned buffers are considered; anything pinned is in use and will
+ * come back around. Call with buffer_lock held.
+ */
+static
+void
+buffer_syncer_pass(time_t now)
+{
+	struct buf *b;
+	bool flushing;
+	unsigned skipped = 0;
+	int result;
+
+	flushing = buffer_ndirty * 100 > buffer_max * BUFFER_HIWAT;
+ again:
+	for (b = buffer_lru.b_lrunext; b != &buffer_lru; b = b->b_lrunext) {
+		if (!b->b_dirty) {
+			continue;
+		}
+		if (buffer_ndirty * 100 <= buffer_max * BUFFER_LOWAT) {
+			flushing = false;
+		}
+		if (!flushing && now - b->b_dirtytime < BUFFER_AGE) {
+			continue;
+		}
+
+		buffer_pin(b);
+		result = 0;
+		if (b->b_dirty) {
+			result = buffer_writeout(b);
+		}
+		buffer_unpin(b, false);
+		if (result == EAGAIN) {
+			/* Held back by the filesystem; come back later */
+			b->b_dirtytime = now;
+			if (++skipped > buffer_count) {
+				return;
+			}
+			goto again;
+		}
+		if (result) {
+			kprintf("buffer cache: block %u: write error %s\n",
+				b->b_block, strerror(result));
+			return;
+		}
+		/* The list may have changed while we slept. */
+		goto again;
+	}
+}
+
+/*
+ * Syncer thread. Wakes up once a second to write back old dirty
+ * buffers, and does a full sync every so often.
+ */
+static
+void
+buffer_syncer_thread(void *unused1, unsigned long unused2)
+{
+	time_t now, lastsync;
+	bool writeback;
+
+	(void)unused1;
+	(void)unused2;
+
+	lastsync = buffer_now();
+	while (1) {
+		clocksleep(1);
+		now = buffer_now();
+
+		lock_acquire(buffer_lock);
+		writeback = buffer_writeback;
+		if (writeback) {
+			buffer_syncer_pass(now);
+		}
+		lock_release(buffer_lock);
+
+		if (writeback && now - lastsync >= BUFFER_SYNC_INTERVAL) {
+			vfs_sync();
+			lastsync = now;
+		}
+	}
+}
+
+/*
+ * Turn delayed writes on or off. When turning them off, write back
+ * everything that was being delayed.
+ */
+int
+buffer_setwriteback(bool on)
+{
+	int result = 0;
+
+	lock_acquire(buffer_lock);
+	buffer_writeback = on;
+	if (!on) {
+		result = buffer_sync_matching(NULL);
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+/*
+ * Change the size of the cache.
+ */
+void
+buffer_setmax(unsigned max)
+{
+	lock_acquire(buffer_lock);
+	buffer_max = max;
+	buffer_trim();
+	lock_release(buffer_lock);
+}
+
+/*
+ * Set up the cache.
+ */
+void
+buffer_bootstrap(void)
+{
+	unsigned i;
+	int result;
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buffer_ra_cv = cv_create("readahead");
+	if (buffer_ra_cv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		buffer_hash[i] = NULL;
+	}
+	buffer_lru.b_lruprev = buffer_lru.b_lrunext = &buffer_lru;
+
+	buffer_count = 0;
+	buffer_max = BUFFER_DEFAULT_MAX;
+	buffer_ndirty = 0;
+	buffer_writeback = true;
+
+	buffer_raq_head = 0;
+	buffer_raq_count = 0;
+	buffer_ra_fs = NULL;
+
+	result = thread_fork("readahead", NULL, buffer_readahead_thread,
+			     NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("syncer", NULL, buffer_syncer_thread, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
@@ -112,6 +112,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_dcache_bootstrap();
+
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -654,6 +656,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* drop the name cache's references to it */
+	vfs_dcache_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -677,6 +682,39 @@ vfs_unmount(const char *devname)
 	return result;
 }
 
+/*
+ * Get the space usage of the filesystem mounted on a device.
+ */
+int
+vfs_statfs(const char *devname, struct fs_stats *st)
+{
+	struct knowndev *kd;
+	int result;
+
+	vfs_biglock_acquire();
+
+	result = findmount(devname, &kd);
+	if (result) {
+		goto fail;
+	}
+
+	if (kd->kd_fs == NULL || kd->kd_fs == SWAP_FS) {
+		result = EINVAL;
+		goto fail;
+	}
+
+	if (kd->kd_fs->fs_ops->fsop_statfs == NULL) {
+		result = ENOSYS;
+		goto fail;
+	}
+
+	result = FSOP_STATFS(kd->kd_fs, st);
+
+ fail:
+	vfs_biglock_release();
+	return result;
+}
+
 /*
  * Detach swap. Like unmount.
  *
@@ -745,6 +783,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_dcache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
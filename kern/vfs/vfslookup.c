@@ -34,6 +34,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <limits.h>
+#include <stat.h>
 #include <lib.h>
 #include <synch.h>
 #include <vfs.h>
@@ -120,6 +121,374 @@ vfs_clearbootfs(void)
 }
 
 
+////////////////////////////////////////////////////////////
+// Name cache
+
+/*
+ * Cache of VOP_LOOKUP results, keyed on (directory vnode, name).
+ * Positive entries hold a reference to the vnode found; negative
+ * entries (dc_vn == NULL) remember that the name didn't exist. Every
+ * entry also holds a reference to its directory, so the key can't be
+ * recycled out from under us.
+ *
+ * Entries are single path components: vfs_lookup and vfs_lookparent
+ * split paths up and look each component up in turn, so every
+ * directory along the way gets cached. "." and ".." aren't cached,
+ * since the latter changes if a directory is moved. Names longer than
+ * DCACHE_NAMELEN-1 aren't cached either, to keep the entries small.
+ *
+ * The VFS operations that change directories purge the affected names
+ * once the filesystem has done its part. Because a lookup might be in
+ * progress in the filesystem while that happens, each purge bumps
+ * dcache_gen, and a lookup only enters its result if the generation
+ * is the same as when it started.
+ *
+ * dcache_lock protects everything below. We never call into the
+ * filesystem with it held; references dropped while evicting are
+ * collected and released afterwards.
+ */
+
+#define DCACHE_NAMELEN	32	/* longest cached name, plus one */
+#define DCACHE_HASHSIZE	128	/* number of hash chains */
+#define DCACHE_MAX	256	/* number of entries kept */
+
+struct dcentry {
+	struct vnode *dc_dir;		/* directory looked in */
+	char dc_name[DCACHE_NAMELEN];	/* name looked up */
+	struct vnode *dc_vn;		/* result; NULL if not found */
+	struct dcentry *dc_hashnext;	/* hash chain */
+	struct dcentry *dc_lruprev;	/* LRU list */
+	struct dcentry *dc_lrunext;
+};
+
+static struct lock *dcache_lock;
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry dcache_lru;	/* LRU bookends; next is oldest */
+static unsigned dcache_count;		/* entries in the cache */
+static unsigned dcache_gen;		/* bumped by every purge */
+
+static
+unsigned
+dcache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+/*
+ * Check if a name is one we're willing to cache.
+ */
+static
+bool
+dcache_cacheable(struct vnode *dir, const char *name)
+{
+	if (dir->vn_fs == NULL) {
+		/* device; nothing to gain */
+		return false;
+	}
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return false;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return false;
+	}
+	return true;
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+
+	KASSERT(lock_do_i_hold(dcache_lock));
+
+	for (dc = dcache_hash[dcache_hashfunc(dir, name)];
+	     dc != NULL;
+	     dc = dc->dc_hashnext) {
+		if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Put an entry at the recently-used end of the LRU list.
+ */
+static
+void
+dcache_lru_add(struct dcentry *dc)
+{
+	dc->dc_lrunext = &dcache_lru;
+	dc->dc_lruprev = dcache_lru.dc_lruprev;
+	dc->dc_lruprev->dc_lrunext = dc;
+	dcache_lru.dc_lruprev = dc;
+}
+
+static
+void
+dcache_lru_remove(struct dcentry *dc)
+{
+	dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	dc->dc_lruprev = dc->dc_lrunext = NULL;
+}
+
+/*
+ * Take an entry out of the cache. It goes on the list at *FREELIST
+ * (threaded through dc_hashnext) for dcache_release.
+ */
+static
+void
+dcache_remove(struct dcentry *dc, struct dcentry **freelist)
+{
+	struct dcentry **dcp;
+
+	KASSERT(lock_do_i_hold(dcache_lock));
+
+	dcp = &dcache_hash[dcache_hashfunc(dc->dc_dir, dc->dc_name)];
+	while (*dcp != dc) {
+		KASSERT(*dcp != NULL);
+		dcp = &(*dcp)->dc_hashnext;
+	}
+	*dcp = dc->dc_hashnext;
+	dcache_lru_remove(dc);
+	KASSERT(dcache_count > 0);
+	dcache_count--;
+
+	dc->dc_hashnext = *freelist;
+	*freelist = dc;
+}
+
+/*
+ * Drop the references held by removed entries and free them. Call
+ * without dcache_lock, as this may reclaim vnodes.
+ */
+static
+void
+dcache_release(struct dcentry *freelist)
+{
+	struct dcentry *dc;
+
+	while ((dc = freelist) != NULL) {
+		freelist = dc->dc_hashnext;
+		if (dc->dc_vn != NULL) {
+			VOP_DECREF(dc->dc_vn);
+		}
+		VOP_DECREF(dc->dc_dir);
+		kfree(dc);
+	}
+}
+
+/*
+ * Look NAME up in DIR in the cache. On a hit, returns true and hands
+ * back the vnode (with a reference) or NULL if the name is known not
+ * to exist. On a miss, returns false and hands back the generation
+ * to pass to dcache_enter.
+ */
+static
+bool
+dcache_get(struct vnode *dir, const char *name, struct vnode **ret,
+	   unsigned *gen)
+{
+	struct dcentry *dc;
+
+	lock_acquire(dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		*gen = dcache_gen;
+		lock_release(dcache_lock);
+		return false;
+	}
+	dcache_lru_remove(dc);
+	dcache_lru_add(dc);
+	if (dc->dc_vn != NULL) {
+		VOP_INCREF(dc->dc_vn);
+	}
+	*ret = dc->dc_vn;
+	lock_release(dcache_lock);
+	return true;
+}
+
+/*
+ * Enter the result of a lookup, unless something was purged since
+ * GEN was handed out (in which case it may be stale). VN is NULL for
+ * a negative entry. If we're out of memory, just don't bother.
+ */
+static
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     unsigned gen)
+{
+	struct dcentry *dc, *freelist = NULL;
+	unsigned ix;
+
+	dc = kmalloc(sizeof(*dc));
+	if (dc == NULL) {
+		return;
+	}
+
+	lock_acquire(dcache_lock);
+	if (gen != dcache_gen || dcache_find(dir, name) != NULL) {
+		lock_release(dcache_lock);
+		kfree(dc);
+		return;
+	}
+
+	dc->dc_dir = dir;
+	VOP_INCREF(dir);
+	strcpy(dc->dc_name, name);
+	dc->dc_vn = vn;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	ix = dcache_hashfunc(dir, name);
+	dc->dc_hashnext = dcache_hash[ix];
+	dcache_hash[ix] = dc;
+	dcache_lru_add(dc);
+	dcache_count++;
+
+	while (dcache_count > DCACHE_MAX) {
+		dcache_remove(dcache_lru.dc_lrunext, &freelist);
+	}
+	lock_release(dcache_lock);
+
+	dcache_release(freelist);
+}
+
+/*
+ * Forget whatever is cached about NAME in DIR. Called by the
+ * operations in vfspath.c after they change a directory.
+ */
+void
+vfs_dcache_purge(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc, *freelist = NULL;
+
+	lock_acquire(dcache_lock);
+	dcache_gen++;
+	dc = dcache_find(dir, name);
+	if (dc != NULL) {
+		dcache_remove(dc, &freelist);
+	}
+	lock_release(dcache_lock);
+
+	dcache_release(freelist);
+}
+
+/*
+ * Like vfs_dcache_purge, but NAME is (or was) a directory; also
+ * forget the names cached in it, so their references get dropped.
+ */
+void
+vfs_dcache_purgedir(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc, *next, *freelist = NULL;
+	struct vnode *subdir = NULL;
+	unsigned i;
+
+	lock_acquire(dcache_lock);
+	dcache_gen++;
+	dc = dcache_find(dir, name);
+	if (dc != NULL) {
+		subdir = dc->dc_vn;
+		dcache_remove(dc, &freelist);
+	}
+	if (subdir != NULL) {
+		for (i=0; i<DCACHE_HASHSIZE; i++) {
+			for (dc = dcache_hash[i]; dc != NULL; dc = next) {
+				next = dc->dc_hashnext;
+				if (dc->dc_dir == subdir) {
+					dcache_remove(dc, &freelist);
+				}
+			}
+		}
+	}
+	lock_release(dcache_lock);
+
+	dcache_release(freelist);
+}
+
+/*
+ * Forget everything cached for a filesystem, so it can be unmounted.
+ */
+void
+vfs_dcache_purgefs(struct fs *fs)
+{
+	struct dcentry *dc, *next, *freelist = NULL;
+	unsigned i;
+
+	lock_acquire(dcache_lock);
+	dcache_gen++;
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		for (dc = dcache_hash[i]; dc != NULL; dc = next) {
+			next = dc->dc_hashnext;
+			if (dc->dc_dir->vn_fs == fs) {
+				dcache_remove(dc, &freelist);
+			}
+		}
+	}
+	lock_release(dcache_lock);
+
+	dcache_release(freelist);
+}
+
+/*
+ * Setup function.
+ */
+void
+vfs_dcache_bootstrap(void)
+{
+	dcache_lock = lock_create("dcache");
+	if (dcache_lock == NULL) {
+		panic("vfs: Could not create name cache lock\n");
+	}
+	dcache_lru.dc_lrunext = dcache_lru.dc_lruprev = &dcache_lru;
+	dcache_count = 0;
+	dcache_gen = 0;
+}
+
+/*
+ * Do a VOP_LOOKUP, going through the cache for names it can hold.
+ */
+static
+int
+dcache_lookup(struct vnode *dir, char *name, struct vnode **ret)
+{
+	struct vnode *vn;
+	unsigned gen;
+	int result;
+
+	if (!dcache_cacheable(dir, name)) {
+		return VOP_LOOKUP(dir, name, ret);
+	}
+
+	if (dcache_get(dir, name, &vn, &gen)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn;
+		return 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, &vn);
+	if (result == 0) {
+		dcache_enter(dir, name, vn, gen);
+		*ret = vn;
+	}
+	else if (result == ENOENT) {
+		dcache_enter(dir, name, NULL, gen);
+	}
+	return result;
+}
+
+
 /*
  * Common code to pull the device name, if any, off the front of a
  * path and choose the vnode to begin the name lookup relative to.
@@ -234,16 +603,92 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Copy the first component of the path at *PATH into NAME (of size
+ * NAMELEN), and advance *PATH past it and any slashes that follow.
+ */
+static
+int
+nextcomponent(char **path, char *name, size_t namelen)
+{
+	size_t len;
+
+	for (len = 0; (*path)[len] != 0 && (*path)[len] != '/'; len++) {
+		/* nothing */
+	}
+	if (len >= namelen) {
+		return ENAMETOOLONG;
+	}
+	memcpy(name, *path, len);
+	name[len] = 0;
+
+	*path += len;
+	while (**path == '/') {
+		(*path)++;
+	}
+	return 0;
+}
+
+/*
+ * Translate PATH relative to STARTVN one component at a time, going
+ * through the name cache for each. If WANTPARENT is set, stop short
+ * of the last component and copy it into LAST (of size LASTLEN)
+ * instead. Returns the vnode reached, with a reference.
+ */
+static
+int
+lookup_walk(struct vnode *startvn, char *path, bool wantparent,
+	    struct vnode **ret, char *last, size_t lastlen)
+{
+	char name[NAME_MAX+1];
+	struct vnode *dir, *vn;
+	int result;
+
+	VOP_INCREF(startvn);
+	dir = startvn;
+
+	while (*path != 0) {
+		result = nextcomponent(&path, name, sizeof(name));
+		if (result) {
+			VOP_DECREF(dir);
+			return result;
+		}
+		if (wantparent && *path == 0) {
+			if (strlen(name)+1 > lastlen) {
+				VOP_DECREF(dir);
+				return ENAMETOOLONG;
+			}
+			strcpy(last, name);
+			break;
+		}
+
+		result = dcache_lookup(dir, name, &vn);
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = vn;
+	}
+
+	*ret = dir;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * The filesystem only ever sees one component at a time: everything
+ * but the last goes through VOP_LOOKUP (and the name cache), and
+ * vfs_lookparent hands the last to VOP_LOOKPARENT on its own.
  */
 
 int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char name[NAME_MAX+1];
 	int result;
 
 	vfs_biglock_acquire();
@@ -263,7 +708,13 @@ vfs_lookparent(char *path, struct vnode **retval,
 		result = EINVAL;
 	}
 	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		result = lookup_walk(startvn, path, true, &dir,
+				     name, sizeof(name));
+		if (result == 0) {
+			result = VOP_LOOKPARENT(dir, name, retval,
+						buf, buflen);
+			VOP_DECREF(dir);
+		}
 	}
 
 	VOP_DECREF(startvn);
@@ -275,7 +726,9 @@ vfs_lookparent(char *path, struct vnode **retval,
 int
 vfs_lookup(char *path, struct vnode **retval)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *vn;
+	mode_t vtype;
+	bool trailingslash;
 	int result;
 
 	vfs_biglock_acquire();
@@ -292,7 +745,21 @@ vfs_lookup(char *path, struct vnode **retval)
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	trailingslash = path[strlen(path)-1] == '/';
+	result = lookup_walk(startvn, path, false, &vn, NULL, 0);
+	if (result == 0 && trailingslash) {
+		/* "name/" has to be a directory */
+		result = VOP_GETTYPE(vn, &vtype);
+		if (result == 0 && vtype != S_IFDIR) {
+			result = ENOTDIR;
+		}
+		if (result) {
+			VOP_DECREF(vn);
+		}
+	}
+	if (result == 0) {
+		*retval = vn;
+	}
 
 	VOP_DECREF(startvn);
 	vfs_biglock_release();
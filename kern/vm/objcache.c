@@ -0,0 +1,158 @@
+/*
+ * Object caches.
+ *
+ * Each cache keeps a singly linked free list of constructed objects,
+ * protected by a spinlock. The link lives in a small header in front
+ * of each object rather than in the object itself, since a free
+ * object has to stay fully constructed. Constructors and destructors
+ * are always called with the spinlock released, as they may sleep.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <objcache.h>
+
+/*
+ * Header in front of every object. Padded to 8 bytes so the object
+ * gets the same alignment kmalloc would give it.
+ */
+union objhdr {
+	union objhdr *oh_next;		/* next on free list */
+	uint64_t oh_align;
+};
+
+struct objcache {
+	char *oc_name;
+	size_t oc_size;			/* client size of an object */
+	unsigned oc_maxfree;		/* free list length limit */
+	int (*oc_ctor)(void *);
+	void (*oc_dtor)(void *);
+
+	struct spinlock oc_lock;	/* protects the fields below */
+	union objhdr *oc_free;		/* free list */
+	unsigned oc_nfree;		/* length of free list */
+	unsigned oc_nout;		/* objects handed out */
+};
+
+#define OBJ_TO_HDR(obj)	((union objhdr *)(obj) - 1)
+#define HDR_TO_OBJ(oh)	((void *)((oh) + 1))
+
+/*
+ * Create a cache.
+ */
+struct objcache *
+objcache_create(const char *name, size_t size, unsigned maxfree,
+		int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct objcache *oc;
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = kstrdup(name);
+	if (oc->oc_name == NULL) {
+		kfree(oc);
+		return NULL;
+	}
+	oc->oc_size = size;
+	oc->oc_maxfree = maxfree;
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+	spinlock_init(&oc->oc_lock);
+	oc->oc_free = NULL;
+	oc->oc_nfree = 0;
+	oc->oc_nout = 0;
+	return oc;
+}
+
+/*
+ * Get an object, from the free list if there is one, otherwise fresh
+ * from kmalloc.
+ */
+void *
+objcache_get(struct objcache *oc)
+{
+	union objhdr *oh;
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+	oh = oc->oc_free;
+	if (oh != NULL) {
+		oc->oc_free = oh->oh_next;
+		oc->oc_nfree--;
+		oc->oc_nout++;
+		spinlock_release(&oc->oc_lock);
+		return HDR_TO_OBJ(oh);
+	}
+	spinlock_release(&oc->oc_lock);
+
+	oh = kmalloc(sizeof(*oh) + oc->oc_size);
+	if (oh == NULL) {
+		return NULL;
+	}
+	obj = HDR_TO_OBJ(oh);
+	if (oc->oc_ctor != NULL && oc->oc_ctor(obj)) {
+		kfree(oh);
+		return NULL;
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	oc->oc_nout++;
+	spinlock_release(&oc->oc_lock);
+	return obj;
+}
+
+/*
+ * Return an object. Keep it if there's room on the free list;
+ * otherwise destroy it.
+ */
+void
+objcache_put(struct objcache *oc, void *obj)
+{
+	union objhdr *oh;
+
+	KASSERT(obj != NULL);
+	oh = OBJ_TO_HDR(obj);
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(oc->oc_nout > 0);
+	oc->oc_nout--;
+	if (oc->oc_nfree < oc->oc_maxfree) {
+		oh->oh_next = oc->oc_free;
+		oc->oc_free = oh;
+		oc->oc_nfree++;
+		spinlock_release(&oc->oc_lock);
+		return;
+	}
+	spinlock_release(&oc->oc_lock);
+
+	if (oc->oc_dtor != NULL) {
+		oc->oc_dtor(obj);
+	}
+	kfree(oh);
+}
+
+/*
+ * Destroy a cache.
+ */
+void
+objcache_destroy(struct objcache *oc)
+{
+	union objhdr *oh;
+
+	KASSERT(oc->oc_nout == 0);
+
+	while (oc->oc_free != NULL) {
+		oh = oc->oc_free;
+		oc->oc_free = oh->oh_next;
+		if (oc->oc_dtor != NULL) {
+			oc->oc_dtor(HDR_TO_OBJ(oh));
+		}
+		kfree(oh);
+	}
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc->oc_name);
+	kfree(oc);
+}
@@ -73,6 +73,12 @@ static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
 
+/* Inode table layout (packed format; ninodes is 0 otherwise) */
+static uint32_t ninodes, inodemapstart, inodetablestart;
+
+/* Depth of the hashed directory being dumped */
+static uint32_t hashdepth;
+
 ////////////////////////////////////////////////////////////
 // printouts
 
@@ -142,14 +148,50 @@ readsb(void)
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	switch (SWAP32(sb.sb_version)) {
+	    case SFS_VERSION_ORIG:
+		break;
+	    case SFS_VERSION_PACKED:
+		ninodes = SWAP32(sb.sb_ninodes);
+		inodemapstart = SWAP32(sb.sb_inodemapstart);
+		inodetablestart = SWAP32(sb.sb_inodetablestart);
+		break;
+	    default:
+		errx(1, "Unsupported sfs format version %u",
+		     SWAP32(sb.sb_version));
+	}
 	return SWAP32(sb.sb_nblocks);
 }
 
+/*
+ * Read inode INO. In the packed format only the front of the inode is
+ * on disk; the rest reads as zero.
+ */
+static
+void
+readinode(uint32_t ino, struct sfs_dinode *sfi)
+{
+	char buf[SFS_BLOCKSIZE];
+
+	if (ninodes == 0) {
+		diskread(sfi, ino);
+		return;
+	}
+	if (ino >= ninodes) {
+		errx(1, "Inode %u out of range (%u inodes)", ino, ninodes);
+	}
+	diskread(buf, inodetablestart + ino / SFS_INOPB);
+	memset(sfi, 0, sizeof(*sfi));
+	memcpy(sfi, buf + (ino % SFS_INOPB) * SFS_PINODESIZE, SFS_PINODESIZE);
+}
+
 static
 void
 dumpsb(void)
 {
 	struct sfs_superblock sb;
+	struct sfs_jheader jh;
+	char desc[32], val[64];
 	unsigned i;
 
 	diskread(&sb, SFS_SUPER_BLOCK);
@@ -162,7 +204,65 @@ dumpsb(void)
 	dumpvalf("Freemap size", "%u blocks",
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+	dumpvalf("Format version", "%u", SWAP32(sb.sb_version));
+	if (SWAP32(sb.sb_version) == SFS_VERSION_PACKED) {
+		dumpvalf("Inodes", "%u", SWAP32(sb.sb_ninodes));
+		dumpvalf("Inodes per block", "%u", SFS_INOPB);
+		dumpvalf("Inode bitmap", "block %u",
+			 SWAP32(sb.sb_inodemapstart));
+		dumpvalf("Inode bitmap size", "%u blocks",
+			 SFS_INODEMAPBLOCKS(SWAP32(sb.sb_ninodes)));
+		dumpvalf("Inode table", "block %u",
+			 SWAP32(sb.sb_inodetablestart));
+		dumpvalf("Inode table size", "%u blocks",
+			 SFS_INODETABLEBLOCKS(SWAP32(sb.sb_ninodes)));
+	}
 	dumplval("Volume name", sb.sb_volname);
+	if (SWAP32(sb.sb_ngroups) == 0) {
+		dumplval("Allocation groups", "none");
+	}
+	else {
+		dumpvalf("Allocation groups", "%u", SWAP32(sb.sb_ngroups));
+		dumpvalf("Group size", "%u blocks",
+			 SWAP32(sb.sb_groupblocks));
+		if (SWAP32(sb.sb_version) == SFS_VERSION_PACKED) {
+			dumpvalf("Inodes per group", "%u",
+				 SWAP32(sb.sb_groupinodes));
+		}
+	}
+	for (i=0; i<SWAP32(sb.sb_ngroups) && i<SFS_MAXGROUPS; i++) {
+		snprintf(desc, sizeof(desc), "Group %u", i);
+		if (SWAP32(sb.sb_version) == SFS_VERSION_PACKED) {
+			snprintf(val, sizeof(val),
+				 "%u blocks free, %u inodes free",
+				 SWAP32(sb.sb_groupfree[i]),
+				 SWAP32(sb.sb_groupifree[i]));
+		}
+		else {
+			snprintf(val, sizeof(val), "%u blocks free",
+				 SWAP32(sb.sb_groupfree[i]));
+		}
+		dumplval(desc, val);
+	}
+	if (SWAP32(sb.sb_journalblocks) == 0) {
+		dumplval("Journal", "none");
+	}
+	else {
+		dumpvalf("Journal", "block %u", SWAP32(sb.sb_journalstart));
+		dumpvalf("Journal size", "%u blocks",
+			 SWAP32(sb.sb_journalblocks));
+		diskread(&jh, SWAP32(sb.sb_journalstart));
+		if (SWAP32(jh.jh_magic) == SFS_JHEADER_MAGIC) {
+			dumpvalf("Next transaction", "%u",
+				 SWAP32(jh.jh_seq));
+			dumpvalf("Log starts at", "journal block %u",
+				 SWAP32(jh.jh_start));
+		}
+		else {
+			dumpvalf("Journal header", "bad magic 0x%x",
+				 SWAP32(jh.jh_magic));
+		}
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -173,22 +273,24 @@ dumpsb(void)
 	printf("\n");
 }
 
+/*
+ * Dump a bitmap of NBITS things (blocks or inodes) stored in MAPBLOCKS
+ * blocks starting at disk block START.
+ */
 static
 void
-dumpfreemap(uint32_t fsblocks)
+dumpbitmap(const char *thing, uint32_t start, uint32_t mapblocks,
+	   uint32_t nbits)
 {
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
 	uint32_t i, j, k, bn;
 	uint8_t data[SFS_BLOCKSIZE], mask;
 	char tmp[16];
 
-	printf("Free block bitmap\n");
-	printf("-----------------\n");
-	for (i=0; i<freemapblocks; i++) {
-		diskread(data, SFS_FREEMAP_START+i);
-		printf("    Freemap block #%u in disk block %u: blocks %u - %u"
+	for (i=0; i<mapblocks; i++) {
+		diskread(data, start+i);
+		printf("    Bitmap block #%u in disk block %u: %ss %u - %u"
 		       " (0x%x - 0x%x)\n",
-		       i, SFS_FREEMAP_START+i,
+		       i, start+i, thing,
 		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1,
 		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1);
 		for (j=0; j<SFS_BLOCKSIZE; j++) {
@@ -200,7 +302,7 @@ dumpfreemap(uint32_t fsblocks)
 			for (k=0; k<8; k++) {
 				bn = i*SFS_BITSPERBLOCK + j*8 + k;
 				mask = 1U << k;
-				if (bn >= fsblocks) {
+				if (bn >= nbits) {
 					if (data[j] & mask) {
 						putchar('x');
 					}
@@ -230,7 +332,24 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpfreemap(uint32_t fsblocks)
+{
+	printf("Free block bitmap\n");
+	printf("-----------------\n");
+	dumpbitmap("block", SFS_FREEMAP_START, SFS_FREEMAPBLOCKS(fsblocks),
+		   fsblocks);
+
+	if (ninodes > 0) {
+		printf("Inode bitmap\n");
+		printf("------------\n");
+		dumpbitmap("inode", inodemapstart,
+			   SFS_INODEMAPBLOCKS(ninodes), ninodes);
+	}
+}
+
+static
+void
+dumpindirect(uint32_t block, int indirection)
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
@@ -239,7 +358,9 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%s block %u\n",
+	       indirection == 3 ? "Triple indirect" :
+	       indirection == 2 ? "Double indirect" : "Indirect", block);
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +374,22 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+	if (indirection > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), indirection-1);
+		}
+	}
 }
 
+/*
+ * Traverse an index block at level INDIRECTION (1 for an indirect
+ * block, 2 for double indirect, 3 for triple indirect). A missing
+ * index block is treated as if it were all zeros.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    int indirection, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,7 +401,14 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (indirection > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), indirection-1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -291,18 +429,42 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
 
+static
+void
+dumpdirentries(struct sfs_direntry *sds, unsigned nsds)
+{
+	unsigned i;
+
+	for (i=0; i<nsds; i++) {
+		uint32_t ino = SWAP32(sds[i].sfd_ino);
+		if (ino==SFS_NOINO) {
+			printf("        [free entry]\n");
+		}
+		else {
+			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
+			printf("        %u %s\n", ino, sds[i].sfd_name);
+		}
+	}
+}
+
 static
 void
 dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 {
 	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
-	int i;
 
 	(void)fileblock;
 	if (diskblock == 0) {
@@ -312,85 +474,189 @@ dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 	diskread(&sds, diskblock);
 
 	printf("    [block %u]\n", diskblock);
-	for (i=0; i<nsds; i++) {
-		uint32_t ino = SWAP32(sds[i].sfd_ino);
-		if (ino==SFS_NOINO) {
-			printf("        [free entry]\n");
+	dumpdirentries(sds, ARRAYCOUNT(sds));
+}
+
+/*
+ * Hashed directories: block 0 is the header, then comes the bucket
+ * table, then the buckets.
+ */
+static
+void
+dumphashdirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	union {
+		struct sfs_dirheader dh;
+		struct sfs_dirbucket db;
+		uint32_t table[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	} u;
+	uint32_t ix, first;
+
+	if (fileblock == 0) {
+		hashdepth = 0;
+		if (diskblock == 0) {
+			printf("    [header missing]\n");
+			return;
 		}
-		else {
-			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
-			printf("        %u %s\n", ino, sds[i].sfd_name);
+		diskread(&u, diskblock);
+		hashdepth = SWAP32(u.dh.dh_depth);
+		printf("    [header: block %u] magic 0x%x, depth %u\n",
+		       diskblock, SWAP32(u.dh.dh_magic), hashdepth);
+		if (hashdepth > SFS_DIRHASH_MAXDEPTH) {
+			warnx("Warning: bad hash table depth");
+			hashdepth = 0;
+		}
+		return;
+	}
+	if (fileblock < SFS_DIRHASH_FIRSTBUCKET) {
+		/* The bucket table; only dumped with -i */
+		first = (fileblock - 1) * ARRAYCOUNT(u.table);
+		if (!doindirect || first >= (1U << hashdepth)) {
+			return;
+		}
+		if (diskblock == 0) {
+			printf("    [table block %u - missing]\n", fileblock);
+			return;
+		}
+		diskread(&u, diskblock);
+		printf("    [table: block %u]\n", diskblock);
+		for (ix=0; ix<ARRAYCOUNT(u.table) &&
+			     first + ix < (1U << hashdepth); ix++) {
+			if (ix % 8 == 0) {
+				printf("@%-6u", first + ix);
+			}
+			printf(" %6u", SWAP32(u.table[ix]));
+			if (ix % 8 == 7) {
+				printf("\n");
+			}
 		}
+		if (ix % 8 != 0) {
+			printf("\n");
+		}
+		return;
+	}
+	if (diskblock == 0) {
+		printf("    [bucket %u - missing]\n", fileblock);
+		return;
 	}
+	diskread(&u, diskblock);
+	printf("    [bucket %u: block %u] depth %u, next %u\n",
+	       fileblock, diskblock, SWAP32(u.db.db_depth),
+	       SWAP32(u.db.db_next));
+	dumpdirentries(u.db.db_entries, SFS_DIRHASH_PERBUCKET);
 }
 
 static
 void
 dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
 {
+	struct sfs_direntry sds[SFS_INLINE_MAX/sizeof(struct sfs_direntry)];
 	int nentries;
 
 	nentries = SWAP32(sfi->sfi_size) / sizeof(struct sfs_direntry);
 	if (SWAP32(sfi->sfi_size) % sizeof(struct sfs_direntry) != 0) {
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_HASHED) {
+		printf("Directory contents for inode %u: hashed\n", ino);
+		traverse(sfi, dumphashdirblock);
+		return;
+	}
 	printf("Directory contents for inode %u: %d entries\n", ino, nentries);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		if (nentries > (int)ARRAYCOUNT(sds)) {
+			warnx("Warning: inline dir is too large");
+			nentries = ARRAYCOUNT(sds);
+		}
+		memcpy(sds, sfi->sfi_inline, nentries * sizeof(sds[0]));
+		printf("    [inline]\n");
+		dumpdirentries(sds, nentries);
+		return;
+	}
 	traverse(sfi, dumpdirblock);
 }
 
+static
+void
+recursedirentries(struct sfs_direntry *sds, unsigned nsds)
+{
+	unsigned i;
+
+	for (i=0; i<nsds; i++) {
+		uint32_t ino = SWAP32(sds[i].sfd_ino);
+		if (ino==SFS_NOINO) {
+			continue;
+		}
+		sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
+		dumpinode(ino, sds[i].sfd_name);
+	}
+}
+
 static
 void
 recursedirblock(uint32_t fileblock, uint32_t diskblock)
 {
 	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
-	int i;
 
 	(void)fileblock;
 	if (diskblock == 0) {
 		return;
 	}
 	diskread(&sds, diskblock);
+	recursedirentries(sds, ARRAYCOUNT(sds));
+}
 
-	for (i=0; i<nsds; i++) {
-		uint32_t ino = SWAP32(sds[i].sfd_ino);
-		if (ino==SFS_NOINO) {
-			continue;
-		}
-		sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
-		dumpinode(ino, sds[i].sfd_name);
+static
+void
+recursehashdirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_dirbucket db;
+
+	if (fileblock < SFS_DIRHASH_FIRSTBUCKET || diskblock == 0) {
+		return;
 	}
+	diskread(&db, diskblock);
+	recursedirentries(db.db_entries, SFS_DIRHASH_PERBUCKET);
 }
 
 static
 void
 recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 {
-	int nentries;
+	struct sfs_direntry sds[SFS_INLINE_MAX/sizeof(struct sfs_direntry)];
+	unsigned nentries;
 
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_HASHED) {
+		printf("Reading files in directory %u: hashed\n", ino);
+		traverse(sfi, recursehashdirblock);
+		printf("Done with directory %u\n", ino);
+		return;
+	}
 	nentries = SWAP32(sfi->sfi_size) / sizeof(struct sfs_direntry);
-	printf("Reading files in directory %u: %d entries\n", ino, nentries);
-	traverse(sfi, recursedirblock);
+	printf("Reading files in directory %u: %u entries\n", ino, nentries);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		if (nentries > ARRAYCOUNT(sds)) {
+			nentries = ARRAYCOUNT(sds);
+		}
+		memcpy(sds, sfi->sfi_inline, nentries * sizeof(sds[0]));
+		recursedirentries(sds, nentries);
+	}
+	else {
+		traverse(sfi, recursedirblock);
+	}
 	printf("Done with directory %u\n", ino);
 }
 
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumpdata(uint32_t offset, const uint8_t *data, unsigned len)
 {
-	uint8_t data[SFS_BLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", offset + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -400,9 +666,13 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 			printf(" ");
 		}
 		printf("%02x", data[i]);
-		if (i % 16 == 15) {
+		if (i % 16 == 15 || i == len-1) {
+			/* pad out a short last line */
+			for (j = i % 16 + 1; j < 16; j++) {
+				printf(j % 8 == 0 ? "    " : "   ");
+			}
 			printf("  ");
-			for (j = i-15; j<=i; j++) {
+			for (j = i - i % 16; j<=i; j++) {
 				if (data[j] < 32 || data[j] > 126) {
 					putchar('.');
 				}
@@ -415,11 +685,37 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_BLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumpdata(fileblock * SFS_BLOCKSIZE, data, SFS_BLOCKSIZE);
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
+	uint32_t size;
+
 	printf("File contents for inode %u:\n", ino);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		size = SWAP32(sfi->sfi_size);
+		if (size > sizeof(sfi->sfi_inline)) {
+			warnx("Warning: inline file is too large");
+			size = sizeof(sfi->sfi_inline);
+		}
+		printf("    [inline]\n");
+		dumpdata(0, sfi->sfi_inline, size);
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
@@ -432,7 +728,7 @@ dumpinode(uint32_t ino, const char *name)
 	char tmp[128];
 	unsigned i;
 
-	diskread(&sfi, ino);
+	readinode(ino, &sfi);
 
 	printf("Inode %u", ino);
 	if (name != NULL) {
@@ -476,15 +772,26 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAP32(sfi.sfi_waste[i]));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	printf("    Flags: 0x%x%s%s\n", SWAP32(sfi.sfi_flags),
+	       (SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) ? " (inline)" : "",
+	       (SWAP32(sfi.sfi_flags) & SFS_IFLAG_HASHED) ? " (hashed)" : "");
+	if (!(SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE)) {
+		for (i=0; i<ARRAYCOUNT(sfi.sfi_inline); i++) {
+			if (sfi.sfi_inline[i] != 0) {
+				printf("    Byte %u in inline area: 0x%x\n",
+				       i, sfi.sfi_inline[i]);
+			}
 		}
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -507,7 +814,7 @@ usage(void)
 {
 	warnx("Usage: dumpsfs [options] device/diskfile");
 	warnx("   -s: dump superblock");
-	warnx("   -b: dump free block bitmap");
+	warnx("   -b: dump free block bitmap (and inode bitmap)");
 	warnx("   -i ino: dump specified inode");
 	warnx("   -I: dump indirect blocks");
 	warnx("   -f: dump file contents");
@@ -57,12 +57,28 @@
 
 #include "disk.h"
 
-/* Maximum size of freemap we support */
+/* Maximum size of freemap (and inode bitmap) we support */
 #define MAXFREEMAPBLOCKS 32
 
+/* In the packed format, make one inode for this many blocks */
+#define BLOCKSPERINODE 4
+
+/* Journal size: this fraction of the volume, within limits */
+#define BLOCKSPERJOURNALBLOCK 8
+#define MAXJOURNALBLOCKS 1024
+
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
 
+/* Inode bitmap (packed format) */
+static char inodemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
+
+/* Layout of the inode table (packed format; all 0 otherwise) */
+static uint32_t ninodes, inodemapstart, inodetablestart;
+
+/* Where the journal is, if we're making one */
+static uint32_t journalstart, journalblocks;
+
 /*
  * Assert that the on-disk data structures are correctly sized.
  */
@@ -89,6 +105,82 @@ allocblock(uint32_t block)
 	freemapbuf[mapbyte] |= mask;
 }
 
+/*
+ * Mark an inode allocated (packed format).
+ */
+static
+void
+allocinode(uint32_t ino)
+{
+	uint32_t mapbyte = ino/CHAR_BIT;
+	unsigned char mask = (1<<(ino % CHAR_BIT));
+
+	assert((inodemapbuf[mapbyte] & mask) == 0);
+	inodemapbuf[mapbyte] |= mask;
+}
+
+/*
+ * Lay out the inode bitmap and inode table for the packed format:
+ * they go right after the freemap.
+ */
+static
+void
+initinodes(uint32_t fsblocks)
+{
+	uint32_t i;
+
+	ninodes = fsblocks / BLOCKSPERINODE;
+	ninodes = SFS_ROUNDUP(ninodes, SFS_INOPB);
+	if (ninodes <= SFS_ROOTDIR_INO) {
+		ninodes = SFS_INOPB;
+	}
+	if (SFS_INODEMAPBLOCKS(ninodes) > MAXFREEMAPBLOCKS) {
+		errx(1, "Filesystem too large -- "
+		     "increase MAXFREEMAPBLOCKS and recompile");
+	}
+
+	inodemapstart = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(fsblocks);
+	inodetablestart = inodemapstart + SFS_INODEMAPBLOCKS(ninodes);
+	if (inodetablestart + SFS_INODETABLEBLOCKS(ninodes) >= fsblocks) {
+		errx(1, "Filesystem too small for its inode table");
+	}
+
+	/* inode 0 is SFS_NOINO and never used; then the root */
+	allocinode(SFS_NOINO);
+	allocinode(SFS_ROOTDIR_INO);
+
+	/* all inodes in the bitmap but past the table end are "in use" */
+	for (i=ninodes; i<SFS_FREEMAPBITS(ninodes); i++) {
+		allocinode(i);
+	}
+}
+
+/*
+ * Lay out the journal: it goes right after the rest of the metadata.
+ */
+static
+void
+initjournal(uint32_t fsblocks)
+{
+	if (ninodes == 0) {
+		journalstart = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(fsblocks);
+	}
+	else {
+		journalstart = inodetablestart + SFS_INODETABLEBLOCKS(ninodes);
+	}
+
+	journalblocks = fsblocks / BLOCKSPERJOURNALBLOCK;
+	if (journalblocks > MAXJOURNALBLOCKS) {
+		journalblocks = MAXJOURNALBLOCKS;
+	}
+	if (journalblocks < SFS_JOURNAL_MINBLOCKS) {
+		journalblocks = SFS_JOURNAL_MINBLOCKS;
+	}
+	if (journalstart + journalblocks >= fsblocks) {
+		errx(1, "Filesystem too small for a journal");
+	}
+}
+
 /*
  * Initialize the free block bitmap.
  */
@@ -105,21 +197,101 @@ initfreemap(uint32_t fsblocks)
 		     "increase MAXFREEMAPBLOCKS and recompile");
 	}
 
-	/* mark the superblock and root inode in use */
+	/* mark the superblock in use */
 	allocblock(SFS_SUPER_BLOCK);
-	allocblock(SFS_ROOTDIR_INO);
 
 	/* the freemap blocks must be in use */
 	for (i=0; i<freemapblocks; i++) {
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
+	if (ninodes == 0) {
+		/* the root inode is a block of its own */
+		allocblock(SFS_ROOTDIR_INO);
+	}
+	else {
+		/* so are the inode bitmap and the inode table */
+		for (i=0; i<SFS_INODEMAPBLOCKS(ninodes); i++) {
+			allocblock(inodemapstart + i);
+		}
+		for (i=0; i<SFS_INODETABLEBLOCKS(ninodes); i++) {
+			allocblock(inodetablestart + i);
+		}
+	}
+
+	/* and the journal */
+	for (i=0; i<journalblocks; i++) {
+		allocblock(journalstart + i);
+	}
+
 	/* all blocks in the freemap but past the volume end are "in use" */
 	for (i=fsblocks; i<freemapbits; i++) {
 		allocblock(i);
 	}
 }
 
+/*
+ * Count the clear bits in MAP from START up to but not including END.
+ */
+static
+uint32_t
+countfree(const char *map, uint32_t start, uint32_t end)
+{
+	uint32_t i, count = 0;
+
+	for (i=start; i<end; i++) {
+		if ((map[i/CHAR_BIT] & (1<<(i % CHAR_BIT))) == 0) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/*
+ * Fill in the allocation groups in the superblock, from the bitmaps.
+ */
+static
+void
+initgroups(struct sfs_superblock *sb, uint32_t nblocks)
+{
+	uint32_t ngroups, groupblocks, groupinodes = 0;
+	uint32_t group, start, end;
+
+	ngroups = SFS_NGROUPS(nblocks);
+	groupblocks = SFS_GROUPBLOCKS(nblocks);
+	if (ninodes > 0) {
+		groupinodes = SFS_GROUPINODES(ninodes, ngroups);
+	}
+	assert(ngroups <= SFS_MAXGROUPS);
+
+	sb->sb_ngroups = SWAP32(ngroups);
+	sb->sb_groupblocks = SWAP32(groupblocks);
+	sb->sb_groupinodes = SWAP32(groupinodes);
+
+	for (group=0; group<ngroups; group++) {
+		start = group * groupblocks;
+		end = start + groupblocks;
+		if (end > nblocks) {
+			end = nblocks;
+		}
+		sb->sb_groupfree[group] =
+			SWAP32(countfree(freemapbuf, start, end));
+
+		if (ninodes == 0) {
+			continue;
+		}
+		start = group * groupinodes;
+		end = start + groupinodes;
+		if (end > ninodes) {
+			end = ninodes;
+		}
+		if (start < end) {
+			sb->sb_groupifree[group] =
+				SWAP32(countfree(inodemapbuf, start, end));
+		}
+	}
+}
+
 /*
  * Initialize and write out the superblock.
  */
@@ -140,6 +312,15 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	if (ninodes > 0) {
+		sb.sb_version = SWAP32(SFS_VERSION_PACKED);
+		sb.sb_ninodes = SWAP32(ninodes);
+		sb.sb_inodemapstart = SWAP32(inodemapstart);
+		sb.sb_inodetablestart = SWAP32(inodetablestart);
+	}
+	sb.sb_journalstart = SWAP32(journalstart);
+	sb.sb_journalblocks = SWAP32(journalblocks);
+	initgroups(&sb, nblocks);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -164,6 +345,55 @@ writefreemap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Write out the inode bitmap and the inode table, which is empty
+ * except for the root directory (packed format).
+ */
+static
+void
+writeinodes(const struct sfs_dinode *rootsfi)
+{
+	char buf[SFS_BLOCKSIZE];
+	uint32_t i;
+
+	for (i=0; i<SFS_INODEMAPBLOCKS(ninodes); i++) {
+		diskwrite(inodemapbuf + i*SFS_BLOCKSIZE, inodemapstart+i);
+	}
+
+	bzero(buf, sizeof(buf));
+	for (i=1; i<SFS_INODETABLEBLOCKS(ninodes); i++) {
+		diskwrite(buf, inodetablestart+i);
+	}
+
+	/* The root is in the first block, with inode 0 */
+	assert(SFS_ROOTDIR_INO < SFS_INOPB);
+	memcpy(buf + SFS_ROOTDIR_INO * SFS_PINODESIZE, rootsfi,
+	       SFS_PINODESIZE);
+	diskwrite(buf, inodetablestart);
+}
+
+/*
+ * Write out an empty journal: the header, and a blank block where the
+ * first transaction would go so nothing left on the disk looks like
+ * one.
+ */
+static
+void
+writejournal(void)
+{
+	struct sfs_jheader jh;
+	char buf[SFS_BLOCKSIZE];
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JHEADER_MAGIC);
+	jh.jh_seq = SWAP32(1);
+	jh.jh_start = SWAP32(1);
+	diskwrite(&jh, journalstart);
+
+	bzero(buf, sizeof(buf));
+	diskwrite(buf, journalstart + 1);
+}
+
 /*
  * Write out the root directory inode.
  */
@@ -178,9 +408,15 @@ writerootdir(void)
 	sfi.sfi_size = SWAP32(0);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
+	sfi.sfi_flags = SWAP32(SFS_IFLAG_INLINE);
 
 	/* Write it out */
-	diskwrite(&sfi, SFS_ROOTDIR_INO);
+	if (ninodes == 0) {
+		diskwrite(&sfi, SFS_ROOTDIR_INO);
+	}
+	else {
+		writeinodes(&sfi);
+	}
 }
 
 /*
@@ -191,13 +427,29 @@ main(int argc, char **argv)
 {
 	uint32_t size, blocksize;
 	char *volname, *s;
+	int packed = 0, journal = 0;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-p")) {
+			/* packed inode table */
+			packed = 1;
+		}
+		else if (!strcmp(argv[1], "-j")) {
+			/* metadata journal */
+			journal = 1;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-p] [-j] device/diskfile volume-name");
 	}
 
 	check();
@@ -229,10 +481,19 @@ main(int argc, char **argv)
 	size = diskblocks();
 
 	/* Write out the on-disk structures */
+	if (packed) {
+		initinodes(size);
+	}
+	if (journal) {
+		initjournal(size);
+	}
 	initfreemap(size);
 	writesuper(volname, size);
 	writefreemap(size);
 	writerootdir();
+	if (journal) {
+		writejournal();
+	}
 
 	closedisk();
 
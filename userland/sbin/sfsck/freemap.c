@@ -78,6 +78,23 @@ freemap_setup(void)
 	for (i=0; i < mapblocks; i++) {
 		freemap_blockinuse(SFS_FREEMAP_START+i, B_FREEMAPBLOCK, i);
 	}
+
+	/* And the inode bitmap and inode table, if there are any */
+	if (sb_packed()) {
+		for (i=0; i < sb_inodemapblocks(); i++) {
+			freemap_blockinuse(sb_inodemapstart()+i,
+					   B_INODEMAPBLOCK, i);
+		}
+		for (i=0; i < sb_inodetableblocks(); i++) {
+			freemap_blockinuse(sb_inodetablestart()+i,
+					   B_INODETABLE, i);
+		}
+	}
+
+	/* And the journal */
+	for (i=0; i < sb_journalblocks(); i++) {
+		freemap_blockinuse(sb_journalstart()+i, B_JOURNAL, i);
+	}
 }
 
 /*
@@ -99,6 +116,18 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "inode %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_INODEMAPBLOCK:
+		snprintf(rv, sizeof(rv), "inode bitmap block %lu",
+			 (unsigned long) howdesc);
+		break;
+	    case B_INODETABLE:
+		snprintf(rv, sizeof(rv), "inode table block %lu",
+			 (unsigned long) howdesc);
+		break;
+	    case B_JOURNAL:
+		snprintf(rv, sizeof(rv), "journal block %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_IBLOCK:
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu",
 			 (unsigned long) howdesc);
@@ -299,6 +328,23 @@ freemap_check(void)
 	}
 }
 
+/*
+ * Count the free blocks from START up to but not including END, which
+ * after freemap_check is the same as what's on disk.
+ */
+uint32_t
+freemap_countfree(uint32_t start, uint32_t end)
+{
+	uint32_t block, count = 0;
+
+	for (block=start; block<end; block++) {
+		if ((freemapdata[block/8] & (((uint8_t)1)<<(block%8))) == 0) {
+			count++;
+		}
+	}
+	return count;
+}
+
 /*
  * Return the total number of blocks in use, which we count during
  * pass 1.
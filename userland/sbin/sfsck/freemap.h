@@ -42,6 +42,9 @@ typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_FREEMAPBLOCK,	/* Block used by free-block bitmap */
 	B_INODE,	/* Block that is an inode */
+	B_INODEMAPBLOCK,/* Block used by inode bitmap (packed format) */
+	B_INODETABLE,	/* Block of the inode table (packed format) */
+	B_JOURNAL,	/* Block of the metadata journal */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
 	B_DATA,		/* Data block */
@@ -60,6 +63,9 @@ void freemap_blockfree(uint32_t block);
 /* Call this after all checks that call freemap_block{inuse,free}. */
 void freemap_check(void);
 
+/* Count the free blocks in a range. Valid after freemap_check(). */
+uint32_t freemap_countfree(uint32_t start, uint32_t end);
+
 /* Return the number of blocks in use. Valid after freemap_check(). */
 unsigned long freemap_blocksused(void);
 
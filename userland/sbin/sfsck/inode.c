@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/types.h>	/* for CHAR_BIT */
+#include <limits.h>	/* also for CHAR_BIT */
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +40,7 @@
 
 #include "utils.h"
 #include "sfs.h"
+#include "sb.h"
 #include "freemap.h"
 #include "inode.h"
 #include "main.h"
@@ -264,3 +267,105 @@ inode_adjust_filelinks(void)
 	}
 }
 
+
+/*
+ * Check the inode bitmap (packed format only) against the inodes we
+ * found in pass 1, and fix it. Inodes nothing refers to any more are
+ * freed; inodes in use that are marked free are marked in use.
+ */
+void
+inode_check_inodemap(void)
+{
+	uint8_t actual[SFS_BLOCKSIZE], *expected, diff, mask;
+	uint32_t mapblocks, mapbits, ino, i, j;
+	unsigned long alloccount = 0, freecount = 0;
+	int bchanged;
+
+	if (!sb_packed()) {
+		/* Inodes are blocks; the freemap covers them */
+		return;
+	}
+
+	mapblocks = sb_inodemapblocks();
+	mapbits = mapblocks * SFS_BITSPERBLOCK;
+	expected = domalloc(mapblocks * SFS_BLOCKSIZE);
+	memset(expected, 0, mapblocks * SFS_BLOCKSIZE);
+
+	/* Inode 0 is never used; past the table end is "in use" */
+	expected[SFS_NOINO / CHAR_BIT] |= 1 << (SFS_NOINO % CHAR_BIT);
+	for (ino = sb_maxinodes(); ino < mapbits; ino++) {
+		expected[ino / CHAR_BIT] |= 1 << (ino % CHAR_BIT);
+	}
+	for (i=0; i<ninodes; i++) {
+		ino = inodes[i].ino;
+		expected[ino / CHAR_BIT] |= 1 << (ino % CHAR_BIT);
+	}
+
+	for (i=0; i<mapblocks; i++) {
+		sfs_readinodemapblock(i, actual);
+		bchanged = 0;
+		for (j=0; j<SFS_BLOCKSIZE; j++) {
+			diff = actual[j] ^ expected[i*SFS_BLOCKSIZE + j];
+			if (diff == 0) {
+				continue;
+			}
+			for (mask = 1, ino = i*SFS_BITSPERBLOCK + j*CHAR_BIT;
+			     mask != 0; mask <<= 1, ino++) {
+				if ((diff & mask) == 0) {
+					continue;
+				}
+				if (actual[j] & mask) {
+					warnx("Inode %lu erroneously shown "
+					      "allocated in inode bitmap",
+					      (unsigned long) ino);
+					freecount++;
+				}
+				else {
+					warnx("Inode %lu erroneously shown "
+					      "free in inode bitmap",
+					      (unsigned long) ino);
+					alloccount++;
+				}
+			}
+			actual[j] = expected[i*SFS_BLOCKSIZE + j];
+			bchanged = 1;
+		}
+		if (bchanged) {
+			sfs_writeinodemapblock(i, actual);
+		}
+	}
+	free(expected);
+
+	if (alloccount > 0) {
+		warnx("%lu inodes erroneously shown free in inode bitmap "
+		      "(fixed)", alloccount);
+		setbadness(EXIT_RECOV);
+	}
+	if (freecount > 0) {
+		warnx("%lu inodes erroneously shown used in inode bitmap "
+		      "(fixed)", freecount);
+		setbadness(EXIT_RECOV);
+	}
+}
+
+/*
+ * Count the inodes from START up to but not including END that are
+ * free, which after inode_check_inodemap is what the inode bitmap
+ * says.
+ */
+uint32_t
+inode_countfree(uint32_t start, uint32_t end)
+{
+	uint32_t count, i;
+
+	count = end - start;
+	if (start <= SFS_NOINO && SFS_NOINO < end) {
+		count--;
+	}
+	for (i=0; i<ninodes; i++) {
+		if (inodes[i].ino >= start && inodes[i].ino < end) {
+			count--;
+		}
+	}
+	return count;
+}
@@ -61,5 +61,17 @@ void inode_addlink(uint32_t ino);
  */
 void inode_adjust_filelinks(void);
 
+/*
+ * Check and fix the inode bitmap (packed format), once pass 1 has
+ * found all the inodes.
+ */
+void inode_check_inodemap(void);
+
+/*
+ * Count the free inodes in a range (packed format), once pass 1 has
+ * found all the inodes.
+ */
+uint32_t inode_countfree(uint32_t start, uint32_t end);
+
 
 #endif /* INODE_H */
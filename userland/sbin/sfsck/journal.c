@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>	/* for CHAR_BIT */
+#include <limits.h>	/* also for CHAR_BIT */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "utils.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+static uint32_t jstart, jsize;
+
+/*
+ * Move N blocks along the log from POS, wrapping around at the end.
+ * Log positions run from 1 to jsize-1; block 0 is the header.
+ */
+static
+uint32_t
+jadvance(uint32_t pos, uint32_t n)
+{
+	return (pos - 1 + n) % (jsize - 1) + 1;
+}
+
+/*
+ * Read the record at log position POS.
+ */
+static
+void
+jreadrec(uint32_t pos, struct sfs_jdesc *jd)
+{
+	unsigned i;
+
+	diskread(jd, jstart + pos);
+	jd->jd_magic = SWAP32(jd->jd_magic);
+	jd->jd_seq = SWAP32(jd->jd_seq);
+	jd->jd_count = SWAP32(jd->jd_count);
+	for (i=0; i<SFS_JPERDESC; i++) {
+		jd->jd_blocks[i] = SWAP32(jd->jd_blocks[i]);
+	}
+}
+
+/*
+ * Write an empty log whose first transaction will be number SEQ.
+ */
+static
+void
+jreset(uint32_t seq)
+{
+	struct sfs_jheader jh;
+
+	memset(&jh, 0, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JHEADER_MAGIC);
+	jh.jh_seq = SWAP32(seq);
+	jh.jh_start = SWAP32(1);
+	diskwrite(&jh, jstart);
+}
+
+/*
+ * Check if a log record may put BLOCK back: it has to be inside the
+ * volume and not in the journal.
+ */
+static
+int
+jhome_ok(uint32_t block)
+{
+	return block < sb_totalblocks() &&
+		(block < jstart || block >= jstart + jsize);
+}
+
+int
+journal_replay(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	char data[SFS_BLOCKSIZE];
+	uint8_t *done;
+	uint32_t *starts;
+	uint32_t pos, seq, left, txstart, adv, block, i;
+	unsigned n, t;
+
+	jstart = sb_journalstart();
+	jsize = sb_journalblocks();
+	if (jsize == 0) {
+		return 0;
+	}
+
+	diskread(&jh, jstart);
+	jh.jh_magic = SWAP32(jh.jh_magic);
+	jh.jh_seq = SWAP32(jh.jh_seq);
+	jh.jh_start = SWAP32(jh.jh_start);
+	if (jh.jh_magic != SFS_JHEADER_MAGIC || jh.jh_start == 0 ||
+	    jh.jh_start >= jsize) {
+		warnx("Journal header is bad; emptied the journal (fixed)");
+		setbadness(EXIT_RECOV);
+		/* Make sure nothing left in the log looks like a record */
+		memset(data, 0, sizeof(data));
+		diskwrite(data, jstart + 1);
+		jreset(1);
+		return 0;
+	}
+
+	/* Every transaction takes at least two blocks */
+	starts = domalloc(((jsize - 1) / 2 + 1) * sizeof(uint32_t));
+
+	/* Find where each complete transaction starts */
+	pos = txstart = jh.jh_start;
+	seq = jh.jh_seq;
+	n = 0;
+	for (left = jsize - 1; left > 0; left -= adv) {
+		jreadrec(pos, &jd);
+		if (jd.jd_seq != seq) {
+			break;
+		}
+		if (jd.jd_magic == SFS_JDESC_MAGIC &&
+		    jd.jd_count > 0 && jd.jd_count <= SFS_JPERDESC) {
+			adv = 1 + jd.jd_count;
+		}
+		else if (jd.jd_magic == SFS_JREVOKE_MAGIC &&
+			 jd.jd_count <= SFS_JPERDESC) {
+			adv = 1;
+		}
+		else if (jd.jd_magic == SFS_JCOMMIT_MAGIC) {
+			adv = 1;
+		}
+		else {
+			break;
+		}
+		if (adv > left) {
+			break;
+		}
+		pos = jadvance(pos, adv);
+		if (jd.jd_magic == SFS_JCOMMIT_MAGIC) {
+			starts[n++] = txstart;
+			txstart = pos;
+			seq++;
+		}
+	}
+
+	if (n == 0) {
+		free(starts);
+		return 0;
+	}
+
+	/*
+	 * Put back the newest copy of each block, going from the last
+	 * transaction to the first. A revoked block was freed, so no
+	 * older copy of it counts either.
+	 */
+	done = domalloc(SFS_FREEMAPBLOCKS(sb_totalblocks()) * SFS_BLOCKSIZE);
+	memset(done, 0, SFS_FREEMAPBLOCKS(sb_totalblocks()) * SFS_BLOCKSIZE);
+	for (t = n; t-- > 0; ) {
+		pos = starts[t];
+		while (1) {
+			jreadrec(pos, &jd);
+			if (jd.jd_magic == SFS_JCOMMIT_MAGIC) {
+				break;
+			}
+			for (i=0; i<jd.jd_count; i++) {
+				block = jd.jd_blocks[i];
+				if (!jhome_ok(block)) {
+					warnx("Journal: transaction %lu has "
+					      "bad block number %lu (skipped)",
+					      (unsigned long) (jh.jh_seq + t),
+					      (unsigned long) block);
+					setbadness(EXIT_RECOV);
+					continue;
+				}
+				if (done[block/CHAR_BIT] &
+				    (1 << (block % CHAR_BIT))) {
+					continue;
+				}
+				done[block/CHAR_BIT] |= 1 << (block % CHAR_BIT);
+				if (jd.jd_magic == SFS_JDESC_MAGIC) {
+					diskread(data, jstart +
+						 jadvance(pos, 1 + i));
+					diskwrite(data, block);
+				}
+			}
+			pos = jadvance(pos, jd.jd_magic == SFS_JDESC_MAGIC ?
+				       1 + jd.jd_count : 1);
+		}
+	}
+	free(done);
+	free(starts);
+
+	jreset(seq);
+	warnx("Replayed %u transaction%s from the journal (fixed)",
+	      n, n == 1 ? "" : "s");
+	setbadness(EXIT_RECOV);
+	return 1;
+}
@@ -39,6 +39,7 @@
 #include "sb.h"
 #include "freemap.h"
 #include "inode.h"
+#include "journal.h"
 #include "passes.h"
 #include "main.h"
 
@@ -78,11 +79,18 @@ main(int argc, char **argv)
 	sfs_setup();
 	sb_load();
 	sb_check();
+	if (journal_replay()) {
+		/* The superblock may have been among what it put back */
+		sb_load();
+		sb_check();
+	}
 	freemap_setup();
 
 	printf("Phase 1 -- check blocks and sizes\n");
 	pass1();
 	freemap_check();
+	inode_check_inodemap();
+	sb_check_groups();
 
 	printf("Phase 2 -- check directory tree\n");
 	inode_sorttable();
@@ -247,6 +247,78 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * Check an inline inode INO, whose inode has already been loaded
+ * into SFI. An inline inode has no blocks, and its size is limited
+ * by the space in the inode. ISDIR is a shortcut telling us if the
+ * inode is a directory.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_inline(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	uint32_t max;
+	int changed = 0, hadblocks = 0;
+	int i;
+
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			SET_D(sfi, i) = 0;
+			hadblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_I; i++) {
+		if (GET_I(sfi, i) != 0) {
+			SET_I(sfi, i) = 0;
+			hadblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_II; i++) {
+		if (GET_II(sfi, i) != 0) {
+			SET_II(sfi, i) = 0;
+			hadblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_III; i++) {
+		if (GET_III(sfi, i) != 0) {
+			SET_III(sfi, i) = 0;
+			hadblocks = 1;
+		}
+	}
+	if (hadblocks) {
+		/* The blocks become unreferenced and are freed later */
+		warnx("Inode %lu: inline inode has block pointers (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	max = sb_inlinemax();
+	if (isdir) {
+		max -= max % sizeof(struct sfs_direntry);
+	}
+	if (sfi->sfi_size > max) {
+		warnx("Inode %lu: inline size %lu too large (truncated)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_size);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = max;
+		changed = 1;
+	}
+
+	if (checkzeroed(sfi->sfi_inline + sfi->sfi_size,
+			sizeof(sfi->sfi_inline) - sfi->sfi_size)) {
+		warnx("Inode %lu: inline data past EOF not zeroed (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -268,25 +340,169 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		return 1;
 	}
 
-	freemap_blockinuse(ino, B_INODE, ino);
+	if (!sb_packed()) {
+		/* The inode is a block; packed inodes are in the table */
+		freemap_blockinuse(ino, B_INODE, ino);
+	}
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
-		      (unsigned long) ino);
+	if (sfi->sfi_flags & ~(SFS_IFLAG_INLINE | SFS_IFLAG_HASHED)) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_flags);
 		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IFLAG_INLINE | SFS_IFLAG_HASHED;
 		changed = 1;
 	}
 
-	if (check_inode_blocks(ino, sfi, isdir)) {
+	if ((sfi->sfi_flags & SFS_IFLAG_HASHED) &&
+	    (!isdir || (sfi->sfi_flags & SFS_IFLAG_INLINE))) {
+		warnx("Inode %lu: bogus hashed directory flag (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IFLAG_HASHED;
 		changed = 1;
 	}
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		if (check_inode_inline(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+	else {
+		if (checkzeroed(sfi->sfi_inline, sizeof(sfi->sfi_inline))) {
+			warnx("Inode %lu: sfi_inline section not zeroed "
+			      "(fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+
+		if (check_inode_blocks(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+
 	if (changed) {
 		sfs_writeinode(ino, sfi);
 	}
 	return 0;
 }
 
+/*
+ * Check the index of the hashed directory PATH, whose inode is SFI:
+ * the header, the bucket table, and that each entry is in the bucket
+ * its hash selects. Entries anywhere else can't be found by the
+ * kernel. We don't rebuild the index, so problems are reported but
+ * not fixed.
+ */
+static
+void
+pass1_hashdir(const struct sfs_dinode *sfi, const char *path)
+{
+	const uint32_t perblock = SFS_BLOCKSIZE / sizeof(uint32_t);
+	struct sfs_dirbucket db;
+	uint32_t table[SFS_BLOCKSIZE / sizeof(uint32_t)];
+	uint32_t *reached;
+	uint32_t nblocks, nbuckets, depth, bdepth, bits, ix, block, n, i;
+	char name[SFS_NAMELEN];
+
+	nblocks = sfi->sfi_size / SFS_BLOCKSIZE;
+	depth = sfs_readdirword(sfi, 0, 1);
+	if (sfi->sfi_size % SFS_BLOCKSIZE != 0 ||
+	    nblocks <= SFS_DIRHASH_FIRSTBUCKET ||
+	    sfs_readdirword(sfi, 0, 0) != SFS_DIRHASH_MAGIC ||
+	    depth > SFS_DIRHASH_MAXDEPTH) {
+		setbadness(EXIT_UNRECOV);
+		warnx("Directory %s: Bad hashed directory header "
+		      "(NOT FIXED)", path);
+		return;
+	}
+
+	/* For each bucket, 1 + the hash bits it was reached with */
+	nbuckets = nblocks - SFS_DIRHASH_FIRSTBUCKET;
+	reached = domalloc(nbuckets * sizeof(uint32_t));
+	bzero(reached, nbuckets * sizeof(uint32_t));
+
+	for (ix=0; ix < (1U << depth); ix++) {
+		if (ix % perblock == 0) {
+			sfs_readfileblock(sfi, 1 + ix / perblock, table);
+		}
+		block = SWAP32(table[ix % perblock]);
+		if (block < SFS_DIRHASH_FIRSTBUCKET || block >= nblocks) {
+			setbadness(EXIT_UNRECOV);
+			warnx("Directory %s: Hash table entry %lu out of "
+			      "range (NOT FIXED)", path, (unsigned long) ix);
+			continue;
+		}
+
+		sfs_readfileblock(sfi, block, &db);
+		bdepth = SWAP32(db.db_depth);
+		if (bdepth > depth) {
+			setbadness(EXIT_UNRECOV);
+			warnx("Directory %s: Hash bucket at block %lu has bad "
+			      "depth %lu (NOT FIXED)", path,
+			      (unsigned long) block, (unsigned long) bdepth);
+			continue;
+		}
+		bits = ix & ((1U << bdepth) - 1);
+		if (reached[block - SFS_DIRHASH_FIRSTBUCKET] != 0) {
+			if (reached[block - SFS_DIRHASH_FIRSTBUCKET] !=
+			    bits + 1) {
+				setbadness(EXIT_UNRECOV);
+				warnx("Directory %s: Hash table entry %lu "
+				      "inconsistent (NOT FIXED)", path,
+				      (unsigned long) ix);
+			}
+			continue;
+		}
+
+		/* First visit: check the bucket and its overflow chain */
+		for (n=0; n<nbuckets; n++) {
+			reached[block - SFS_DIRHASH_FIRSTBUCKET] = bits + 1;
+			for (i=0; i<SFS_DIRHASH_PERBUCKET; i++) {
+				if (SWAP32(db.db_entries[i].sfd_ino) ==
+				    SFS_NOINO) {
+					continue;
+				}
+				memcpy(name, db.db_entries[i].sfd_name,
+				       sizeof(name));
+				name[sizeof(name)-1] = 0;
+				if ((sfs_dirhash(name) &
+				     ((1U << bdepth) - 1)) != bits) {
+					setbadness(EXIT_UNRECOV);
+					warnx("Directory %s: Entry %s is in "
+					      "the wrong hash bucket "
+					      "(NOT FIXED)", path, name);
+				}
+			}
+
+			block = SWAP32(db.db_next);
+			if (block == 0) {
+				break;
+			}
+			if (bdepth != SFS_DIRHASH_MAXDEPTH ||
+			    block < SFS_DIRHASH_FIRSTBUCKET ||
+			    block >= nblocks ||
+			    reached[block - SFS_DIRHASH_FIRSTBUCKET] != 0) {
+				setbadness(EXIT_UNRECOV);
+				warnx("Directory %s: Bad hash overflow chain "
+				      "(NOT FIXED)", path);
+				break;
+			}
+			sfs_readfileblock(sfi, block, &db);
+		}
+	}
+
+	for (n=0; n<nbuckets; n++) {
+		if (reached[n] == 0) {
+			setbadness(EXIT_UNRECOV);
+			warnx("Directory %s: Hash bucket at block %lu not in "
+			      "the table (NOT FIXED)", path,
+			      (unsigned long) (n + SFS_DIRHASH_FIRSTBUCKET));
+		}
+	}
+
+	free(reached);
+}
+
 /*
  * Check the directory entry in SFD. INDEX is its offset, and PATH is
  * its name; these are used for printing messages.
@@ -296,9 +512,9 @@ int
 pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 {
 	int dchanged = 0;
-	uint32_t nblocks;
+	uint32_t maxinodes;
 
-	nblocks = sb_totalblocks();
+	maxinodes = sb_maxinodes();
 
 	if (sfd->sfd_ino == SFS_NOINO) {
 		if (sfd->sfd_name[0] != 0) {
@@ -309,7 +525,7 @@ pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 			dchanged = 1;
 		}
 	}
-	else if (sfd->sfd_ino >= nblocks) {
+	else if (sfd->sfd_ino >= maxinodes) {
 		setbadness(EXIT_RECOV);
 		warnx("Directory %s entry %lu has out of range "
 		      "inode (cleared)",
@@ -381,8 +597,12 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 		return;
 	}
 
-	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
-	direntries = domalloc(sfi.sfi_size);
+	if (sfi.sfi_flags & SFS_IFLAG_HASHED) {
+		pass1_hashdir(&sfi, pathsofar);
+	}
+
+	ndirentries = sfs_dir_nentries(&sfi);
+	direntries = domalloc(ndirentries * sizeof(struct sfs_direntry));
 
 	sfs_readdir(&sfi, direntries, ndirentries);
 
@@ -436,7 +656,9 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 	}
 
 	if (dchanged) {
-		sfs_writedir(&sfi, direntries, ndirentries);
+		if (sfs_writedir(&sfi, direntries, ndirentries)) {
+			sfs_writeinode(ino, &sfi);
+		}
 	}
 
 	free(direntries);
@@ -82,9 +82,20 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 * entries.
 	 */
 
-	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
+	ndirentries = sfs_dir_nentries(&sfi);
 	maxdirentries = SFS_ROUNDUP(ndirentries,
 				    SFS_BLOCKSIZE/sizeof(struct sfs_direntry));
+	if (sfi.sfi_flags & SFS_IFLAG_HASHED) {
+		/* Hashed directories don't have spare room at the end */
+		maxdirentries = ndirentries;
+	}
+	if (sfi.sfi_flags & SFS_IFLAG_INLINE) {
+		/* An inline directory can only grow as far as the inode */
+		maxdirentries = sb_inlinemax() / sizeof(struct sfs_direntry);
+		if (maxdirentries < ndirentries) {
+			maxdirentries = ndirentries;
+		}
+	}
 	dirsize = maxdirentries * sizeof(struct sfs_direntry);
 	direntries = domalloc(dirsize);
 
@@ -122,6 +133,32 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 				d1->sfd_ino = SFS_NOINO;
 				d1->sfd_name[0] = 0;
 			}
+			else if (sfi.sfi_flags & SFS_IFLAG_HASHED) {
+				/* The new name must go in its own bucket */
+				char name[SFS_NAMELEN];
+				uint32_t dino = d1->sfd_ino;
+
+				/* XXX: what if FSCK.n.m already exists? */
+				snprintf(name, sizeof(name), "FSCK.%lu.%lu",
+					 (unsigned long) dino,
+					 (unsigned long) uniqueid());
+				d1->sfd_ino = SFS_NOINO;
+				d1->sfd_name[0] = 0;
+				if (sfsdir_tryadd(&sfi, direntries,
+						  ndirentries, name, dino)) {
+					d1->sfd_ino = dino;
+					strcpy(d1->sfd_name, d2->sfd_name);
+					setbadness(EXIT_UNRECOV);
+					warnx("Directory %s: Duplicate names "
+					      "%s (NOT FIXED)",
+					      pathsofar, d2->sfd_name);
+					continue;
+				}
+				setbadness(EXIT_RECOV);
+				warnx("Directory %s: Duplicate names %s "
+				      "(one renamed: %s)",
+				      pathsofar, d2->sfd_name, name);
+			}
 			else {
 				/* XXX: what if FSCK.n.m already exists? */
 				snprintf(d1->sfd_name, sizeof(d1->sfd_name),
@@ -173,13 +210,13 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (!dotseen) {
-		if (sfsdir_tryadd(direntries, ndirentries, ".", ino)==0) {
+		if (sfsdir_tryadd(&sfi, direntries, ndirentries, ".", ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `.' entry (added)",
 			      pathsofar);
 			dchanged = 1;
 		}
-		else if (sfsdir_tryadd(direntries, maxdirentries, ".",
+		else if (sfsdir_tryadd(&sfi, direntries, maxdirentries, ".",
 				       ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `.' entry (added)",
@@ -201,14 +238,14 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (!dotdotseen) {
-		if (sfsdir_tryadd(direntries, ndirentries, "..",
+		if (sfsdir_tryadd(&sfi, direntries, ndirentries, "..",
 				  parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `..' entry (added)",
 			      pathsofar);
 			dchanged = 1;
 		}
-		else if (sfsdir_tryadd(direntries, maxdirentries, "..",
+		else if (sfsdir_tryadd(&sfi, direntries, maxdirentries, "..",
 				    parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `..' entry (added)",
@@ -302,7 +339,9 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (dchanged) {
-		sfs_writedir(&sfi, direntries, ndirentries);
+		if (sfs_writedir(&sfi, direntries, ndirentries)) {
+			ichanged = 1;
+		}
 	}
 
 	if (ichanged) {
@@ -40,10 +40,38 @@
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
+#include "inode.h"
 #include "main.h"
 
 static struct sfs_superblock sb;
 
+/*
+ * Check the layout of the packed format's inode bitmap and inode
+ * table. We can't fix these, because we can't tell where the inodes
+ * really are if they're wrong.
+ */
+static
+void
+sb_checklayout(void)
+{
+	uint32_t mapend, tableend;
+
+	mapend = sb.sb_inodemapstart + SFS_INODEMAPBLOCKS(sb.sb_ninodes);
+	tableend = sb.sb_inodetablestart +
+		SFS_INODETABLEBLOCKS(sb.sb_ninodes);
+
+	if (sb.sb_ninodes <= SFS_ROOTDIR_INO) {
+		errx(EXIT_FATAL, "Superblock: bad inode count %lu",
+		     (unsigned long) sb.sb_ninodes);
+	}
+	if (sb.sb_inodemapstart < SFS_FREEMAP_START +
+	    SFS_FREEMAPBLOCKS(sb.sb_nblocks) ||
+	    sb.sb_inodetablestart < mapend ||
+	    tableend > sb.sb_nblocks || tableend < sb.sb_inodetablestart) {
+		errx(EXIT_FATAL, "Superblock: bad inode table layout");
+	}
+}
+
 /*
  * Load the superblock.
  */
@@ -57,6 +85,17 @@ sb_load(void)
 
 	assert(sb.sb_nblocks > 0);
 	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
+
+	switch (sb.sb_version) {
+	    case SFS_VERSION_ORIG:
+		break;
+	    case SFS_VERSION_PACKED:
+		sb_checklayout();
+		break;
+	    default:
+		errx(EXIT_FATAL, "Unsupported sfs format version %lu",
+		     (unsigned long) sb.sb_version);
+	}
 }
 
 /*
@@ -65,6 +104,7 @@ sb_load(void)
 void
 sb_check(void)
 {
+	uint32_t ngroups, groupblocks, groupinodes, metaend, end;
 	int schanged=0;
 
 	/*
@@ -83,6 +123,40 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_ngroups != 0) {
+		/* The group layout is fixed by the volume size */
+		ngroups = SFS_NGROUPS(sb.sb_nblocks);
+		groupblocks = SFS_GROUPBLOCKS(sb.sb_nblocks);
+		groupinodes = sb_packed() ?
+			SFS_GROUPINODES(sb.sb_ninodes, ngroups) : 0;
+		if (sb.sb_ngroups != ngroups ||
+		    sb.sb_groupblocks != groupblocks ||
+		    sb.sb_groupinodes != groupinodes) {
+			warnx("Bad allocation group layout (fixed)");
+			setbadness(EXIT_RECOV);
+			sb.sb_ngroups = ngroups;
+			sb.sb_groupblocks = groupblocks;
+			sb.sb_groupinodes = groupinodes;
+			schanged = 1;
+		}
+	}
+	if (sb.sb_journalblocks != 0) {
+		/* It has to come after the rest of the metadata */
+		metaend = sb_packed() ?
+			sb.sb_inodetablestart +
+			SFS_INODETABLEBLOCKS(sb.sb_ninodes) :
+			SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb.sb_nblocks);
+		end = sb.sb_journalstart + sb.sb_journalblocks;
+		if (sb.sb_journalblocks < SFS_JOURNAL_MINBLOCKS ||
+		    sb.sb_journalstart < metaend ||
+		    end > sb.sb_nblocks || end < sb.sb_journalstart) {
+			warnx("Bad journal layout; journal removed (fixed)");
+			setbadness(EXIT_RECOV);
+			sb.sb_journalstart = 0;
+			sb.sb_journalblocks = 0;
+			schanged = 1;
+		}
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -95,6 +169,74 @@ sb_check(void)
 	}
 }
 
+/*
+ * Check the free counts of the allocation groups against the bitmaps,
+ * which must have been checked (and fixed) already. A volume without
+ * allocation groups is fine; the kernel adds them at mount time.
+ */
+void
+sb_check_groups(void)
+{
+	uint32_t group, start, end, count;
+	int schanged=0;
+
+	for (group=0; group<sb.sb_ngroups; group++) {
+		start = group * sb.sb_groupblocks;
+		end = start + sb.sb_groupblocks;
+		if (end > sb.sb_nblocks) {
+			end = sb.sb_nblocks;
+		}
+		count = freemap_countfree(start, end);
+		if (sb.sb_groupfree[group] != count) {
+			warnx("Allocation group %lu: free block count %lu "
+			      "should be %lu (fixed)", (unsigned long) group,
+			      (unsigned long) sb.sb_groupfree[group],
+			      (unsigned long) count);
+			setbadness(EXIT_RECOV);
+			sb.sb_groupfree[group] = count;
+			schanged = 1;
+		}
+
+		count = 0;
+		if (sb_packed()) {
+			start = group * sb.sb_groupinodes;
+			end = start + sb.sb_groupinodes;
+			if (end > sb.sb_ninodes) {
+				end = sb.sb_ninodes;
+			}
+			if (start < end) {
+				count = inode_countfree(start, end);
+			}
+		}
+		if (sb.sb_groupifree[group] != count) {
+			warnx("Allocation group %lu: free inode count %lu "
+			      "should be %lu (fixed)", (unsigned long) group,
+			      (unsigned long) sb.sb_groupifree[group],
+			      (unsigned long) count);
+			setbadness(EXIT_RECOV);
+			sb.sb_groupifree[group] = count;
+			schanged = 1;
+		}
+	}
+
+	/* Nothing should be recorded past the last group */
+	for (; group<SFS_MAXGROUPS; group++) {
+		if (sb.sb_groupfree[group] != 0 ||
+		    sb.sb_groupifree[group] != 0) {
+			warnx("Allocation group %lu: counts past the last "
+			      "group (fixed)", (unsigned long) group);
+			setbadness(EXIT_RECOV);
+			sb.sb_groupfree[group] = 0;
+			sb.sb_groupifree[group] = 0;
+			schanged = 1;
+		}
+	}
+
+	if (schanged) {
+		sfs_writesb(SFS_SUPER_BLOCK, &sb);
+	}
+}
+
 /*
  * Return the total number of blocks in the volume.
  */
@@ -114,6 +256,81 @@ sb_freemapblocks(void)
 	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
 }
 
+/*
+ * Return true if the volume uses the packed inode table format.
+ */
+int
+sb_packed(void)
+{
+	return sb.sb_version == SFS_VERSION_PACKED;
+}
+
+/*
+ * Return one more than the largest valid inode number. In the
+ * original format inode numbers are block numbers.
+ */
+uint32_t
+sb_maxinodes(void)
+{
+	return sb_packed() ? sb.sb_ninodes : sb.sb_nblocks;
+}
+
+/*
+ * Return how many bytes of data fit inline in an inode.
+ */
+uint32_t
+sb_inlinemax(void)
+{
+	return sb_packed() ? SFS_PINLINE_MAX : SFS_INLINE_MAX;
+}
+
+/*
+ * Return the location and size of the inode bitmap and inode table
+ * (packed format only).
+ */
+uint32_t
+sb_inodemapstart(void)
+{
+	assert(sb_packed());
+	return sb.sb_inodemapstart;
+}
+
+uint32_t
+sb_inodemapblocks(void)
+{
+	assert(sb_packed());
+	return SFS_INODEMAPBLOCKS(sb.sb_ninodes);
+}
+
+uint32_t
+sb_inodetablestart(void)
+{
+	assert(sb_packed());
+	return sb.sb_inodetablestart;
+}
+
+uint32_t
+sb_inodetableblocks(void)
+{
+	assert(sb_packed());
+	return SFS_INODETABLEBLOCKS(sb.sb_ninodes);
+}
+
+/*
+ * Return the location and size of the journal (0 blocks if none).
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return sb.sb_journalstart;
+}
+
+uint32_t
+sb_journalblocks(void)
+{
+	return sb.sb_journalblocks;
+}
+
 /*
  * Return the volume name.
  */
@@ -46,10 +46,32 @@ uint32_t sb_totalblocks(void);
 /* After the superblock is loaded: return number of freemap blocks. */
 uint32_t sb_freemapblocks(void);
 
+/* After the superblock is loaded: true if it's the packed format. */
+int sb_packed(void);
+
+/* After the superblock is loaded: return 1 + the largest inode number. */
+uint32_t sb_maxinodes(void);
+
+/* After the superblock is loaded: return the inline data capacity. */
+uint32_t sb_inlinemax(void);
+
+/* Packed format: where the inode bitmap and inode table are. */
+uint32_t sb_inodemapstart(void);
+uint32_t sb_inodemapblocks(void);
+uint32_t sb_inodetablestart(void);
+uint32_t sb_inodetableblocks(void);
+
+/* Where the journal is; it has 0 blocks if there isn't one. */
+uint32_t sb_journalstart(void);
+uint32_t sb_journalblocks(void);
+
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
+/* Check the allocation group counts. Call after fixing the bitmaps. */
+void sb_check_groups(void);
+
 #endif /* SB_H */
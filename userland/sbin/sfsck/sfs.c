@@ -40,6 +40,7 @@
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
+#include "sb.h"
 #include "main.h"
 
 ////////////////////////////////////////////////////////////
@@ -60,8 +61,23 @@ static
 void
 swapsb(struct sfs_superblock *sb)
 {
+	unsigned i;
+
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_version = SWAP32(sb->sb_version);
+	sb->sb_ninodes = SWAP32(sb->sb_ninodes);
+	sb->sb_inodemapstart = SWAP32(sb->sb_inodemapstart);
+	sb->sb_inodetablestart = SWAP32(sb->sb_inodetablestart);
+	sb->sb_ngroups = SWAP32(sb->sb_ngroups);
+	sb->sb_groupblocks = SWAP32(sb->sb_groupblocks);
+	sb->sb_groupinodes = SWAP32(sb->sb_groupinodes);
+	for (i=0; i<SFS_MAXGROUPS; i++) {
+		sb->sb_groupfree[i] = SWAP32(sb->sb_groupfree[i]);
+		sb->sb_groupifree[i] = SWAP32(sb->sb_groupifree[i]);
+	}
+	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
 }
 
 static
@@ -81,6 +97,7 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
@@ -227,21 +244,64 @@ sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 }
 
 /*
- *  inodes - ino is an inode number, which is a disk block number.
+ * inode bitmap blocks (packed format) - whichblock is a block number
+ * within the inode bitmap.
+ */
+
+void
+sfs_readinodemapblock(uint32_t whichblock, uint8_t *bits)
+{
+	diskread(bits, sb_inodemapstart() + whichblock);
+	swapbits(bits);
+}
+
+void
+sfs_writeinodemapblock(uint32_t whichblock, uint8_t *bits)
+{
+	swapbits(bits);
+	diskwrite(bits, sb_inodemapstart() + whichblock);
+	swapbits(bits);
+}
+
+/*
+ *  inodes - ino is an inode number. In the original format that's a
+ *  disk block number; in the packed format it's a slot in the inode
+ *  table, and only the first SFS_PINODESIZE bytes of the inode are
+ *  stored.
  */
 
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	diskread(sfi, ino);
+	char buf[SFS_BLOCKSIZE];
+
+	if (!sb_packed()) {
+		diskread(sfi, ino);
+	}
+	else {
+		diskread(buf, sb_inodetablestart() + ino / SFS_INOPB);
+		bzero(sfi, sizeof(*sfi));
+		memcpy(sfi, buf + (ino % SFS_INOPB) * SFS_PINODESIZE,
+		       SFS_PINODESIZE);
+	}
 	swapinode(sfi);
 }
 
 void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
+	char buf[SFS_BLOCKSIZE];
+
 	swapinode(sfi);
-	diskwrite(sfi, ino);
+	if (!sb_packed()) {
+		diskwrite(sfi, ino);
+	}
+	else {
+		diskread(buf, sb_inodetablestart() + ino / SFS_INOPB);
+		memcpy(buf + (ino % SFS_INOPB) * SFS_PINODESIZE, sfi,
+		       SFS_PINODESIZE);
+		diskwrite(buf, sb_inodetablestart() + ino / SFS_INOPB);
+	}
 	swapinode(sfi);
 }
 
@@ -267,6 +327,74 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 ////////////////////////////////////////////////////////////
 // directory I/O
 
+/*
+ * Hashed directory support. sfs_dirhash must match the kernel.
+ */
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+/*
+ * Read word WORD of file block FILEBLOCK of a directory; holes read
+ * as 0.
+ */
+uint32_t
+sfs_readdirword(const struct sfs_dinode *sfi, uint32_t fileblock,
+		uint32_t word)
+{
+	uint32_t data[SFS_BLOCKSIZE / sizeof(uint32_t)];
+
+	assert(word < SFS_BLOCKSIZE / sizeof(uint32_t));
+	sfs_readfileblock(sfi, fileblock, data);
+	return SWAP32(data[word]);
+}
+
+/*
+ * Read file block FILEBLOCK of SFI, without byte-swapping. Holes read
+ * as zeros.
+ */
+void
+sfs_readfileblock(const struct sfs_dinode *sfi, uint32_t fileblock,
+		  void *data)
+{
+	uint32_t diskblock;
+
+	diskblock = bmap(sfi, fileblock);
+	if (diskblock == 0) {
+		bzero(data, SFS_BLOCKSIZE);
+	}
+	else {
+		diskread(data, diskblock);
+	}
+}
+
+/*
+ * Number of directory entries sfs_readdir will produce: the whole
+ * file for a flat directory, the bucket contents for a hashed one.
+ */
+unsigned
+sfs_dir_nentries(const struct sfs_dinode *sfi)
+{
+	uint32_t nblocks;
+
+	if (sfi->sfi_flags & SFS_IFLAG_HASHED) {
+		nblocks = sfi->sfi_size / SFS_BLOCKSIZE;
+		if (nblocks < SFS_DIRHASH_FIRSTBUCKET) {
+			return 0;
+		}
+		return (nblocks - SFS_DIRHASH_FIRSTBUCKET) *
+			SFS_DIRHASH_PERBUCKET;
+	}
+	return sfi->sfi_size / sizeof(struct sfs_direntry);
+}
+
 /*
  * Read the directory block at DISKBLOCK into D.
  */
@@ -304,6 +432,30 @@ sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 	struct sfs_direntry buffer[atonce];
 	uint32_t diskblock;
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		/* The entries are in the inode */
+		assert(nd * sizeof(*d) <= sizeof(sfi->sfi_inline));
+		memcpy(d, sfi->sfi_inline, nd * sizeof(*d));
+		for (j=0; j<nd; j++) {
+			swapdir(&d[j]);
+		}
+		return;
+	}
+
+	if (sfi->sfi_flags & SFS_IFLAG_HASHED) {
+		/* The entries are the bucket contents, in bucket order */
+		assert(nd % SFS_DIRHASH_PERBUCKET == 0);
+		for (i=0; i<nd / SFS_DIRHASH_PERBUCKET; i++) {
+			diskblock = bmap(sfi, SFS_DIRHASH_FIRSTBUCKET + i);
+			sfs_readdirblock(buffer, diskblock);
+			/* slot 0 is the bucket header */
+			for (j=0; j<SFS_DIRHASH_PERBUCKET; j++) {
+				d[i*SFS_DIRHASH_PERBUCKET + j] = buffer[1+j];
+			}
+		}
+		return;
+	}
+
 	left = nd;
 	for (i=0; i<nblocks; i++) {
 		diskblock = bmap(sfi, i);
@@ -358,9 +510,12 @@ sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
  * Write out a directory, from the inode SFI, using D, which is a
  * buffer with ND slots. The caller is assumed to have set the inode
  * size accordingly.
+ *
+ * If the directory is inline, the entries go into SFI instead, and
+ * we return 1 to tell the caller to write the inode back.
  */
-void
-sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
+int
+sfs_writedir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
 	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
@@ -369,6 +524,31 @@ sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 	struct sfs_direntry buffer[atonce];
 	uint32_t diskblock;
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		assert(nd * sizeof(*d) <= sizeof(sfi->sfi_inline));
+		for (j=0; j<nd; j++) {
+			buffer[0] = d[j];
+			swapdir(&buffer[0]);
+			memcpy(sfi->sfi_inline + j * sizeof(*d), &buffer[0],
+			       sizeof(*d));
+		}
+		return 1;
+	}
+
+	if (sfi->sfi_flags & SFS_IFLAG_HASHED) {
+		/* Put the entries back, keeping the bucket headers */
+		assert(nd % SFS_DIRHASH_PERBUCKET == 0);
+		for (i=0; i<nd / SFS_DIRHASH_PERBUCKET; i++) {
+			diskblock = bmap(sfi, SFS_DIRHASH_FIRSTBUCKET + i);
+			sfs_readdirblock(buffer, diskblock);
+			for (j=0; j<SFS_DIRHASH_PERBUCKET; j++) {
+				buffer[1+j] = d[i*SFS_DIRHASH_PERBUCKET + j];
+			}
+			sfs_writedirblock(buffer, diskblock);
+		}
+		return 0;
+	}
+
 	left = nd;
 	for (i=0; i<nblocks; i++) {
 		diskblock = bmap(sfi, i);
@@ -389,6 +569,7 @@ sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 		left -= thismany;
 	}
 	assert(left == 0);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -443,16 +624,15 @@ sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector)
 }
 
 /*
- * Try to add an entry NAME/INO to D (which has ND entries) by
- * finding an empty slot. Cannot allocate new space.
- *
- * Returns 0 on success and nonzero on failure.
+ * Put NAME/INO in the first empty slot of D between FIRST and LAST.
  */
+static
 int
-sfsdir_tryadd(struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
+sfsdir_tryslots(struct sfs_direntry *d, int first, int last,
+		const char *name, uint32_t ino)
 {
 	int i;
-	for (i=0; i<nd; i++) {
+	for (i=first; i<last; i++) {
 		if (d[i].sfd_ino==SFS_NOINO) {
 			d[i].sfd_ino = ino;
 			assert(strlen(name) < sizeof(d[i].sfd_name));
@@ -462,3 +642,51 @@ sfsdir_tryadd(struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
 	}
 	return -1;
 }
+
+/*
+ * Try to add an entry NAME/INO to D (which has ND entries, loaded
+ * from the directory SFI) by finding an empty slot. Cannot allocate
+ * new space.
+ *
+ * In a hashed directory the entry can only go in the bucket chain
+ * its hash selects.
+ *
+ * Returns 0 on success and nonzero on failure.
+ */
+int
+sfsdir_tryadd(const struct sfs_dinode *sfi, struct sfs_direntry *d, int nd,
+	      const char *name, uint32_t ino)
+{
+	const uint32_t perblock = SFS_BLOCKSIZE / sizeof(uint32_t);
+	uint32_t depth, ix, block, nblocks, n;
+	int first;
+
+	if (!(sfi->sfi_flags & SFS_IFLAG_HASHED)) {
+		return sfsdir_tryslots(d, 0, nd, name, ino);
+	}
+
+	depth = sfs_readdirword(sfi, 0, 1);
+	if (depth > SFS_DIRHASH_MAXDEPTH) {
+		return -1;
+	}
+	ix = sfs_dirhash(name) & ((1U << depth) - 1);
+	block = sfs_readdirword(sfi, 1 + ix / perblock, ix % perblock);
+
+	/* Follow the chain, but not around in circles */
+	nblocks = sfi->sfi_size / SFS_BLOCKSIZE;
+	for (n = 0; n < nblocks; n++) {
+		if (block < SFS_DIRHASH_FIRSTBUCKET || block >= nblocks) {
+			break;
+		}
+		first = (block - SFS_DIRHASH_FIRSTBUCKET) *
+			SFS_DIRHASH_PERBUCKET;
+		assert(first + (int)SFS_DIRHASH_PERBUCKET <= nd);
+		if (sfsdir_tryslots(d, first, first + SFS_DIRHASH_PERBUCKET,
+				    name, ino) == 0) {
+			return 0;
+		}
+		/* db_next is word 1 of the bucket */
+		block = sfs_readdirword(sfi, block, 1);
+	}
+	return -1;
+}
@@ -57,6 +57,10 @@ void sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb);
 void sfs_readfreemapblock(uint32_t whichblock, uint8_t *bits);
 void sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits);
 
+/* inode bitmap blocks (packed format); whichblock starts at 0 */
+void sfs_readinodemapblock(uint32_t whichblock, uint8_t *bits);
+void sfs_writeinodemapblock(uint32_t whichblock, uint8_t *bits);
+
 /* inode */
 void sfs_readinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
@@ -65,14 +69,29 @@ void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
-/* directory - ND should be the number of directory entries D points to */
+/*
+ * directory - ND should be the number of directory entries D points
+ * to. sfs_writedir returns nonzero if the directory is inline and
+ * so the inode needs to be written.
+ */
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
-void sfs_writedir(const struct sfs_dinode *sfi,
-		  struct sfs_direntry *d, unsigned nd);
+int sfs_writedir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
+
+/* directory size in entries, as loaded by sfs_readdir */
+unsigned sfs_dir_nentries(const struct sfs_dinode *sfi);
+
+/* raw file block; and one 32-bit word of a file block, byte-swapped */
+void sfs_readfileblock(const struct sfs_dinode *sfi, uint32_t fileblock,
+		       void *data);
+uint32_t sfs_readdirword(const struct sfs_dinode *sfi, uint32_t fileblock,
+			 uint32_t word);
+
+/* name hash for hashed directories */
+uint32_t sfs_dirhash(const char *name);
 
 /* Try to add an entry to a directory. */
-int sfsdir_tryadd(struct sfs_direntry *d, int nd,
-		  const char *name, uint32_t ino);
+int sfsdir_tryadd(const struct sfs_dinode *sfi, struct sfs_direntry *d,
+		  int nd, const char *name, uint32_t ino);
 
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2026
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+
+/*
+ * Test for the positional and vectored I/O calls: pread, pwrite,
+ * readv, writev, preadv, and pwritev.
+ *
+ * Checks that the p* calls transfer at the offset they're given and
+ * leave the seek position alone, that the vectored calls go through
+ * their buffers in order, and that the calls fail the way they should
+ * on a console (ESPIPE) and on bad arguments (EINVAL).
+ */
+
+#define TESTFILE "prwtestfile"
+
+static const char *slogans[] = {
+	"QUO USQUE TANDEM ABUTERE CATILINA PATENTIA NOSTRA",
+	"QUEM IN FINEM SESE EFFRENATA IACTABIT AUDACIA",
+	"NIHILNE TE NOCTURNUM PRAESIDIUM PALATI",
+};
+
+static
+void
+check_count(const char *what, ssize_t r, size_t expected)
+{
+	if (r < 0) {
+		err(1, "%s", what);
+	}
+	if ((size_t)r != expected) {
+		errx(1, "%s: result %zd bytes, expected %zu",
+		     what, r, expected);
+	}
+}
+
+static
+void
+check_data(const char *what, const char *buf, const char *expected,
+	   size_t len)
+{
+	if (memcmp(buf, expected, len) != 0) {
+		warnx("%s: got wrong data", what);
+		warnx("expected: %.*s", (int)len, expected);
+		errx(1, "found: %.*s", (int)len, buf);
+	}
+}
+
+static
+void
+check_fails(const char *what, ssize_t r, int expected)
+{
+	if (r >= 0) {
+		errx(1, "%s: expected failure but got %zd", what, r);
+	}
+	if (errno != expected) {
+		err(1, "%s: wrong error (expected %s)", what,
+		    strerror(expected));
+	}
+}
+
+static
+void
+check_seekpos(int fd, off_t expected)
+{
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos == -1) {
+		err(1, "lseek(fd, 0, SEEK_CUR)");
+	}
+	if (pos != expected) {
+		errx(1, "Seek position moved (got 0x%llx, expected 0x%llx)",
+		     pos, expected);
+	}
+}
+
+/*
+ * pwrite the slogans at scattered offsets, in reverse order, and
+ * pread them back out of order.
+ */
+static
+void
+test_positional(int fd)
+{
+	static const off_t offsets[] = { 0x10, 0x1000, 0x3123 };
+	char buf[64];
+	size_t len;
+	ssize_t r;
+	int i;
+
+	printf("Testing pwrite/pread\n");
+	for (i=2; i>=0; i--) {
+		len = strlen(slogans[i]);
+		r = pwrite(fd, slogans[i], len, offsets[i]);
+		check_count("pwrite", r, len);
+		check_seekpos(fd, 0);
+	}
+
+	for (i=0; i<3; i++) {
+		len = strlen(slogans[(i + 1) % 3]);
+		r = pread(fd, buf, len, offsets[(i + 1) % 3]);
+		check_count("pread", r, len);
+		check_data("pread", buf, slogans[(i + 1) % 3], len);
+		check_seekpos(fd, 0);
+	}
+
+	/* The hole before the first slogan should read back as zeros. */
+	r = pread(fd, buf, 0x10, 0);
+	check_count("pread", r, 0x10);
+	for (i=0; i<0x10; i++) {
+		if (buf[i] != 0) {
+			errx(1, "pread: buf[%d] was 0x%x, expected 0", i,
+			     (unsigned char)buf[i]);
+		}
+	}
+
+	/* And the seek position should still be usable as normal. */
+	if (lseek(fd, 0x1000, SEEK_SET) == -1) {
+		err(1, "lseek");
+	}
+	len = strlen(slogans[1]);
+	r = read(fd, buf, len);
+	check_count("read", r, len);
+	check_data("read", buf, slogans[1], len);
+	check_seekpos(fd, 0x1000 + len);
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		err(1, "lseek");
+	}
+}
+
+/*
+ * writev/pwritev the three slogans in one call each, then read them
+ * back with readv/preadv into buffers of different lengths, so each
+ * buffer boundary falls at a different point than the one it was
+ * written at.
+ */
+static
+void
+test_vectored(int fd)
+{
+	struct iovec iov[3];
+	char all[256], buf[256];
+	size_t total, len;
+	ssize_t r;
+	int i;
+
+	total = 0;
+	for (i=0; i<3; i++) {
+		len = strlen(slogans[i]);
+		memcpy(all + total, slogans[i], len);
+		iov[i].iov_base = (void *)slogans[i];
+		iov[i].iov_len = len;
+		total += len;
+	}
+
+	printf("Testing writev/readv\n");
+	r = writev(fd, iov, 3);
+	check_count("writev", r, total);
+	check_seekpos(fd, total);
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		err(1, "lseek");
+	}
+	memset(buf, 0, sizeof(buf));
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 7;
+	iov[1].iov_base = buf + 7;
+	iov[1].iov_len = 60;
+	iov[2].iov_base = buf + 67;
+	iov[2].iov_len = total - 67;
+	r = readv(fd, iov, 3);
+	check_count("readv", r, total);
+	check_data("readv", buf, all, total);
+	check_seekpos(fd, total);
+
+	printf("Testing pwritev/preadv\n");
+	for (i=0; i<3; i++) {
+		iov[i].iov_base = (void *)slogans[2 - i];
+		iov[i].iov_len = strlen(slogans[2 - i]);
+	}
+	r = pwritev(fd, iov, 3, 0x2000);
+	check_count("pwritev", r, total);
+	check_seekpos(fd, total);
+
+	/* slogans 2, 1, 0 on disk land at buf+200, buf+100, buf+0 */
+	memset(buf, 0, sizeof(buf));
+	iov[0].iov_len = strlen(slogans[2]);
+	iov[1].iov_len = strlen(slogans[1]);
+	iov[2].iov_len = strlen(slogans[0]);
+	iov[0].iov_base = buf + 200;
+	iov[1].iov_base = buf + 100;
+	iov[2].iov_base = buf;
+	r = preadv(fd, iov, 3, 0x2000);
+	check_count("preadv", r, total);
+	check_data("preadv", buf, slogans[0], strlen(slogans[0]));
+	check_data("preadv", buf + 100, slogans[1], strlen(slogans[1]));
+	check_data("preadv", buf + 200, slogans[2], strlen(slogans[2]));
+	check_seekpos(fd, total);
+}
+
+static
+void
+test_badargs(int fd)
+{
+	static struct iovec iov[IOV_MAX + 1];
+	char buf[16];
+	ssize_t r;
+	int i;
+
+	printf("Testing bad arguments\n");
+	for (i=0; i<IOV_MAX + 1; i++) {
+		iov[i].iov_base = buf;
+		iov[i].iov_len = 0;
+	}
+
+	r = pread(fd, buf, sizeof(buf), -1);
+	check_fails("pread at -1", r, EINVAL);
+	r = pwrite(fd, buf, sizeof(buf), -1);
+	check_fails("pwrite at -1", r, EINVAL);
+	r = preadv(fd, iov, 1, -1);
+	check_fails("preadv at -1", r, EINVAL);
+	r = pwritev(fd, iov, 1, -1);
+	check_fails("pwritev at -1", r, EINVAL);
+
+	r = readv(fd, iov, 0);
+	check_fails("readv with iovcnt 0", r, EINVAL);
+	r = writev(fd, iov, 0);
+	check_fails("writev with iovcnt 0", r, EINVAL);
+	r = preadv(fd, iov, 0, 0);
+	check_fails("preadv with iovcnt 0", r, EINVAL);
+	r = pwritev(fd, iov, 0, 0);
+	check_fails("pwritev with iovcnt 0", r, EINVAL);
+
+	r = readv(fd, iov, IOV_MAX + 1);
+	check_fails("readv with iovcnt IOV_MAX+1", r, EINVAL);
+	r = writev(fd, iov, IOV_MAX + 1);
+	check_fails("writev with iovcnt IOV_MAX+1", r, EINVAL);
+	r = preadv(fd, iov, IOV_MAX + 1, 0);
+	check_fails("preadv with iovcnt IOV_MAX+1", r, EINVAL);
+	r = pwritev(fd, iov, IOV_MAX + 1, 0);
+	check_fails("pwritev with iovcnt IOV_MAX+1", r, EINVAL);
+
+	/* IOV_MAX itself is fine */
+	r = readv(fd, iov, IOV_MAX);
+	check_count("readv with iovcnt IOV_MAX", r, 0);
+}
+
+static
+void
+test_console(void)
+{
+	struct iovec iov;
+	char buf[16];
+	ssize_t r;
+	int fd;
+
+	printf("Testing the console (should get ESPIPE)\n");
+	fd = open("con:", O_RDWR);
+	if (fd < 0) {
+		err(1, "con:");
+	}
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+
+	r = pread(fd, buf, sizeof(buf), 0);
+	check_fails("pread on con:", r, ESPIPE);
+	r = pwrite(fd, "x", 1, 0);
+	check_fails("pwrite on con:", r, ESPIPE);
+	r = preadv(fd, &iov, 1, 0);
+	check_fails("preadv on con:", r, ESPIPE);
+	r = pwritev(fd, &iov, 1, 0);
+	check_fails("pwritev on con:", r, ESPIPE);
+
+	close(fd);
+}
+
+int
+main(void)
+{
+	int fd;
+
+	printf("Creating file...\n");
+	fd = open(TESTFILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+
+	test_positional(fd);
+	test_vectored(fd);
+	test_badargs(fd);
+	test_console();
+
+	printf("Passed.\n");
+
+	close(fd);
+	remove(TESTFILE);
+	return 0;
+}